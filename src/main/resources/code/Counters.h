@@ -0,0 +1,151 @@
+#ifndef COUNTERS_H_
+#define COUNTERS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#   include <linux/perf_event.h>
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Hardware performance counters for a kernel thread.
+ * The counters are opened as one group on the calling thread so that
+ * they are scheduled together.  The counts are scaled if the kernel had
+ * to multiplex the group.  Counters that are not available read as
+ * zero.  The descriptors stay open until the process exits so that the
+ * counts can be read from other threads after the kernel stops.
+ */
+#define SP_COUNTER_CYCLES           0
+#define SP_COUNTER_INSTRUCTIONS     1
+#define SP_COUNTER_LLC_MISSES       2
+#define SP_COUNTER_BRANCH_MISSES    3
+#define SP_COUNTER_COUNT            4
+
+typedef struct {
+    int open;                       /**< Set if the group is open. */
+    int fd[SP_COUNTER_COUNT];       /**< Descriptor for each counter. */
+    int index[SP_COUNTER_COUNT];    /**< Position in the group (-1 if none). */
+    int size;                       /**< Number of counters in the group. */
+} SPCounters;
+
+#ifdef __linux__
+
+/** Open the counters for the calling thread.
+ * @return Non-zero if the counters are available.
+ */
+static inline int sp_counters_open(SPCounters *c)
+{
+    static const uint64_t configs[SP_COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    c->open = 0;
+    c->size = 0;
+    for(int i = 0; i < SP_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP
+                         | PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        const int leader = i == 0 ? -1 : c->fd[0];
+        c->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+        if(c->fd[i] >= 0) {
+            c->index[i] = c->size;
+            c->size += 1;
+        } else if(i == 0) {
+            return 0;
+        } else {
+            c->index[i] = -1;
+        }
+    }
+    c->open = 1;
+    return 1;
+}
+
+/** Reset and start counting. */
+static inline void sp_counters_start(SPCounters *c)
+{
+    if(c->open) {
+        ioctl(c->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(c->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+/** Stop counting. */
+static inline void sp_counters_stop(SPCounters *c)
+{
+    if(c->open) {
+        ioctl(c->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+/** Read the counts.
+ * This is safe to call from any thread.
+ * @param values The counts, indexed by SP_COUNTER_*.
+ * @return Non-zero if the counters are available.
+ */
+static inline int sp_counters_read(SPCounters *c, uint64_t *values)
+{
+    memset(values, 0, SP_COUNTER_COUNT * sizeof(uint64_t));
+    if(!c->open) {
+        return 0;
+    }
+    uint64_t data[3 + SP_COUNTER_COUNT];
+    const ssize_t size = (3 + c->size) * sizeof(uint64_t);
+    if(read(c->fd[0], data, size) != size) {
+        return 0;
+    }
+    const double scale = data[2] > 0 ? (double)data[1] / data[2] : 1.0;
+    for(int i = 0; i < SP_COUNTER_COUNT; i++) {
+        if(c->index[i] >= 0) {
+            values[i] = (uint64_t)(data[3 + c->index[i]] * scale);
+        }
+    }
+    return 1;
+}
+
+#else
+
+static inline int sp_counters_open(SPCounters *c)
+{
+    c->open = 0;
+    return 0;
+}
+
+static inline void sp_counters_start(SPCounters *c)
+{
+}
+
+static inline void sp_counters_stop(SPCounters *c)
+{
+}
+
+static inline int sp_counters_read(SPCounters *c, uint64_t *values)
+{
+    memset(values, 0, SP_COUNTER_COUNT * sizeof(uint64_t));
+    return 0;
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
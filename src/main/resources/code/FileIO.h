@@ -0,0 +1,384 @@
+#ifndef FILEIO_H_
+#define FILEIO_H_
+
+#include "ScalaPipe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Streaming file I/O for source and sink kernels.
+ * A file is moved in fixed-size blocks through a ring of readahead
+ * buffers.  An I/O thread keeps the ring full (reading) or drains it
+ * (writing) while the kernel copies records in and out of the current
+ * block, so the kernel only waits when the disk cannot keep up.  The
+ * file is opened with O_DIRECT when the block size allows it so that
+ * large files do not go through the page cache; files on filesystems
+ * without O_DIRECT support are read and written through the cache.
+ */
+#define SP_FILE_READ        0
+#define SP_FILE_WRITE       1
+#define SP_FILE_ALIGN       4096
+
+typedef struct SPFile {
+    int fd;
+    int mode;               /**< SP_FILE_READ or SP_FILE_WRITE. */
+    int direct;             /**< Set if O_DIRECT is in effect. */
+    uint32_t block_size;
+    uint32_t count;         /**< Number of blocks in the ring. */
+    char *buffers;          /**< Ring of count blocks. */
+    uint32_t *sizes;        /**< Bytes in each block. */
+    uint32_t put;           /**< Blocks filled (free-running). */
+    uint32_t take;          /**< Blocks emptied (free-running). */
+    uint32_t offset;        /**< Kernel position in its current block. */
+    uint32_t done;          /**< Set at end of file or once closed. */
+    uint32_t stop;          /**< Set to stop a reader early. */
+    SPWait io_wait;         /**< I/O thread waiting on the kernel. */
+    SPWait kernel_wait;     /**< Kernel waiting on the I/O thread. */
+    pthread_t thread;
+    struct SPFile *next;    /**< Next open writer. */
+} SPFile;
+
+/** Writers to flush at exit. */
+static SPFile *sp_file_writers = NULL;
+static pthread_mutex_t sp_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline char *sp_file_block(SPFile *f, uint32_t index)
+{
+    return &f->buffers[(size_t)(index % f->count) * f->block_size];
+}
+
+/** Wait until cond holds, re-checking after every spw_wait call. */
+#define SP_FILE_WAIT(w, cond)                   \
+    do {                                        \
+        SPWaitState state;                      \
+        spw_start(&state);                      \
+        while(!(cond)) {                        \
+            spw_wait(w, &state);                \
+        }                                       \
+    } while(0)
+
+/** Turn off O_DIRECT for requests it cannot handle. */
+static inline void sp_file_buffered(SPFile *f)
+{
+    if(f->direct) {
+        fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) & ~O_DIRECT);
+        f->direct = 0;
+    }
+}
+
+/** Body of the reading I/O thread. */
+static inline void *sp_file_read_thread(void *arg)
+{
+    SPFile *f = (SPFile*)arg;
+    off_t pos = 0;
+    for(;;) {
+        SP_FILE_WAIT(&f->io_wait,
+                     f->put - sp_load_acquire(&f->take) < f->count
+                     || sp_load_acquire(&f->stop));
+        if(sp_load_acquire(&f->stop)) {
+            break;
+        }
+        char *ptr = sp_file_block(f, f->put);
+        ssize_t rc = pread(f->fd, ptr, f->block_size, pos);
+        if(rc < 0 && errno == EINVAL && f->direct) {
+            sp_file_buffered(f);
+            continue;
+        } else if(rc < 0 && errno == EINTR) {
+            continue;
+        } else if(rc < 0) {
+            perror("pread");
+            exit(-1);
+        } else if(rc == 0) {
+            break;
+        }
+        pos += rc;
+        f->sizes[f->put % f->count] = rc;
+        sp_store_release(&f->put, f->put + 1);
+        spw_signal(&f->kernel_wait);
+    }
+    sp_store_release(&f->done, 1);
+    spw_signal(&f->kernel_wait);
+    return NULL;
+}
+
+/** Body of the writing I/O thread. */
+static inline void *sp_file_write_thread(void *arg)
+{
+    SPFile *f = (SPFile*)arg;
+    for(;;) {
+        SP_FILE_WAIT(&f->io_wait,
+                     f->take != sp_load_acquire(&f->put)
+                     || sp_load_acquire(&f->done));
+        if(f->take == sp_load_acquire(&f->put)) {
+            break;
+        }
+        const char *ptr = sp_file_block(f, f->take);
+        size_t size = f->sizes[f->take % f->count];
+        if(size % SP_FILE_ALIGN) {
+            sp_file_buffered(f);
+        }
+        while(size > 0) {
+            const ssize_t rc = write(f->fd, ptr, size);
+            if(rc < 0 && errno == EINVAL && f->direct) {
+                sp_file_buffered(f);
+                continue;
+            } else if(rc < 0 && errno == EINTR) {
+                continue;
+            } else if(rc < 0) {
+                perror("write");
+                exit(-1);
+            }
+            ptr += rc;
+            size -= rc;
+        }
+        sp_store_release(&f->take, f->take + 1);
+        spw_signal(&f->kernel_wait);
+    }
+    return NULL;
+}
+
+static inline void sp_file_flush_all(void);
+
+/** Open a file for streaming.
+ * @param mode SP_FILE_READ or SP_FILE_WRITE.
+ * @param block_size Bytes per read or write.
+ * @param readahead Blocks to keep in flight.
+ * @return The file (NULL on error).
+ */
+static inline SPFile *sp_file_open(const char *name, int mode,
+                                   uint32_t block_size, uint32_t readahead)
+{
+    const int flags = mode == SP_FILE_WRITE
+                    ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    SPFile *f = (SPFile*)calloc(1, sizeof(SPFile));
+    f->mode = mode;
+    f->block_size = block_size > 0 ? block_size : SP_FILE_ALIGN;
+    f->count = readahead > 1 ? readahead : 2;
+    f->direct = (f->block_size % SP_FILE_ALIGN) == 0;
+    f->fd = -1;
+#ifdef O_DIRECT
+    if(f->direct) {
+        f->fd = open(name, flags | O_DIRECT, 0644);
+    }
+#endif
+    if(f->fd < 0) {
+        f->direct = 0;
+        f->fd = open(name, flags, 0644);
+    }
+    if(f->fd < 0) {
+        free(f);
+        return NULL;
+    }
+    void *ptr = NULL;
+    if(posix_memalign(&ptr, SP_FILE_ALIGN,
+                      (size_t)f->count * f->block_size)) {
+        close(f->fd);
+        free(f);
+        return NULL;
+    }
+    f->buffers = (char*)ptr;
+    f->sizes = (uint32_t*)calloc(f->count, sizeof(uint32_t));
+    spw_init(&f->io_wait);
+    spw_init(&f->kernel_wait);
+    if(mode == SP_FILE_WRITE) {
+        pthread_mutex_lock(&sp_file_lock);
+        if(sp_file_writers == NULL) {
+            atexit(sp_file_flush_all);
+        }
+        f->next = sp_file_writers;
+        sp_file_writers = f;
+        pthread_mutex_unlock(&sp_file_lock);
+        pthread_create(&f->thread, NULL, sp_file_write_thread, f);
+    } else {
+        pthread_create(&f->thread, NULL, sp_file_read_thread, f);
+    }
+    return f;
+}
+
+/** Read a record.
+ * @return 1 on success, 0 at the end of the file.
+ */
+static inline int sp_file_read(SPFile *f, void *dest, uint32_t size)
+{
+    char *out = (char*)dest;
+    while(size > 0) {
+        if(SPUNLIKELY(f->offset == 0)) {
+            SP_FILE_WAIT(&f->kernel_wait,
+                         f->take != sp_load_acquire(&f->put)
+                         || sp_load_acquire(&f->done));
+            if(f->take == sp_load_acquire(&f->put)) {
+                return 0;
+            }
+        }
+        const uint32_t block_bytes = f->sizes[f->take % f->count];
+        const uint32_t avail = block_bytes - f->offset;
+        const uint32_t n = size < avail ? size : avail;
+        memcpy(out, sp_file_block(f, f->take) + f->offset, n);
+        out += n;
+        size -= n;
+        f->offset += n;
+        if(f->offset == block_bytes) {
+            f->offset = 0;
+            sp_store_release(&f->take, f->take + 1);
+            spw_signal(&f->io_wait);
+        }
+    }
+    return 1;
+}
+
+/** Pass the current block to the writing I/O thread. */
+static inline void sp_file_send(SPFile *f)
+{
+    f->sizes[f->put % f->count] = f->offset;
+    f->offset = 0;
+    sp_store_release(&f->put, f->put + 1);
+    spw_signal(&f->io_wait);
+}
+
+/** Write a record. */
+static inline void sp_file_write(SPFile *f, const void *src, uint32_t size)
+{
+    const char *in = (const char*)src;
+    while(size > 0) {
+        if(SPUNLIKELY(f->offset == 0)) {
+            SP_FILE_WAIT(&f->kernel_wait,
+                         f->put - sp_load_acquire(&f->take) < f->count);
+        }
+        const uint32_t room = f->block_size - f->offset;
+        const uint32_t n = size < room ? size : room;
+        memcpy(sp_file_block(f, f->put) + f->offset, in, n);
+        in += n;
+        size -= n;
+        f->offset += n;
+        if(f->offset == f->block_size) {
+            sp_file_send(f);
+        }
+    }
+}
+
+/** Close a file.
+ * Writers are flushed.  This is called at exit for writers that are
+ * still open, since sink kernels run until their inputs end.
+ */
+static inline void sp_file_close(SPFile *f)
+{
+    if(f->mode == SP_FILE_WRITE) {
+        pthread_mutex_lock(&sp_file_lock);
+        SPFile **p = &sp_file_writers;
+        while(*p != NULL && *p != f) {
+            p = &(*p)->next;
+        }
+        if(*p != NULL) {
+            *p = f->next;
+        }
+        pthread_mutex_unlock(&sp_file_lock);
+        if(f->offset > 0) {
+            sp_file_send(f);
+        }
+        sp_store_release(&f->done, 1);
+        spw_signal(&f->io_wait);
+    } else {
+        sp_store_release(&f->stop, 1);
+        spw_signal(&f->io_wait);
+    }
+    pthread_join(f->thread, NULL);
+    close(f->fd);
+    free(f->buffers);
+    free(f->sizes);
+    free(f);
+}
+
+/** Flush and close writers that are still open. */
+static inline void sp_file_flush_all(void)
+{
+    while(sp_file_writers != NULL) {
+        sp_file_close(sp_file_writers);
+    }
+}
+
+/** Read-only file mapping for mapped source kernels.
+ * Records are handed out by pointer into the mapping, which stays
+ * mapped until the process exits so that downstream kernels can read
+ * through the pointers after the source is done.  The operating system
+ * is asked to read ahead of the current position one window at a time.
+ */
+#define SP_MAP_WINDOW       (4 << 20)
+#define SP_MAP_PREFETCH     256
+
+typedef struct {
+    char *data;
+    size_t size;            /**< Bytes in the file. */
+    size_t offset;          /**< Next record. */
+    size_t advised;         /**< End of the read-ahead window. */
+} SPMap;
+
+/** Map a file for sequential reading.
+ * @param huge_pages Set to ask for transparent huge pages.
+ * @return The mapping (NULL on error).
+ */
+static inline SPMap *sp_map_open(const char *name, int huge_pages)
+{
+    const int fd = open(name, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    SPMap *m = (SPMap*)calloc(1, sizeof(SPMap));
+    m->size = st.st_size;
+    if(m->size > 0) {
+        void *ptr = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(ptr == MAP_FAILED) {
+            close(fd);
+            free(m);
+            return NULL;
+        }
+        m->data = (char*)ptr;
+        madvise(m->data, m->size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+        if(huge_pages) {
+            madvise(m->data, m->size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    close(fd);
+    return m;
+}
+
+/** Get the next record.
+ * @return A pointer into the mapping (NULL at the end of the file).
+ */
+static inline void *sp_map_next(SPMap *m, size_t size)
+{
+    if(SPUNLIKELY(m->offset + size > m->size)) {
+        return NULL;
+    }
+    char *ptr = &m->data[m->offset];
+    m->offset += size;
+    if(SPUNLIKELY(m->offset >= m->advised && m->advised < m->size)) {
+        const size_t start = m->advised & ~(size_t)(SP_FILE_ALIGN - 1);
+        const size_t end = m->advised + SP_MAP_WINDOW;
+        const size_t length = (end < m->size ? end : m->size) - start;
+        madvise(&m->data[start], length, MADV_WILLNEED);
+        m->advised = start + length;
+    }
+    __builtin_prefetch(ptr + SP_MAP_PREFETCH);
+    return ptr;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
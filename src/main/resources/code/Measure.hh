@@ -4,8 +4,79 @@
 #include "TimeTrial.hh"
 #include "Stat.hh"
 
-#include <list>
-#include <map>
+#include <vector>
+
+/** Fixed-capacity ring of time stamps.
+ * The capacity is a power of two and storage is only allocated by
+ * Reserve, so pushing and popping never allocate.
+ */
+class TimeRing {
+public:
+
+    TimeRing()
+    {
+        Reserve(1);
+    }
+
+    /** Allocate room for at least count time stamps.
+     * This discards anything in the ring.
+     */
+    void Reserve(size_t count)
+    {
+        size_t size = 1;
+        while(size < count) {
+            size <<= 1;
+        }
+        m_data.assign(size, 0);
+        m_mask = size - 1;
+        m_head = 0;
+        m_tail = 0;
+    }
+
+    bool Empty() const
+    {
+        return m_head == m_tail;
+    }
+
+    bool Full() const
+    {
+        return m_tail - m_head > m_mask;
+    }
+
+    size_t Size() const
+    {
+        return m_tail - m_head;
+    }
+
+    void Clear()
+    {
+        m_head = m_tail;
+    }
+
+    uint64_t Front() const
+    {
+        return m_data[m_head & m_mask];
+    }
+
+    void PopFront()
+    {
+        m_head += 1;
+    }
+
+    void PushBack(uint64_t t)
+    {
+        m_data[m_tail & m_mask] = t;
+        m_tail += 1;
+    }
+
+private:
+
+    std::vector<uint64_t> m_data;
+    uint64_t m_mask;
+    uint64_t m_head;
+    uint64_t m_tail;
+
+};
 
 class Measure {
 public:
@@ -13,7 +84,8 @@ public:
     Measure(Stat *stat, bool hardware) :
         m_stat(stat),
         m_hardware(hardware),
-        m_software(!hardware)
+        m_software(!hardware),
+        m_slack(0)
     {
     }
 
@@ -26,6 +98,14 @@ public:
         m_stat->Stop();
     }
 
+    /** Set how many events may arrive out of order.
+     * This is called before the startup event is processed.
+     */
+    void SetSlack(size_t slack)
+    {
+        m_slack = slack;
+    }
+
     /** This function is called once per second. */
     virtual void Tick(double diff)
     {
@@ -70,6 +150,9 @@ public:
         case TTA_TYPE_HINTERPOP:
             ProcessHInterPop(entry);
             break;
+        case TTA_TYPE_LOST:
+            ProcessLost(entry);
+            break;
         default:
             break;
         }
@@ -121,9 +204,15 @@ protected:
     {
     }
 
+    virtual void ProcessLost(const TTAEntry *entry)
+    {
+        m_stat->Lost(entry->value);
+    }
+
     Stat *m_stat;
     const bool m_hardware;
     const bool m_software;
+    size_t m_slack;         /**< Events that may arrive out of order. */
 
 };
 
@@ -174,6 +263,23 @@ private:
 
 };
 
+/** Record the time between events.
+ * Log-scale stats get nanoseconds.  Others get microseconds clamped to
+ * 10000 so that they can be used as a bin number.
+ */
+static inline void RecordInterval(Stat *stat, uint64_t diff_ns)
+{
+    if(stat->IsLogScale()) {
+        stat->Record(1, diff_ns);
+    } else {
+        uint64_t value = diff_ns / 1000;
+        if(value > 10000) {
+            value = 10000;
+        }
+        stat->Record(1, value);
+    }
+}
+
 class MeasureInterPush : public Measure {
 public:
 
@@ -185,7 +291,11 @@ public:
     MeasureInterPush(Stat *stat, bool hw) : Measure(stat, hw)
     {
         m_last_time = 0;
-        stat->SetXLabel("Bin Number");
+        if(stat->IsLogScale()) {
+            stat->SetXLabel("Nanoseconds");
+        } else {
+            stat->SetXLabel("Bin Number");
+        }
     }
 
 protected:
@@ -194,11 +304,7 @@ protected:
     {
         if(m_software) {
             if(m_last_time > 0) {
-                uint64_t value = (entry->time_ns - m_last_time) / 1000;
-                if(value > 10000) {
-                    value = 10000;
-                }
-                m_stat->Record(1, value);
+                RecordInterval(m_stat, entry->time_ns - m_last_time);
             }
             m_last_time = entry->time_ns;
         }
@@ -236,7 +342,11 @@ public:
     MeasureInterPop(Stat *stat, bool hw) : Measure(stat, hw)
     {
         m_last_time = 0;
-        stat->SetXLabel("Bin Number");
+        if(stat->IsLogScale()) {
+            stat->SetXLabel("Nanoseconds");
+        } else {
+            stat->SetXLabel("Bin Number");
+        }
     }
 
 protected:
@@ -247,11 +357,7 @@ protected:
             // Note that we only measure pops when the queue is non-empty.
             if(entry->value == 0) {
                 if(m_last_time > 0) {
-                    uint64_t value = (entry->time_ns - m_last_time) / 1000;
-                    if(value > 10000) {
-                        value = 10000;
-                    }
-                    m_stat->Record(1, value);
+                    RecordInterval(m_stat, entry->time_ns - m_last_time);
                 }
                 m_last_time = entry->time_ns;
             }
@@ -339,7 +445,8 @@ public:
     {
         stat->SetXLabel("Occupancy");
         m_depth = 0;
-        m_time_map[0] = 0;
+        m_last_time = 0;
+        m_unmatched = 0;
     }
 
     virtual void Stop(double diff)
@@ -349,16 +456,9 @@ public:
 
         // Note that there shouldn't be any pushes left here.
 
-        while(!m_pops.empty() && m_depth > 0) {
-            const uint64_t t = m_pops.front();
-            m_pops.pop_front();
-
-            const uint64_t current = t - m_time_map[m_depth];
-            m_depth -= 1;
-            m_time_map[m_depth] = t;
-
-            m_stat->Record(current, m_depth);
-
+        while(!m_pops.Empty() && m_depth > 0) {
+            Pop(m_pops.Front());
+            m_pops.PopFront();
         }
 
         Measure::Stop(diff);
@@ -367,10 +467,22 @@ public:
 
 protected:
 
+    virtual void ProcessStart(const TTAStartup *start)
+    {
+        m_pushes.Reserve(start->queue_depth + m_slack);
+        m_pops.Reserve(start->queue_depth + m_slack);
+    }
+
     virtual void ProcessPush(const TTAEntry *entry)
     {
         if(m_software) {
-            m_pushes.push_back(entry->time_ns);
+            // If the ring is full, the pops are too far behind to wait
+            // for, so assume they come after the oldest push.
+            if(m_pushes.Full()) {
+                Push(m_pushes.Front());
+                m_pushes.PopFront();
+            }
+            m_pushes.PushBack(entry->time_ns);
             Replay();
         }
     }
@@ -378,7 +490,11 @@ protected:
     virtual void ProcessPop(const TTAEntry *entry)
     {
         if(m_software) {
-            m_pops.push_back(entry->time_ns);
+            if(m_pops.Full()) {
+                Pop(m_pops.Front());
+                m_pops.PopFront();
+            }
+            m_pops.PushBack(entry->time_ns);
             Replay();
         }
     }
@@ -400,52 +516,70 @@ protected:
 
 private:
 
+    /** Record the time spent at the current depth up to t.
+     * A forced push or pop can be replayed ahead of events with earlier
+     * times, so times before the last change are clamped to it.
+     */
+    void Advance(uint64_t t)
+    {
+        if(t < m_last_time) {
+            t = m_last_time;
+        }
+        if(m_last_time > 0) {
+            m_stat->Record(t - m_last_time, m_depth);
+        }
+        m_last_time = t;
+    }
+
+    void Push(uint64_t push)
+    {
+        if(m_unmatched > 0) {
+            // This push belongs to a pop that was already dropped.
+            m_unmatched -= 1;
+            return;
+        }
+        Advance(push);
+        m_depth += 1;
+    }
+
+    void Pop(uint64_t pop)
+    {
+        if(m_depth == 0) {
+            // A forced pop got ahead of its push.  Drop the pair so
+            // that the depth does not drift.
+            m_unmatched += 1;
+            m_stat->Lost(1);
+            return;
+        }
+        Advance(pop);
+        m_depth -= 1;
+    }
+
     void Replay()
     {
 
         // While the queues can be changing, we need both
         // a push and a pop to be present.
-        while(!m_pushes.empty() && !m_pops.empty()) {
+        while(!m_pushes.Empty() && !m_pops.Empty()) {
 
-            const uint64_t push = m_pushes.front();
-            const uint64_t pop  = m_pops.front();
-            const uint64_t t = m_time_map[m_depth];
+            const uint64_t push = m_pushes.Front();
+            const uint64_t pop  = m_pops.Front();
             if(pop < push) {
-
-                // Process the pop.
-                m_pops.pop_front();
-
-                if(m_depth > 0) {
-                    if(t > 0) {
-                        const uint64_t current = pop - t;
-                        m_stat->Record(current, m_depth);
-                    }
-                    m_depth -= 1;
-                    m_time_map[m_depth] = pop;
-                }
-
+                m_pops.PopFront();
+                Pop(pop);
             } else {
-
-                // Process the push.
-                m_pushes.pop_front();
-
-                if(t > 0) {
-                    const uint64_t current = push - t;
-                    m_stat->Record(current, m_depth);
-                }
-                m_depth += 1;
-                m_time_map[m_depth] = push;
-
+                m_pushes.PopFront();
+                Push(push);
             }
 
-
         }
     }
 
-    std::list<uint64_t> m_pushes;
-    std::list<uint64_t> m_pops;
-    std::map<uint64_t, uint64_t> m_time_map;
+    TimeRing m_pushes;
+    TimeRing m_pops;
     uint64_t m_depth;
+    uint64_t m_last_time;   /**< Time of the last change in depth. */
+    uint64_t m_unmatched;   /**< Pushes of dropped pops to skip. */
 
 };
 
@@ -461,14 +595,20 @@ public:
     {
         stat->SetXLabel("Nanoseconds");
         m_full = 0;
+        m_skip = 0;
     }
 
 protected:
 
+    virtual void ProcessStart(const TTAStartup *start)
+    {
+        m_pushes.Reserve(start->queue_depth + m_slack);
+    }
+
     virtual void ProcessFull(const TTAEntry *entry)
     {
         if(m_software) {
-            m_pushes.push_back(entry->time_ns);
+            Push(entry->time_ns);
             m_full += 1;
         }
     }
@@ -477,7 +617,7 @@ protected:
     {
         if(m_software) {
             if(m_full == 0) {
-                m_pushes.push_back(entry->time_ns);
+                Push(entry->time_ns);
             }
         }
     }
@@ -485,9 +625,14 @@ protected:
     virtual void ProcessPop(const TTAEntry *entry)
     {
         if(m_software) {
-            if(!m_pushes.empty()) {
-                const uint64_t push_time = m_pushes.front();
-                m_pushes.pop_front();
+            if(m_skip > 0) {
+                m_skip -= 1;
+                if(m_full > 0) {
+                    m_full -= 1;
+                }
+            } else if(!m_pushes.Empty()) {
+                const uint64_t push_time = m_pushes.Front();
+                m_pushes.PopFront();
                 const uint64_t diff_time = entry->time_ns - push_time;
                 if(m_full > 0) {
                     m_full -= 1;
@@ -499,8 +644,23 @@ protected:
 
 private:
 
-    std::list<uint64_t> m_pushes;
+    void Push(uint64_t t)
+    {
+        // If the pops are too far behind, drop the pending pushes along
+        // with this one and skip their pops so that pairing resumes.
+        if(SPUNLIKELY(m_pushes.Full())) {
+            const uint64_t count = m_pushes.Size() + 1;
+            m_pushes.Clear();
+            m_skip += count;
+            m_stat->Lost(count);
+            return;
+        }
+        m_pushes.PushBack(t);
+    }
+
+    TimeRing m_pushes;
     uint64_t m_full;
+    uint64_t m_skip;        /**< Pops of dropped pushes to skip. */
 
 };
 
@@ -0,0 +1,175 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Live metrics.
+ * A running process publishes its metrics in a POSIX shared memory
+ * segment named by sp_metrics_name.  The segment starts with an
+ * SPMetrics header followed by the kernel, queue, and tap arrays.
+ * Kernel and queue values are updated together under a sequence lock:
+ * seq is odd while an update is in progress.  Tap values are updated
+ * separately by the TimeTrial agent.
+ */
+#define SP_METRICS_MAGIC    0x4D505053  // "SPPM"
+#define SP_METRICS_VERSION  2
+#define SP_METRICS_NAME     64
+#define SP_METRICS_COUNTERS 4   // Matches SP_COUNTER_COUNT.
+
+typedef struct {
+    char name[SP_METRICS_NAME];
+    uint64_t ticks;         /**< Ticks spent running. */
+    uint64_t reads;         /**< Items read. */
+    uint64_t counters[SP_METRICS_COUNTERS]; /**< Hardware counts (or 0). */
+} SPMetricsKernel;
+
+typedef struct {
+    char name[SP_METRICS_NAME];
+    uint32_t depth;         /**< Depth of the queue. */
+    uint32_t used;          /**< Items in the queue. */
+} SPMetricsQueue;
+
+typedef struct {
+    char name[SP_METRICS_NAME];
+    uint32_t tap_id;        /**< TimeTrial tap. */
+    uint32_t reserved;
+    uint64_t events;        /**< Events processed by the agent. */
+    uint64_t lost;          /**< Events lost to the overflow policy. */
+} SPMetricsTap;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t kernel_count;
+    uint32_t queue_count;
+    uint32_t tap_count;
+    uint32_t pad;
+    uint64_t seq;               /**< Odd while an update is in progress. */
+    uint64_t ticks;             /**< Ticks since startup. */
+    uint64_t ticks_per_second;  /**< Timebase of the process. */
+} SPMetrics;
+
+/** Get the name of the segment for a process. */
+static inline void sp_metrics_name(char *name, size_t size, int pid)
+{
+    snprintf(name, size, "/scalapipe.%d", pid);
+}
+
+/** Determine the size of a segment. */
+static inline size_t sp_metrics_size(uint32_t kernels, uint32_t queues,
+                                     uint32_t taps)
+{
+    return sizeof(SPMetrics)
+         + kernels * sizeof(SPMetricsKernel)
+         + queues * sizeof(SPMetricsQueue)
+         + taps * sizeof(SPMetricsTap);
+}
+
+static inline SPMetricsKernel *sp_metrics_kernels(SPMetrics *m)
+{
+    return (SPMetricsKernel*)&m[1];
+}
+
+static inline SPMetricsQueue *sp_metrics_queues(SPMetrics *m)
+{
+    return (SPMetricsQueue*)&sp_metrics_kernels(m)[m->kernel_count];
+}
+
+static inline SPMetricsTap *sp_metrics_taps(SPMetrics *m)
+{
+    return (SPMetricsTap*)&sp_metrics_queues(m)[m->queue_count];
+}
+
+/** Create the segment for this process.
+ * @return The segment (NULL on error).
+ */
+static inline SPMetrics *sp_metrics_create(uint32_t kernels,
+                                           uint32_t queues,
+                                           uint32_t taps)
+{
+    char name[64];
+    sp_metrics_name(name, sizeof(name), getpid());
+    const size_t size = sp_metrics_size(kernels, queues, taps);
+    const int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if(fd < 0) {
+        return NULL;
+    }
+    if(ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    SPMetrics *m = (SPMetrics*)ptr;
+    memset(m, 0, size);
+    m->kernel_count = kernels;
+    m->queue_count = queues;
+    m->tap_count = taps;
+    m->version = SP_METRICS_VERSION;
+    __atomic_store_n(&m->magic, SP_METRICS_MAGIC, __ATOMIC_RELEASE);
+    return m;
+}
+
+/** Remove the segment for this process.
+ * The mapping stays valid until the process exits since other threads
+ * may still be publishing.
+ */
+static inline void sp_metrics_remove(SPMetrics *m)
+{
+    char name[64];
+    sp_metrics_name(name, sizeof(name), getpid());
+    shm_unlink(name);
+}
+
+/** Start an update. */
+static inline void sp_metrics_begin(SPMetrics *m)
+{
+    __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/** Finish an update. */
+static inline void sp_metrics_end(SPMetrics *m)
+{
+    __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+}
+
+/** Copy a consistent snapshot of a segment.
+ * @param dest Buffer of at least size bytes.
+ */
+static inline void sp_metrics_read(SPMetrics *m, void *dest, size_t size)
+{
+    for(;;) {
+        const uint64_t seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+        if((seq & 1) == 0) {
+            memcpy(dest, m, size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == seq) {
+                return;
+            }
+        }
+        sched_yield();
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
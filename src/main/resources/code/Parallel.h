@@ -0,0 +1,312 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include "ScalaPipe.h"
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Work-stealing pool for the replicas of a stateless kernel.
+ * Each replica runs the kernel on its own thread.  A replica takes
+ * items from its own deque, steals from the other replicas when its
+ * deque is empty, and only then claims a new batch from the input.
+ * Every item read starts a firing with the sequence number of that
+ * item.  The output of each firing is buffered and released to the
+ * output in sequence order, so the output stream matches that of a
+ * single instance.
+ */
+
+/** Default number of items to claim from the input at a time. */
+#ifndef SPP_BATCH
+#   define SPP_BATCH 16
+#endif
+
+/** Output buffer for a firing. */
+typedef struct {
+    char *data;
+    int count;              /**< Number of items. */
+    int capacity;           /**< Capacity in items. */
+} SPPBuffer;
+
+/** State for a replica. */
+typedef struct {
+    pthread_mutex_t lock;   /**< Protects the deque. */
+    uint64_t base;          /**< Sequence number of the first item. */
+    int head;               /**< Index of the next item to take. */
+    int tail;               /**< Index past the last item. */
+    char *items;            /**< Deque items. */
+    SPPBuffer buffer;       /**< Output of the current firing. */
+    uint64_t seq;           /**< Sequence number of the current firing. */
+    int active;             /**< Set while a firing is in progress. */
+    char pad[SP_CACHE_LINE];
+} SPPReplica;
+
+/** A replica pool. */
+typedef struct {
+    int replicas;
+    int batch;
+    int window;             /**< Maximum firings waiting for output. */
+    int in_width;
+    int out_width;
+    int (*fill)(char *dest, int max);
+    void (*drain)(const char *src, int count);
+
+    pthread_mutex_t in_lock;
+    uint64_t next_seq;      /**< Sequence number of the next item read. */
+    int done;               /**< Set once the input is finished. */
+
+    pthread_mutex_t out_lock;
+    pthread_cond_t out_cond;
+    uint64_t next_out;      /**< Sequence number of the next firing out. */
+    int draining;           /**< Set while a replica is draining. */
+    SPPBuffer *slots;
+    char *ready;
+
+    SPPReplica *state;
+} SPPool;
+
+/** Make room for count more items in an output buffer. */
+static inline void spp_reserve(SPPBuffer *b, int width, int count)
+{
+    if(SPUNLIKELY(b->count + count > b->capacity)) {
+        int capacity = b->capacity > 0 ? b->capacity * 2 : 16;
+        while(capacity < b->count + count) {
+            capacity *= 2;
+        }
+        b->data = (char*)realloc(b->data, (size_t)capacity * width);
+        b->capacity = capacity;
+    }
+}
+
+/** Initialize a replica pool.
+ * @param p The pool.
+ * @param replicas The number of replicas.
+ * @param batch Items to claim from the input at a time (0 for default).
+ * @param in_width The size of an input item.
+ * @param out_width The size of an output item.
+ * @param fill Function to read up to max items from the input,
+ *  returning 0 once the input is finished.
+ * @param drain Function to write items to the output.
+ */
+static inline void spp_init(SPPool *p, int replicas, int batch,
+                            int in_width, int out_width,
+                            int (*fill)(char*, int),
+                            void (*drain)(const char*, int))
+{
+    p->replicas = replicas;
+    p->batch = batch > 1 ? batch : SPP_BATCH;
+    p->window = 4 * replicas * p->batch;
+    p->in_width = in_width;
+    p->out_width = out_width;
+    p->fill = fill;
+    p->drain = drain;
+    pthread_mutex_init(&p->in_lock, NULL);
+    p->next_seq = 0;
+    p->done = 0;
+    pthread_mutex_init(&p->out_lock, NULL);
+    pthread_cond_init(&p->out_cond, NULL);
+    p->next_out = 0;
+    p->draining = 0;
+    p->slots = (SPPBuffer*)calloc(p->window, sizeof(SPPBuffer));
+    p->ready = (char*)calloc(p->window, 1);
+    p->state = (SPPReplica*)calloc(replicas, sizeof(SPPReplica));
+    for(int i = 0; i < replicas; i++) {
+        SPPReplica *r = &p->state[i];
+        pthread_mutex_init(&r->lock, NULL);
+        r->items = (char*)malloc((size_t)p->batch * in_width);
+    }
+}
+
+/** Release resources used by a replica pool. */
+static inline void spp_destroy(SPPool *p)
+{
+    for(int i = 0; i < p->replicas; i++) {
+        SPPReplica *r = &p->state[i];
+        pthread_mutex_destroy(&r->lock);
+        free(r->items);
+        free(r->buffer.data);
+    }
+    for(int i = 0; i < p->window; i++) {
+        free(p->slots[i].data);
+    }
+    pthread_mutex_destroy(&p->in_lock);
+    pthread_mutex_destroy(&p->out_lock);
+    pthread_cond_destroy(&p->out_cond);
+    free(p->slots);
+    free(p->ready);
+    free(p->state);
+}
+
+/** Hand the output of the current firing to the reorder window.
+ * The firing next in sequence is written out along with any
+ * firings after it that are already complete.
+ */
+static inline void spp_deposit(SPPool *p, int id)
+{
+    SPPReplica *r = &p->state[id];
+    if(!r->active) {
+        return;
+    }
+    r->active = 0;
+
+    pthread_mutex_lock(&p->out_lock);
+    while(r->seq >= p->next_out + p->window) {
+        pthread_cond_wait(&p->out_cond, &p->out_lock);
+    }
+
+    // Swap buffers with the (empty) slot to avoid a copy.
+    const int slot = (int)(r->seq % p->window);
+    SPPBuffer temp = p->slots[slot];
+    p->slots[slot] = r->buffer;
+    r->buffer = temp;
+    p->ready[slot] = 1;
+
+    if(!p->draining) {
+        p->draining = 1;
+        for(;;) {
+            const int next = (int)(p->next_out % p->window);
+            if(!p->ready[next]) {
+                break;
+            }
+            SPPBuffer *b = &p->slots[next];
+            pthread_mutex_unlock(&p->out_lock);
+            if(b->count > 0) {
+                p->drain(b->data, b->count);
+            }
+            pthread_mutex_lock(&p->out_lock);
+            b->count = 0;
+            p->ready[next] = 0;
+            p->next_out += 1;
+            pthread_cond_broadcast(&p->out_cond);
+        }
+        p->draining = 0;
+    }
+    pthread_mutex_unlock(&p->out_lock);
+}
+
+/** Steal the newest half of the items from another replica.
+ * @return Non-zero if items were stolen.
+ */
+static inline int spp_steal(SPPool *p, int id)
+{
+    SPPReplica *r = &p->state[id];
+    for(int i = 1; i < p->replicas; i++) {
+        SPPReplica *v = &p->state[(id + i) % p->replicas];
+        pthread_mutex_lock(&v->lock);
+        const int size = v->tail - v->head;
+        if(size > 0) {
+
+            // Our deque is empty, so the items can be copied
+            // without holding our lock.
+            const int count = (size + 1) / 2;
+            const int start = v->tail - count;
+            const uint64_t base = v->base + start;
+            memcpy(r->items, v->items + (size_t)start * p->in_width,
+                   (size_t)count * p->in_width);
+            v->tail = start;
+            pthread_mutex_unlock(&v->lock);
+
+            pthread_mutex_lock(&r->lock);
+            r->base = base;
+            r->head = 0;
+            r->tail = count;
+            pthread_mutex_unlock(&r->lock);
+            return 1;
+
+        }
+        pthread_mutex_unlock(&v->lock);
+    }
+    return 0;
+}
+
+/** Claim a batch of items from the input.
+ * @return Zero once the input is finished.
+ */
+static inline int spp_refill(SPPool *p, int id)
+{
+    SPPReplica *r = &p->state[id];
+    int count = 0;
+    pthread_mutex_lock(&p->in_lock);
+    if(!p->done) {
+        count = p->fill(r->items, p->batch);
+        if(count > 0) {
+            pthread_mutex_lock(&r->lock);
+            r->base = p->next_seq;
+            r->head = 0;
+            r->tail = count;
+            pthread_mutex_unlock(&r->lock);
+            p->next_seq += count;
+        } else {
+            p->done = 1;
+        }
+    }
+    pthread_mutex_unlock(&p->in_lock);
+    return count;
+}
+
+/** Finish the current firing and start the next.
+ * @return A pointer to the input item or NULL if there is no more input.
+ */
+static inline void *spp_read(SPPool *p, int id)
+{
+    SPPReplica *r = &p->state[id];
+    spp_deposit(p, id);
+    for(;;) {
+        pthread_mutex_lock(&r->lock);
+        if(r->head < r->tail) {
+            const int index = r->head;
+            r->head += 1;
+            r->seq = r->base + index;
+            r->active = 1;
+            pthread_mutex_unlock(&r->lock);
+            return r->items + (size_t)index * p->in_width;
+        }
+        pthread_mutex_unlock(&r->lock);
+        if(spp_steal(p, id)) {
+            continue;
+        }
+        if(!spp_refill(p, id)) {
+            return NULL;
+        }
+    }
+}
+
+/** Get the number of items queued for a replica. */
+static inline int spp_available(SPPool *p, int id)
+{
+    SPPReplica *r = &p->state[id];
+    pthread_mutex_lock(&r->lock);
+    const int result = r->tail - r->head;
+    pthread_mutex_unlock(&r->lock);
+    return result;
+}
+
+/** Allocate space for output items for the current firing.
+ * @param count The number of items (all are always granted).
+ */
+static inline void *spp_allocate(SPPool *p, int id, int *count)
+{
+    SPPBuffer *b = &p->state[id].buffer;
+    spp_reserve(b, p->out_width, *count);
+    return b->data + (size_t)b->count * p->out_width;
+}
+
+/** Commit output items for the current firing. */
+static inline void spp_send(SPPool *p, int id, int count)
+{
+    p->state[id].buffer.count += count;
+}
+
+/** Finish the current firing of an exiting replica. */
+static inline void spp_exit(SPPool *p, int id)
+{
+    spp_deposit(p, id);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef REPORT_H_
+#define REPORT_H_
+
+#include "Timebase.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Bottleneck report.
+ * The report combines the kernel clocks with edge fill levels sampled
+ * while the pipeline runs.  A stage that limits throughput is busy most
+ * of the time with full input queues and empty output queues, while the
+ * stages around it spend their time waiting on it.
+ *
+ * The same samples make up a queue profile: the fill distribution of
+ * each edge, which the generator reads back to size the queues.
+ */
+
+/** Buckets in the fill histogram (bucket b holds fills < 2^b). */
+#define SP_REPORT_BUCKETS   33
+
+typedef struct {
+    const char *name;
+    uint64_t ticks;         /**< Ticks spent running (0 if not timed). */
+    uint64_t input_ticks;   /**< Ticks spent waiting for input. */
+    uint64_t output_ticks;  /**< Ticks spent waiting for output space. */
+    uint64_t reads;         /**< Items read. */
+} SPReportKernel;
+
+typedef struct {
+    const char *name;
+    int source;             /**< Index of the source kernel (-1 if remote). */
+    int dest;               /**< Index of the destination kernel. */
+    uint32_t depth;         /**< Depth of the queue. */
+    uint32_t width;         /**< Size of an item in bytes. */
+    uint64_t fill;          /**< Sum of the sampled fill levels. */
+    uint64_t max;           /**< Largest sampled fill level. */
+    uint64_t full;          /**< Samples within 1/8 of the depth. */
+    uint64_t hist[SP_REPORT_BUCKETS];
+} SPReportEdge;
+
+typedef struct {
+    SPReportKernel *kernels;
+    uint32_t kernel_count;
+    SPReportEdge *edges;
+    uint32_t edge_count;
+    uint64_t samples;       /**< Number of times edges were sampled. */
+    uint64_t ticks;         /**< Total ticks. */
+    int timed;              /**< Set if kernel ticks are available. */
+} SPReport;
+
+/** Record the fill level of an edge. */
+static inline void sp_report_sample(SPReportEdge *e, uint32_t used)
+{
+    e->fill += used;
+    if(used > e->max) {
+        e->max = used;
+    }
+    if(used + e->depth / 8 >= e->depth) {
+        e->full += 1;
+    }
+    e->hist[used == 0 ? 0 : 32 - __builtin_clz(used)] += 1;
+}
+
+/** Get a fill level that a fraction of the samples are at or below. */
+static inline uint64_t sp_report_percentile(const SPReport *r,
+                                            const SPReportEdge *e,
+                                            double fraction)
+{
+    const uint64_t target = (uint64_t)(fraction * r->samples);
+    uint64_t count = 0;
+    for(int b = 0; b < SP_REPORT_BUCKETS; b++) {
+        count += e->hist[b];
+        if(count >= target && count > 0) {
+            const uint64_t upper = b == 0 ? 0 : (1ULL << b) - 1;
+            return upper < e->max ? upper : e->max;
+        }
+    }
+    return e->max;
+}
+
+/** Get the average fill of an edge (0 to 1). */
+static inline double sp_report_fill(const SPReport *r, const SPReportEdge *e)
+{
+    if(r->samples == 0 || e->depth == 0) {
+        return 0.0;
+    }
+    return (double)e->fill / ((double)r->samples * e->depth);
+}
+
+/** Get the fraction of time a kernel was busy.
+ * Without kernel ticks, this is the time not spent waiting.
+ */
+static inline double sp_report_busy(const SPReport *r,
+                                    const SPReportKernel *k)
+{
+    if(r->ticks == 0) {
+        return 0.0;
+    }
+    if(r->timed) {
+        return (double)k->ticks / r->ticks;
+    }
+    const uint64_t waiting = k->input_ticks + k->output_ticks;
+    return waiting < r->ticks ? 1.0 - (double)waiting / r->ticks : 0.0;
+}
+
+/** Get the average fill of the inputs (in) or outputs (!in) of a kernel.
+ * @return The average fill (-1 if there are no such edges).
+ */
+static inline double sp_report_kernel_fill(const SPReport *r, int kernel,
+                                           int in)
+{
+    double total = 0.0;
+    int count = 0;
+    for(uint32_t i = 0; i < r->edge_count; i++) {
+        const SPReportEdge *e = &r->edges[i];
+        if((in ? e->dest : e->source) == kernel) {
+            total += sp_report_fill(r, e);
+            count += 1;
+        }
+    }
+    return count > 0 ? total / count : -1.0;
+}
+
+static const SPReport *sp_report_sort_data;
+
+static inline int sp_report_compare(const void *a, const void *b)
+{
+    const SPReport *r = sp_report_sort_data;
+    const double ba = sp_report_busy(r, &r->kernels[*(const int*)a]);
+    const double bb = sp_report_busy(r, &r->kernels[*(const int*)b]);
+    return ba < bb ? 1 : (ba > bb ? -1 : 0);
+}
+
+/** Print a fill level (or "-" if there are no edges). */
+static inline void sp_report_print_fill(FILE *fd, double fill)
+{
+    if(fill < 0.0) {
+        fprintf(fd, "       -");
+    } else {
+        fprintf(fd, " %6.1f%%", 100.0 * fill);
+    }
+}
+
+/** Print the report. */
+static inline void sp_report_print(FILE *fd, const SPReport *r)
+{
+
+    const double seconds = (double)sp_ticks_to_ns(r->ticks) / 1e9;
+
+    fprintf(fd, "Bottleneck report:\n");
+    fprintf(fd, "  %-32s %7s %7s %7s %7s %7s %12s\n", "Kernel",
+            "busy", "in", "out", "in-q", "out-q", "reads/s");
+    for(uint32_t i = 0; i < r->kernel_count; i++) {
+        const SPReportKernel *k = &r->kernels[i];
+        const double in = r->ticks > 0
+                        ? (double)k->input_ticks / r->ticks : 0.0;
+        const double out = r->ticks > 0
+                         ? (double)k->output_ticks / r->ticks : 0.0;
+        fprintf(fd, "  %-32s %6.1f%% %6.1f%% %6.1f%%", k->name,
+                100.0 * sp_report_busy(r, k), 100.0 * in, 100.0 * out);
+        sp_report_print_fill(fd, sp_report_kernel_fill(r, i, 1));
+        sp_report_print_fill(fd, sp_report_kernel_fill(r, i, 0));
+        fprintf(fd, " %12.0f\n", seconds > 0.0 ? k->reads / seconds : 0.0);
+    }
+
+    fprintf(fd, "  %-32s %7s %7s\n", "Edge", "fill", "depth");
+    for(uint32_t i = 0; i < r->edge_count; i++) {
+        const SPReportEdge *e = &r->edges[i];
+        fprintf(fd, "  %-32s %6.1f%% %7u\n", e->name,
+                100.0 * sp_report_fill(r, e), e->depth);
+    }
+
+    // Rank kernels by busy fraction.  A kernel with full inputs and
+    // empty outputs is holding up the pipeline.
+    int *order = (int*)malloc(r->kernel_count * sizeof(int));
+    for(uint32_t i = 0; i < r->kernel_count; i++) {
+        order[i] = i;
+    }
+    sp_report_sort_data = r;
+    qsort(order, r->kernel_count, sizeof(int), sp_report_compare);
+    fprintf(fd, "Bottlenecks:\n");
+    for(uint32_t i = 0; i < r->kernel_count; i++) {
+        const SPReportKernel *k = &r->kernels[order[i]];
+        const double in = sp_report_kernel_fill(r, order[i], 1);
+        const double out = sp_report_kernel_fill(r, order[i], 0);
+        const char *reason = "";
+        if(in >= 0.5 && out < 0.5) {
+            reason = " (inputs backed up)";
+        } else if(out >= 0.5) {
+            reason = " (blocked on output)";
+        } else if(in >= 0.0 && in < 0.1 && k->input_ticks > k->ticks) {
+            reason = " (starved)";
+        }
+        fprintf(fd, "  %2u. %-32s %6.1f%% busy%s\n", i + 1, k->name,
+                100.0 * sp_report_busy(r, k), reason);
+    }
+    free(order);
+
+}
+
+/** Write the queue profile.
+ * Each line gives the label, depth, item width, sample count, mean
+ * fill, maximum fill, 99th percentile fill, and the fraction of samples
+ * that were nearly full for one edge.
+ */
+static inline void sp_report_write_profile(const char *filename,
+                                           const SPReport *r)
+{
+    FILE *fd = fopen(filename, "w");
+    if(fd == NULL) {
+        fprintf(stderr, "ERROR: could not open %s\n", filename);
+        return;
+    }
+    fprintf(fd, "# edge depth width samples mean max p99 full\n");
+    for(uint32_t i = 0; i < r->edge_count; i++) {
+        const SPReportEdge *e = &r->edges[i];
+        const double samples = r->samples > 0 ? (double)r->samples : 1.0;
+        fprintf(fd, "%s %u %u %llu %.2f %llu %llu %.4f\n", e->name,
+                e->depth, e->width, (unsigned long long)r->samples,
+                e->fill / samples, (unsigned long long)e->max,
+                (unsigned long long)sp_report_percentile(r, e, 0.99),
+                e->full / samples);
+    }
+    fclose(fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
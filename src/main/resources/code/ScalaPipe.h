@@ -13,6 +13,15 @@
 #include <string.h>
 #include <sched.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Timebase.h"
+
+#ifdef __linux
+#   include <sys/syscall.h>
+#   include <linux/futex.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -47,6 +56,126 @@ static inline void sp_set_affinity(int cpu)
     }
 }
 
+/** Size of a cache line in bytes. */
+#ifndef SP_CACHE_LINE
+#   define SP_CACHE_LINE 64
+#endif
+
+/** Atomic load with acquire semantics. */
+#define sp_load_acquire( ptr ) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+
+/** Atomic store with release semantics. */
+#define sp_store_release( ptr, value ) \
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+
+/** Number of times to spin before yielding or blocking. */
+#ifndef SP_WAIT_SPINS
+#   define SP_WAIT_SPINS 1024
+#endif
+
+/** Maximum time to block before checking again (in nanoseconds). */
+#ifndef SP_WAIT_TIMEOUT_NS
+#   define SP_WAIT_TIMEOUT_NS 10000000
+#endif
+
+/** Hint to the CPU that we are spinning. */
+static inline void sp_pause()
+{
+#if defined(__i386) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+/** Spin for a while, then start yielding.
+ * @param spins The number of failed attempts so far.
+ */
+static inline void sp_spin_wait(int *spins)
+{
+    if(*spins < SP_WAIT_SPINS) {
+        *spins += 1;
+        sp_pause();
+    } else {
+        sched_yield();
+    }
+}
+
+/** Object a thread can block on until it is signaled.
+ * There may be at most one thread waiting on an SPWait at a time.
+ */
+typedef struct {
+    uint32_t seq;       /**< Futex word, incremented for each wakeup. */
+    uint32_t waiting;   /**< Set when the waiter may block. */
+} SPWait;
+
+/** State for a thread waiting on an SPWait. */
+typedef struct {
+    int spins;          /**< Number of failed attempts so far. */
+    int armed;          /**< Set if we may block on the next attempt. */
+    uint32_t seq;       /**< Sequence number when we armed. */
+} SPWaitState;
+
+/** Initialize an SPWait structure. */
+static inline void spw_init(SPWait *w)
+{
+    w->seq = 0;
+    w->waiting = 0;
+}
+
+/** Initialize an SPWaitState structure. */
+static inline void spw_start(SPWaitState *s)
+{
+    s->spins = 0;
+    s->armed = 0;
+    s->seq = 0;
+}
+
+/** Wake the waiter if there is one.
+ * This must be called after the state the waiter is waiting on has
+ * been published.
+ */
+static inline void spw_signal(SPWait *w)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(SPUNLIKELY(__atomic_load_n(&w->waiting, __ATOMIC_RELAXED))) {
+        __atomic_store_n(&w->waiting, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&w->seq, 1, __ATOMIC_RELEASE);
+#ifdef __linux
+        syscall(SYS_futex, &w->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+    }
+}
+
+/** Wait after a failed attempt to use a port.
+ * The first SP_WAIT_SPINS calls spin.  After that, calls alternate
+ * between arming the wait and blocking, so the caller must retry its
+ * operation after every call.  This allows the signaling thread to
+ * skip the wakeup entirely unless a waiter has armed.
+ */
+static inline void spw_wait(SPWait *w, SPWaitState *s)
+{
+    if(s->spins < SP_WAIT_SPINS) {
+        s->spins += 1;
+        sp_pause();
+    } else if(!s->armed) {
+        s->seq = sp_load_acquire(&w->seq);
+        __atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+        s->armed = 1;
+    } else {
+#ifdef __linux
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = SP_WAIT_TIMEOUT_NS;
+        syscall(SYS_futex, &w->seq, FUTEX_WAIT_PRIVATE, s->seq,
+                &ts, NULL, 0);
+#else
+        sched_yield();
+#endif
+        s->armed = 0;
+    }
+}
+
 /** Atomic decrement. */
 static inline void sp_decrement(volatile uint32_t *v)
 {
@@ -71,6 +200,11 @@ typedef struct {
     void *(*read_value)(int in_port);
     void  (*release)(int in_port);
 
+    void *(*allocate_n)(int out_port, int *count);
+    void  (*send_n)(int out_port, int count);
+    void *(*read_n)(int in_port, int *count);
+    void  (*release_n)(int in_port, int count);
+
     int in_port_count;
     int out_port_count;
 
@@ -118,6 +252,28 @@ typedef char       *STRING;
 #define sp_release( kernel, in_port ) \
     (sp_get_private(kernel)->release)(in_port)
 
+/** Allocate space for up to *count items on an output port.
+ * This blocks until at least one item is available and updates count
+ * to the number of contiguous items that were allocated.
+ */
+#define sp_allocate_n( kernel, out_port, count ) \
+    (sp_get_private(kernel)->allocate_n)(out_port, count)
+
+/** Send count items on an output port. */
+#define sp_send_n( kernel, out_port, count ) \
+    (sp_get_private(kernel)->send_n)(out_port, count)
+
+/** Read up to *count items from an input port.
+ * This blocks until at least one item is available and updates count
+ * to the number of contiguous items that can be read.
+ */
+#define sp_read_n( kernel, in_port, count ) \
+    (sp_get_private(kernel)->read_n)(in_port, count)
+
+/** Release count items on an input port. */
+#define sp_release_n( kernel, in_port, count ) \
+    (sp_get_private(kernel)->release_n)(in_port, count)
+
 /** Create a function to read a value from an input port. */
 #define SP_READ_FUNCTION( RTYPE, KTYPE, port ) \
     static inline RTYPE sp_read_input ## port ( struct KTYPE *kernel ) { \
@@ -126,25 +282,106 @@ typedef char       *STRING;
         return result; \
     }
 
-/** Method to get CPU ticks. */
-static inline uint64_t sp_get_ticks()
+/** Window of items on a port used for batched transfers. */
+typedef struct {
+    char *ptr;      /**< First item in the window. */
+    int used;       /**< Number of items produced or consumed. */
+    int size;       /**< Number of items in the window. */
+} SPBatch;
+
+/** Initialize a batch window. */
+static inline void spb_init(SPBatch *b)
 {
-#ifdef __x86_64
-    uint64_t a, d;
-    asm volatile("rdtsc" : "=A"(a), "=d"(d));
-    return (d << 32) | (a & 0xFFFFFFFF);
-#else
-    static uint64_t ticks = 0;
-    ticks += 1;
-    return ticks;
-#endif
+    b->ptr = NULL;
+    b->used = 0;
+    b->size = 0;
+}
+
+/** Determine if a batch window has been exhausted. */
+static inline int spb_is_empty(SPBatch *b)
+{
+    return b->used == b->size;
+}
+
+/** Get a pointer to the next item in a batch window. */
+static inline void *spb_next(SPBatch *b, size_t width)
+{
+    return b->ptr + b->used * width;
 }
 
+/* The functions below to transfer batch windows are macros so that
+ * they use the port functions in effect where they are expanded.
+ */
+
+/** Allocate a new output window (blocks if necessary). */
+#define spb_allocate( kernel, out_port, b, count ) \
+    do { \
+        (b)->size = (count); \
+        (b)->ptr = (char*)sp_allocate_n(kernel, out_port, &(b)->size); \
+        (b)->used = 0; \
+    } while(0)
+
+/** Read a new input window (blocks if necessary). */
+#define spb_read( kernel, in_port, b, count ) \
+    do { \
+        (b)->size = (count); \
+        (b)->ptr = (char*)sp_read_n(kernel, in_port, &(b)->size); \
+        (b)->used = 0; \
+    } while(0)
+
+/** Send the items produced so far in an output window.
+ * The rest of the window remains allocated.
+ */
+#define spb_flush( kernel, out_port, b, width ) \
+    do { \
+        if((b)->used > 0) { \
+            sp_send_n(kernel, out_port, (b)->used); \
+            (b)->ptr += (b)->used * (width); \
+            (b)->size -= (b)->used; \
+            (b)->used = 0; \
+        } \
+    } while(0)
+
+/** Release the items consumed so far in an input window.
+ * The rest of the window remains readable.
+ */
+#define spb_release( kernel, in_port, b, width ) \
+    do { \
+        if((b)->used > 0) { \
+            sp_release_n(kernel, in_port, (b)->used); \
+            (b)->ptr += (b)->used * (width); \
+            (b)->size -= (b)->used; \
+            (b)->used = 0; \
+        } \
+    } while(0)
+
+/** Clock modes for kernel execution time.
+ * SP_CLOCK selects the mode.  In sampled mode, only one in every
+ * SP_CLOCK_PERIOD intervals between port operations is timed and
+ * the total is extrapolated from the samples.
+ */
+#define SP_CLOCK_OFF        0
+#define SP_CLOCK_SAMPLED    1
+#define SP_CLOCK_FULL       2
+#ifndef SP_CLOCK
+#   define SP_CLOCK SP_CLOCK_FULL
+#endif
+
+/** Number of intervals per sample (must be a power of two). */
+#ifndef SP_CLOCK_PERIOD
+#   define SP_CLOCK_PERIOD 64
+#endif
+
 /** Struct for keeping track of kernel execution time. */
 typedef struct {
     uint64_t start_ticks;   /**< Start ticks of the last invocation. */
-    uint64_t total_ticks;   /**< Total number of ticks so far. */
+    uint64_t total_ticks;   /**< Total number of ticks measured so far. */
     uint64_t count;         /**< Number of invocations. */
+    uint64_t intervals;     /**< Number of intervals started. */
+    uint64_t samples;       /**< Number of intervals measured. */
+    uint64_t wait_start;    /**< Start ticks of the current wait. */
+    uint64_t input_ticks;   /**< Ticks spent waiting for input. */
+    uint64_t output_ticks;  /**< Ticks spent waiting for output space. */
 } SPC;
 
 /** Initialize an SPC structure. */
@@ -153,19 +390,82 @@ static inline void spc_init(SPC *c)
    c->start_ticks = 0;
    c->total_ticks = 0;
    c->count = 0;
+   c->intervals = 0;
+   c->samples = 0;
+   c->wait_start = 0;
+   c->input_ticks = 0;
+   c->output_ticks = 0;
 }
 
 /** Set the start ticks. */
 static inline void spc_start(SPC *c)
 {
+#if SP_CLOCK == SP_CLOCK_FULL
    c->start_ticks = sp_get_ticks();
+#elif SP_CLOCK == SP_CLOCK_SAMPLED
+   if((c->intervals & (SP_CLOCK_PERIOD - 1)) == 0) {
+      c->start_ticks = sp_get_ticks();
+   }
+   c->intervals += 1;
+#endif
 }
 
 /** Update the total. */
 static inline void spc_stop(SPC *c)
 {
+#if SP_CLOCK == SP_CLOCK_FULL
    const uint64_t t = sp_get_ticks();
    c->total_ticks += t - c->start_ticks;
+#elif SP_CLOCK == SP_CLOCK_SAMPLED
+   if(((c->intervals - 1) & (SP_CLOCK_PERIOD - 1)) == 0) {
+      const uint64_t t = sp_get_ticks();
+      c->total_ticks += t - c->start_ticks;
+      c->samples += 1;
+   }
+#endif
+}
+
+/** Get the total ticks, extrapolated from the samples if sampling. */
+static inline uint64_t spc_get_total(SPC *c)
+{
+#if SP_CLOCK == SP_CLOCK_SAMPLED
+   if(c->samples == 0) {
+      return 0;
+   }
+   return (uint64_t)((double)c->total_ticks * c->intervals / c->samples);
+#else
+   return c->total_ticks;
+#endif
+}
+
+/** Note that a port operation must wait.
+ * Waits are timed separately from the kernel clock so that blocked
+ * time can be split into time waiting for input and for output.
+ * This is only called once the first attempt fails.
+ */
+static inline void spc_wait(SPC *c)
+{
+   if(c->wait_start == 0) {
+      c->wait_start = sp_get_ticks();
+   }
+}
+
+/** Finish waiting for input, if waiting. */
+static inline void spc_input_done(SPC *c)
+{
+   if(SPUNLIKELY(c->wait_start != 0)) {
+      c->input_ticks += sp_get_ticks() - c->wait_start;
+      c->wait_start = 0;
+   }
+}
+
+/** Finish waiting for output space, if waiting. */
+static inline void spc_output_done(SPC *c)
+{
+   if(SPUNLIKELY(c->wait_start != 0)) {
+      c->output_ticks += sp_get_ticks() - c->wait_start;
+      c->wait_start = 0;
+   }
 }
 
 /** Ring buffer used for queues between kernels. */
@@ -367,12 +667,13 @@ static inline char *spq_start_write(SPQ *q, uint32_t count)
 /** Get a buffer for writing (blocking version). */
 static inline char *spq_start_blocking_write(SPQ *q, uint32_t count)
 {
+    int spins = 0;
     for(;;) {
         char *ptr = spq_start_write(q, count);
         if(ptr != NULL) {
             return ptr;
         }
-        sched_yield();
+        sp_spin_wait(&spins);
     }
 }
 
@@ -437,12 +738,13 @@ static inline uint32_t spq_start_read(SPQ *q, char **buffer)
 /** Start a read (blocking version). */
 static inline uint32_t spq_start_blocking_read(SPQ *q, char **buffer)
 {
+    int spins = 0;
     for(;;) {
         const uint32_t rc = spq_start_read(q, buffer);
         if(rc > 0) {
             return rc;
         }
-        sched_yield();
+        sp_spin_wait(&spins);
     }
 }
 
@@ -452,6 +754,322 @@ static inline void spq_finish_read(SPQ *q, uint32_t count)
     q->read_ptr += count;
 }
 
+/** Lock-free single-producer, single-consumer queue.
+ * Unlike SPQ, the read and write indices are kept on separate cache lines
+ * along with a local copy of the opposite index so that the producer and
+ * consumer only touch each other's line when the cached copy runs out.
+ * The indices are free-running and the depth must be a power of two.
+ */
+typedef struct {
+
+    /* Consumer cache line. */
+    uint32_t read_ptr;          /**< Next item to read. */
+    uint32_t write_cache;       /**< Consumer copy of write_ptr. */
+    uint8_t pad0[SP_CACHE_LINE - 8];
+
+    /* Producer cache line. */
+    uint32_t write_ptr;         /**< Next item to write. */
+    uint32_t read_cache;        /**< Producer copy of read_ptr. */
+    uint8_t pad1[SP_CACHE_LINE - 8];
+
+    /* Shared read-mostly cache line. */
+    uint16_t cookie;
+    uint16_t flags;
+    uint32_t depth;     /**< Number of items that can be put in the queue. */
+    uint32_t width;     /**< Number of bytes for each element. */
+    uint8_t pad2[SP_CACHE_LINE - 12];
+
+    char data[0];
+
+} SPAQ;
+
+/** Round a queue depth up to the next power of two. */
+static inline uint32_t spaq_round_depth(uint32_t depth)
+{
+    uint32_t result = 1;
+    while(result < depth) {
+        result <<= 1;
+    }
+    return result;
+}
+
+/** Determine how many bytes are needed for the specified queue. */
+static inline size_t spaq_get_size(uint32_t depth, uint32_t width)
+{
+    return sizeof(SPAQ) + spaq_round_depth(depth) * width;
+}
+
+/** Initialize the queue.
+ * The memory for the queue must have already been allocated.
+ */
+static inline void spaq_init(SPAQ *q, uint32_t depth, uint32_t width)
+{
+    q->read_ptr = 0;
+    q->write_cache = 0;
+    q->write_ptr = 0;
+    q->read_cache = 0;
+    q->flags = 0;
+    q->depth = spaq_round_depth(depth);
+    q->width = width;
+    q->cookie = SPQ_COOKIE;
+}
+
+/** Allocate and initialize a cache-line aligned queue.
+ * The result should be released with free.
+ */
+static inline SPAQ *spaq_create(uint32_t depth, uint32_t width)
+{
+    void *ptr = NULL;
+    if(posix_memalign(&ptr, SP_CACHE_LINE, spaq_get_size(depth, width))) {
+        return NULL;
+    }
+    spaq_init((SPAQ*)ptr, depth, width);
+    return (SPAQ*)ptr;
+}
+
+/** Mark the queue as closed. */
+static inline void spaq_close(SPAQ *q)
+{
+    q->flags |= SPQ_FLAG_CLOSED;
+}
+
+/** Determine if the queue is valid. */
+static inline int spaq_is_valid(SPAQ *q)
+{
+    return q->cookie == SPQ_COOKIE;
+}
+
+/** Determine if the queue has been closed. */
+static inline int spaq_is_closed(SPAQ *q)
+{
+    return (q->flags & SPQ_FLAG_CLOSED) != 0;
+}
+
+/** Determine how much of a queue is used. */
+static inline int spaq_get_used(SPAQ *q)
+{
+    const uint32_t read_ptr = sp_load_acquire(&q->read_ptr);
+    const uint32_t write_ptr = sp_load_acquire(&q->write_ptr);
+    return (int)(write_ptr - read_ptr);
+}
+
+/** Determine if the queue is empty. */
+static inline int spaq_is_empty(SPAQ *q)
+{
+    return spaq_get_used(q) == 0;
+}
+
+/** Determine how much space is available in the queue. */
+static inline int spaq_get_free(SPAQ *q)
+{
+    const uint32_t read_ptr = sp_load_acquire(&q->read_ptr);
+    const uint32_t write_ptr = sp_load_acquire(&q->write_ptr);
+    return (int)(q->depth - (write_ptr - read_ptr));
+}
+
+/** Get a buffer for writing up to *count items.
+ * On success, count is updated to the number of contiguous items
+ * allocated.  This will return NULL if there is no room.
+ */
+static inline char *spaq_start_write_n(SPAQ *q, uint32_t *count)
+{
+    const uint32_t write_ptr = q->write_ptr;
+    const uint32_t offset = write_ptr & (q->depth - 1);
+    uint32_t free = q->depth - (write_ptr - q->read_cache);
+    if(SPUNLIKELY(free < *count)) {
+        q->read_cache = sp_load_acquire(&q->read_ptr);
+        free = q->depth - (write_ptr - q->read_cache);
+        if(free == 0) {
+            return NULL;
+        }
+    }
+    uint32_t n = *count < free ? *count : free;
+    if(n > q->depth - offset) {
+        n = q->depth - offset;
+    }
+    *count = n;
+    return &q->data[offset * q->width];
+}
+
+/** Get a buffer for writing.
+ * This will return NULL if "count" contiguous items are not available.
+ */
+static inline char *spaq_start_write(SPAQ *q, uint32_t count)
+{
+    uint32_t n = count;
+    char *ptr = spaq_start_write_n(q, &n);
+    return n == count ? ptr : NULL;
+}
+
+/** Get a buffer for writing (blocking version). */
+static inline char *spaq_start_blocking_write(SPAQ *q, uint32_t count)
+{
+    int spins = 0;
+    for(;;) {
+        char *ptr = spaq_start_write(q, count);
+        if(ptr != NULL) {
+            return ptr;
+        }
+        sp_spin_wait(&spins);
+    }
+}
+
+/** Finish a write. */
+static inline void spaq_finish_write(SPAQ *q, uint32_t count)
+{
+    sp_store_release(&q->write_ptr, q->write_ptr + count);
+}
+
+/** Start a read.
+ * This function does not block.  It returns the number of contiguous
+ * items available.
+ */
+static inline uint32_t spaq_start_read(SPAQ *q, char **buffer)
+{
+    const uint32_t read_ptr = q->read_ptr;
+    const uint32_t offset = read_ptr & (q->depth - 1);
+    uint32_t count = q->write_cache - read_ptr;
+    if(count == 0) {
+        q->write_cache = sp_load_acquire(&q->write_ptr);
+        count = q->write_cache - read_ptr;
+        if(count == 0) {
+            return 0;
+        }
+    }
+    if(count > q->depth - offset) {
+        count = q->depth - offset;
+    }
+    *buffer = &q->data[offset * q->width];
+    return count;
+}
+
+/** Start a read (blocking version). */
+static inline uint32_t spaq_start_blocking_read(SPAQ *q, char **buffer)
+{
+    int spins = 0;
+    for(;;) {
+        const uint32_t rc = spaq_start_read(q, buffer);
+        if(rc > 0) {
+            return rc;
+        }
+        sp_spin_wait(&spins);
+    }
+}
+
+/** Finish a read. */
+static inline void spaq_finish_read(SPAQ *q, uint32_t count)
+{
+    sp_store_release(&q->read_ptr, q->read_ptr + count);
+}
+
+/** Queue for an edge between fused kernels.
+ * Both kernels run on the same thread and the producer only runs when
+ * the consumer finds the queue empty, so the queue is normally drained
+ * between items.  It grows if the producer sends more than depth items
+ * in one step.  The growth is not capped since the consumer cannot run
+ * until the step is done, so a producer that sends an unbounded number
+ * of items in one step uses unbounded memory.
+ */
+typedef struct {
+    char *data;
+    uint32_t head;      /**< Index of the next item to read. */
+    uint32_t tail;      /**< Index of the next item to write. */
+    uint32_t depth;     /**< Capacity in items. */
+    uint32_t width;     /**< Size of each item. */
+} SPLQ;
+
+/** Allocate and initialize a fused queue. */
+static inline SPLQ *splq_create(uint32_t depth, uint32_t width)
+{
+    SPLQ *q = (SPLQ*)malloc(sizeof(SPLQ));
+    if(SPUNLIKELY(q == NULL)) {
+        perror("splq_create");
+        exit(-1);
+    }
+    q->depth = depth > 0 ? depth : 1;
+    q->width = width;
+    q->head = 0;
+    q->tail = 0;
+    q->data = (char*)malloc((size_t)q->depth * width);
+    if(SPUNLIKELY(q->data == NULL)) {
+        perror("splq_create");
+        exit(-1);
+    }
+    return q;
+}
+
+/** Release a fused queue. */
+static inline void splq_destroy(SPLQ *q)
+{
+    free(q->data);
+    free(q);
+}
+
+/** Determine how much of a fused queue is used. */
+static inline int splq_get_used(SPLQ *q)
+{
+    return q->tail - q->head;
+}
+
+/** Determine how much space is available in a fused queue.
+ * There is always room for one more item since the queue grows.
+ */
+static inline int splq_get_free(SPLQ *q)
+{
+    const int result = q->depth - splq_get_used(q);
+    return result > 0 ? result : 1;
+}
+
+/** Get a buffer for writing one item. */
+static inline char *splq_start_write(SPLQ *q)
+{
+    if(SPUNLIKELY(q->tail == q->depth)) {
+        if(q->head > 0) {
+            memmove(q->data, &q->data[q->head * q->width],
+                    (size_t)(q->tail - q->head) * q->width);
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            char *data = NULL;
+            if(SPLIKELY(q->depth <= INT32_MAX / 2)) {
+                q->depth *= 2;
+                data = (char*)realloc(q->data, (size_t)q->depth * q->width);
+            }
+            if(SPUNLIKELY(data == NULL)) {
+                fprintf(stderr, "ERROR: fused queue overflow\n");
+                exit(-1);
+            }
+            q->data = data;
+        }
+    }
+    return &q->data[q->tail * q->width];
+}
+
+/** Finish a write. */
+static inline void splq_finish_write(SPLQ *q)
+{
+    q->tail += 1;
+}
+
+/** Get the next item to read or NULL if the queue is empty. */
+static inline char *splq_start_read(SPLQ *q)
+{
+    if(q->head == q->tail) {
+        return NULL;
+    }
+    return &q->data[q->head * q->width];
+}
+
+/** Finish a read. */
+static inline void splq_finish_read(SPLQ *q)
+{
+    q->head += 1;
+    if(q->head == q->tail) {
+        q->head = 0;
+        q->tail = 0;
+    }
+}
+
 /** Compute a square root. */
 #define SP_SQRT_FUNC(NAME, TYPE) \
    static inline TYPE NAME(TYPE v) {  \
@@ -0,0 +1,241 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include "ScalaPipe.h"
+#include <pthread.h>
+#include <ucontext.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Cooperative scheduler for C kernels.
+ * Each kernel runs as a task with its own stack.  Tasks are multiplexed
+ * onto a pool of worker threads and switch back to their worker when
+ * a port is empty or full instead of yielding the thread.  A parked
+ * task is put back on the run queue when an edge signals it.
+ */
+
+/** Stack size for each task (in bytes). */
+#ifndef SPT_STACK_SIZE
+#   define SPT_STACK_SIZE (8 << 20)
+#endif
+
+/** Task states. */
+#define SPT_READY       0   /**< On the run queue. */
+#define SPT_RUNNING     1   /**< Running on a worker. */
+#define SPT_YIELDING    2   /**< Switching out, run again later. */
+#define SPT_PARKING     3   /**< Switching out, run again when signaled. */
+#define SPT_PARKED      4   /**< Waiting for a signal. */
+#define SPT_DONE        5   /**< Finished. */
+
+/** A task. */
+typedef struct SPTask {
+    ucontext_t context;         /**< Saved context of the task. */
+    void *(*run)(void*);        /**< Entry point. */
+    char *stack;                /**< Stack for the task. */
+    uint32_t state;             /**< Task state (SPT_*). */
+    uint32_t waiting;           /**< Set when the task may park. */
+    uint32_t wake;              /**< Set by a signal while waiting. */
+    struct SPTask *next;        /**< Next task on the run queue. */
+} SPTask;
+
+/** Run queue shared by the workers. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SPTask *head;
+    SPTask *tail;
+    int remaining;              /**< Number of tasks not yet done. */
+} spt_pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL,
+    NULL,
+    0
+};
+
+/** The task running on this worker. */
+static __thread SPTask *spt_current = NULL;
+
+/** The context of this worker. */
+static __thread ucontext_t *spt_worker = NULL;
+
+/** Add a task to the run queue. */
+static inline void spt_enqueue(SPTask *t)
+{
+    t->next = NULL;
+    pthread_mutex_lock(&spt_pool.lock);
+    if(spt_pool.tail) {
+        spt_pool.tail->next = t;
+    } else {
+        spt_pool.head = t;
+    }
+    spt_pool.tail = t;
+    pthread_cond_signal(&spt_pool.cond);
+    pthread_mutex_unlock(&spt_pool.lock);
+}
+
+/** Switch from the current task back to its worker.
+ * This is not inlined since the task may resume on a different
+ * worker, so thread-local addresses must not be cached across it.
+ */
+static void __attribute__((noinline)) spt_switch(uint32_t state)
+{
+    SPTask *t = spt_current;
+    __atomic_store_n(&t->state, state, __ATOMIC_SEQ_CST);
+    swapcontext(&t->context, spt_worker);
+}
+
+/** Let other tasks run, then resume. */
+static inline void spt_yield()
+{
+    spt_switch(SPT_YIELDING);
+}
+
+/** Wake a task if it is waiting.
+ * This must be called after the state the task is waiting on has
+ * been published.
+ */
+static inline void spt_signal(SPTask *t)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(SPUNLIKELY(__atomic_load_n(&t->waiting, __ATOMIC_RELAXED))) {
+        uint32_t expected = SPT_PARKED;
+        __atomic_store_n(&t->waiting, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->wake, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_compare_exchange_n(&t->state, &expected, SPT_READY,
+                                       0, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_RELAXED)) {
+            spt_enqueue(t);
+        }
+    }
+}
+
+/** Wait after a failed attempt to use a port.
+ * Calls alternate between arming the wait and parking, so the caller
+ * must retry its operation after every call.
+ */
+static inline void spt_wait(SPTask *t, SPWaitState *s)
+{
+    if(!s->armed) {
+        __atomic_store_n(&t->wake, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&t->waiting, 1, __ATOMIC_SEQ_CST);
+        s->armed = 1;
+    } else {
+        s->armed = 0;
+        spt_switch(SPT_PARKING);
+    }
+}
+
+/** Entry point for all tasks. */
+static void spt_entry()
+{
+    SPTask *t = spt_current;
+    t->run(NULL);
+    spt_switch(SPT_DONE);
+}
+
+/** Create a task and add it to the run queue.
+ * @param t The task.
+ * @param run The function to run.
+ */
+static inline void spt_create(SPTask *t, void *(*run)(void*))
+{
+    getcontext(&t->context);
+    t->run = run;
+    t->stack = (char*)malloc(SPT_STACK_SIZE);
+    t->state = SPT_READY;
+    t->waiting = 0;
+    t->wake = 0;
+    t->context.uc_stack.ss_sp = t->stack;
+    t->context.uc_stack.ss_size = SPT_STACK_SIZE;
+    t->context.uc_link = NULL;
+    makecontext(&t->context, spt_entry, 0);
+    pthread_mutex_lock(&spt_pool.lock);
+    spt_pool.remaining += 1;
+    pthread_mutex_unlock(&spt_pool.lock);
+    spt_enqueue(t);
+}
+
+/** Run tasks until all tasks are done. */
+static void *spt_worker_main(void *arg)
+{
+    ucontext_t context;
+    spt_worker = &context;
+    for(;;) {
+
+        pthread_mutex_lock(&spt_pool.lock);
+        while(spt_pool.head == NULL && spt_pool.remaining > 0) {
+            pthread_cond_wait(&spt_pool.cond, &spt_pool.lock);
+        }
+        SPTask *t = spt_pool.head;
+        if(t == NULL) {
+            pthread_mutex_unlock(&spt_pool.lock);
+            break;
+        }
+        spt_pool.head = t->next;
+        if(spt_pool.head == NULL) {
+            spt_pool.tail = NULL;
+        }
+        pthread_mutex_unlock(&spt_pool.lock);
+
+        __atomic_store_n(&t->state, SPT_RUNNING, __ATOMIC_RELAXED);
+        spt_current = t;
+        swapcontext(&context, &t->context);
+        spt_current = NULL;
+
+        switch(__atomic_load_n(&t->state, __ATOMIC_RELAXED)) {
+        case SPT_YIELDING:
+            t->state = SPT_READY;
+            spt_enqueue(t);
+            break;
+        case SPT_PARKING:
+            // A signal may have arrived while switching out.
+            __atomic_store_n(&t->state, SPT_PARKED, __ATOMIC_SEQ_CST);
+            if(__atomic_exchange_n(&t->wake, 0, __ATOMIC_SEQ_CST)) {
+                uint32_t expected = SPT_PARKED;
+                if(__atomic_compare_exchange_n(&t->state, &expected,
+                                               SPT_READY, 0,
+                                               __ATOMIC_SEQ_CST,
+                                               __ATOMIC_RELAXED)) {
+                    spt_enqueue(t);
+                }
+            }
+            break;
+        case SPT_DONE:
+            free(t->stack);
+            t->stack = NULL;
+            pthread_mutex_lock(&spt_pool.lock);
+            spt_pool.remaining -= 1;
+            if(spt_pool.remaining == 0) {
+                pthread_cond_broadcast(&spt_pool.cond);
+            }
+            pthread_mutex_unlock(&spt_pool.lock);
+            break;
+        }
+
+    }
+    return NULL;
+}
+
+/** Run all tasks to completion.
+ * @param workers The number of worker threads to use.
+ */
+static inline void spt_run(int workers)
+{
+    pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * workers);
+    for(int i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, spt_worker_main, NULL);
+    }
+    for(int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,181 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include "ScalaPipe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Shared memory edge.
+ * An edge between processes on the same machine is a lock-free queue in
+ * a POSIX shared memory segment named after the port assigned to the
+ * edge.  The consumer creates the segment, replacing any left by an
+ * earlier run, and the producer attaches once the consumer has
+ * published it.  Kernels read and write the shared ring directly.
+ *
+ * The queue follows the header in the segment.
+ */
+#define SP_SHM_MAGIC    0x4D485353  // "SSHM"
+
+typedef struct {
+    uint32_t magic;         /**< Set once the queue is initialized. */
+    uint32_t owner;         /**< Process ID of the consumer. */
+    uint32_t producer;      /**< Process ID of the producer (0 if none). */
+    uint32_t done;          /**< Set once the producer is done. */
+    uint32_t ended;         /**< Set once the consumer saw the end. */
+    uint32_t reserved;
+    uint64_t size;          /**< Size of the segment in bytes. */
+    uint8_t pad[SP_CACHE_LINE - 32];
+} SPShmEdge;
+
+/** Get the name of the segment for an edge. */
+static inline void sp_shm_name(char *name, size_t size, int port)
+{
+    snprintf(name, size, "/scalapipe-edge.%d", port);
+}
+
+/** Get the queue of an edge. */
+static inline SPAQ *sp_shm_queue(SPShmEdge *e)
+{
+    return (SPAQ*)&e[1];
+}
+
+/** Create the segment for an edge (consumer side).
+ * @param port The port assigned to the edge.
+ * @param depth The depth of the queue.
+ * @param width The size of an item in bytes.
+ */
+static inline SPShmEdge *sp_shm_create(int port, uint32_t depth,
+                                       uint32_t width)
+{
+    char name[64];
+    sp_shm_name(name, sizeof(name), port);
+    shm_unlink(name);
+    const size_t size = sizeof(SPShmEdge) + spaq_get_size(depth, width);
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0) {
+        perror("shm_open");
+        exit(-1);
+    }
+    if(ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        exit(-1);
+    }
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+    SPShmEdge *e = (SPShmEdge*)ptr;
+    e->owner = getpid();
+    e->producer = 0;
+    e->done = 0;
+    e->ended = 0;
+    e->size = size;
+    spaq_init(sp_shm_queue(e), depth, width);
+    sp_store_release(&e->magic, SP_SHM_MAGIC);
+    return e;
+}
+
+/** Determine if a mapped segment was published by a running consumer. */
+static inline int sp_shm_is_live(SPShmEdge *e)
+{
+    if(sp_load_acquire(&e->magic) != SP_SHM_MAGIC) {
+        return 0;
+    }
+    return kill(e->owner, 0) == 0 || errno == EPERM;
+}
+
+/** Attach to the segment for an edge (producer side).
+ * This waits for the consumer to create the segment.
+ */
+static inline SPShmEdge *sp_shm_attach(int port)
+{
+    char name[64];
+    sp_shm_name(name, sizeof(name), port);
+    for(;;) {
+        const int fd = shm_open(name, O_RDWR, 0);
+        if(fd < 0) {
+            if(errno != ENOENT) {
+                perror("shm_open");
+                exit(-1);
+            }
+            usleep(100);
+            continue;
+        }
+        struct stat st;
+        if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SPShmEdge)) {
+            close(fd);
+            usleep(100);
+            continue;
+        }
+        void *ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        close(fd);
+        if(ptr == MAP_FAILED) {
+            perror("mmap");
+            exit(-1);
+        }
+        SPShmEdge *e = (SPShmEdge*)ptr;
+        if(!sp_shm_is_live(e) || e->size != (uint64_t)st.st_size) {
+            munmap(ptr, st.st_size);
+            usleep(100);
+            continue;
+        }
+        uint32_t expected = 0;
+        if(!__atomic_compare_exchange_n(&e->producer, &expected, getpid(),
+                                        0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            fprintf(stderr, "ERROR: shared memory edge %d in use\n", port);
+            exit(-1);
+        }
+        return e;
+    }
+}
+
+/** Note that the producer is done. */
+static inline void sp_shm_finish(SPShmEdge *e)
+{
+    sp_store_release(&e->done, 1);
+}
+
+/** Determine if the consumer has reached the end of an edge.
+ * This returns non-zero once, after the last item has been read.
+ */
+static inline int sp_shm_ended(SPShmEdge *e)
+{
+    if(SPLIKELY(!sp_load_acquire(&e->done)) || e->ended) {
+        return 0;
+    }
+    if(spaq_get_used(sp_shm_queue(e)) > 0) {
+        return 0;
+    }
+    e->ended = 1;
+    return 1;
+}
+
+/** Unmap an edge.  The consumer also removes the segment. */
+static inline void sp_shm_close(SPShmEdge *e, int port)
+{
+    if(e->owner == (uint32_t)getpid()) {
+        char name[64];
+        sp_shm_name(name, sizeof(name), port);
+        shm_unlink(name);
+    }
+    munmap(e, e->size);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,498 @@
+#ifndef SOCKET_H_
+#define SOCKET_H_
+
+#include "ScalaPipe.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Sending side of a socket edge.
+ * The producer kernel writes items to a local ring.  A sender thread
+ * sends the ring in large batches, using writev when the batch wraps.
+ * A partial batch is sent once the oldest item has waited for the
+ * flush latency.
+ *
+ * Flow control is credit based: the sender starts with credits for the
+ * depth of the receiving queue plus one batch in flight and sends no
+ * more items than it has credits for.  The receiver returns credits as
+ * a uint32_t item count on the same socket as its kernel releases items.
+ */
+typedef struct {
+    int sock;
+    SPAQ *q;                    /**< Items to send. */
+    uint32_t credits;           /**< Items the receiver has room for. */
+    uint32_t batch;             /**< Items to collect before sending. */
+    uint32_t latency_us;        /**< Longest time to hold a partial batch. */
+    uint32_t done;              /**< Set once the producer is done. */
+    uint8_t credit_bytes[4];    /**< Partial credit message. */
+    uint32_t credit_size;
+    pthread_t thread;
+} SPSockSender;
+
+/** Read credits that have arrived.
+ * @param timeout Milliseconds to wait for credits (0 to not wait).
+ * @return 0 if the receiver has closed the connection.
+ */
+static inline int sp_sock_read_credits(SPSockSender *s, int timeout)
+{
+    if(timeout > 0) {
+        struct pollfd fds;
+        fds.fd = s->sock;
+        fds.events = POLLIN;
+        if(poll(&fds, 1, timeout) <= 0) {
+            return 1;
+        }
+    }
+    for(;;) {
+        uint8_t buffer[256];
+        const ssize_t rc = recv(s->sock, buffer, sizeof(buffer),
+                                MSG_DONTWAIT);
+        if(rc == 0) {
+            return 0;
+        } else if(rc < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 1;
+            }
+            return 0;
+        }
+        for(ssize_t i = 0; i < rc; i++) {
+            s->credit_bytes[s->credit_size++] = buffer[i];
+            if(s->credit_size == sizeof(uint32_t)) {
+                uint32_t credit;
+                memcpy(&credit, s->credit_bytes, sizeof(credit));
+                s->credits += credit;
+                s->credit_size = 0;
+            }
+        }
+    }
+}
+
+/** Send all of an I/O vector. */
+static inline void sp_sock_writev(int sock, struct iovec *iov, int count)
+{
+    while(count > 0) {
+        ssize_t rc = writev(sock, iov, count);
+        if(SPUNLIKELY(rc < 0)) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("writev");
+            exit(-1);
+        }
+        while(count > 0 && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov += 1;
+            count -= 1;
+        }
+        if(count > 0) {
+            iov->iov_base = (char*)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+}
+
+/** Send up to the credit limit from the ring.
+ * @return The number of items sent.
+ */
+static inline uint32_t sp_sock_flush(SPSockSender *s)
+{
+    SPAQ *q = s->q;
+    const uint32_t read_ptr = q->read_ptr;
+    uint32_t count = sp_load_acquire(&q->write_ptr) - read_ptr;
+    if(count > s->credits) {
+        count = s->credits;
+    }
+    if(count == 0) {
+        return 0;
+    }
+    const uint32_t offset = read_ptr & (q->depth - 1);
+    const uint32_t first = count < q->depth - offset
+                         ? count : q->depth - offset;
+    struct iovec iov[2];
+    iov[0].iov_base = &q->data[offset * q->width];
+    iov[0].iov_len = first * q->width;
+    iov[1].iov_base = &q->data[0];
+    iov[1].iov_len = (count - first) * q->width;
+    sp_sock_writev(s->sock, iov, count > first ? 2 : 1);
+    spaq_finish_read(q, count);
+    s->credits -= count;
+    return count;
+}
+
+/** Body of the sender thread. */
+static inline void *sp_sock_send_thread(void *arg)
+{
+
+    SPSockSender *s = (SPSockSender*)arg;
+    const int latency_ms = s->latency_us > 1000 ? s->latency_us / 1000 : 1;
+    int open = 1;
+
+    for(;;) {
+
+        if(open) {
+            open = sp_sock_read_credits(s, 0);
+        }
+        const int done = sp_load_acquire(&s->done);
+        const uint32_t used = spaq_get_used(s->q);
+        if(used == 0) {
+            if(done) {
+                break;
+            }
+            usleep(s->latency_us);
+            continue;
+        }
+
+        // Wait for credits.
+        if(s->credits == 0) {
+            if(!open) {
+                fprintf(stderr, "ERROR: socket edge closed by receiver\n");
+                exit(-1);
+            }
+            open = sp_sock_read_credits(s, latency_ms);
+            continue;
+        }
+
+        // Hold a partial batch for up to the flush latency.
+        if(used < s->batch && used < s->credits && !done) {
+            usleep(s->latency_us);
+        }
+        sp_sock_flush(s);
+
+    }
+
+    // Let the receiver see the end of the stream, then wait for it to
+    // close so that credits in flight do not reset the connection.
+    shutdown(s->sock, SHUT_WR);
+    while(open) {
+        uint8_t buffer[256];
+        struct pollfd fds;
+        fds.fd = s->sock;
+        fds.events = POLLIN;
+        if(poll(&fds, 1, 1000) <= 0) {
+            break;
+        }
+        open = recv(s->sock, buffer, sizeof(buffer), 0) > 0;
+    }
+    close(s->sock);
+    return NULL;
+
+}
+
+/** Start sending.
+ * The ring holds at least two batches so that one can fill while the
+ * other is sent.
+ * @param depth The depth of the receiving queue.
+ * @param width The size of an item in bytes.
+ * @param batch_bytes Bytes to collect before sending.
+ * @param latency_us Longest time to hold a partial batch.
+ */
+static inline void sp_sock_sender_start(SPSockSender *s, int sock,
+                                        uint32_t depth, uint32_t width,
+                                        uint32_t batch_bytes,
+                                        uint32_t latency_us)
+{
+    const uint32_t batch = (batch_bytes + width - 1) / width;
+    s->batch = batch > 0 ? batch : 1;
+    s->q = spaq_create(depth > 2 * s->batch ? depth : 2 * s->batch, width);
+    if(s->q == NULL) {
+        perror("spaq_create");
+        exit(-1);
+    }
+    s->sock = sock;
+    s->credits = depth + s->batch;
+    s->latency_us = latency_us;
+    s->done = 0;
+    s->credit_size = 0;
+    pthread_create(&s->thread, NULL, sp_sock_send_thread, s);
+}
+
+/** Note that the producer is done. */
+static inline void sp_sock_sender_finish(SPSockSender *s)
+{
+    sp_store_release(&s->done, 1);
+}
+
+/** Wait for everything to be sent and close the socket. */
+static inline void sp_sock_sender_join(SPSockSender *s)
+{
+    sp_sock_sender_finish(s);
+    pthread_join(s->thread, NULL);
+    free(s->q);
+}
+
+/** Receiving side of a socket edge.
+ * A receive engine thread reads the socket straight into the queue, so
+ * the consumer kernel only touches the queue.  The engine stops polling
+ * a stream while its queue is full and the consumer resumes it when it
+ * returns credits.
+ */
+typedef struct {
+    int listen_sock;
+    int sock;                   /**< Connection (-1 until accepted). */
+    int epfd;                   /**< Engine polling the stream. */
+    SPAQ *q;                    /**< Items received. */
+    SPWait *wait;               /**< Signaled when items arrive (or NULL). */
+    uint32_t partial;           /**< Bytes of an item at the write pointer. */
+    uint32_t stalled;           /**< Set while not polled. */
+    uint32_t closed;            /**< Set once the sender is done. */
+    uint32_t ended;             /**< Set once the consumer saw the end. */
+    uint32_t released;          /**< Items released since the last credit. */
+    uint32_t threshold;         /**< Items to release before a credit. */
+} SPSockStream;
+
+/** Receive engine.
+ * One thread services every incoming socket edge of a process.
+ */
+typedef struct {
+    int epfd;
+    int wake;                   /**< eventfd used to stop the thread. */
+    uint32_t stop;
+    pthread_t thread;
+} SPSockEngine;
+
+/** Events to handle per epoll_wait. */
+#define SP_SOCK_EVENTS      16
+
+/** Reads per stream per event so that one stream cannot starve others. */
+#define SP_SOCK_READS       4
+
+/** Start polling a stream. */
+static inline void sp_sock_poll(SPSockStream *s, int op, int fd)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if(SPUNLIKELY(epoll_ctl(s->epfd, op, fd, &ev) < 0)) {
+        perror("epoll_ctl");
+        exit(-1);
+    }
+}
+
+/** Resume polling a stream if it is stalled. */
+static inline void sp_sock_resume(SPSockStream *s)
+{
+    if(__atomic_exchange_n(&s->stalled, 0, __ATOMIC_SEQ_CST)) {
+        sp_sock_poll(s, EPOLL_CTL_ADD, s->sock);
+    }
+}
+
+/** Stop polling a stream with a full queue.
+ * The consumer releases at least a credit's worth of items before the
+ * queue empties, so it always sees the stall.
+ */
+static inline void sp_sock_stall(SPSockStream *s)
+{
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->sock, NULL);
+    __atomic_store_n(&s->stalled, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(spaq_get_free(s->q) > 0) {
+        sp_sock_resume(s);
+    }
+}
+
+/** Accept the connection for a stream. */
+static inline void sp_sock_accept(SPSockStream *s)
+{
+    const int sock = accept(s->listen_sock, NULL, NULL);
+    if(sock < 0) {
+        perror("accept");
+        exit(-1);
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->listen_sock, NULL);
+    s->sock = sock;
+    sp_sock_poll(s, EPOLL_CTL_ADD, sock);
+}
+
+/** Read from a stream into its queue.
+ * Partial items stay at the write pointer until the rest arrives.
+ */
+static inline void sp_sock_receive(SPSockStream *s)
+{
+    SPAQ *q = s->q;
+    for(int i = 0; i < SP_SOCK_READS; i++) {
+        uint32_t count = q->depth;
+        char *ptr = spaq_start_write_n(q, &count);
+        if(ptr == NULL) {
+            sp_sock_stall(s);
+            return;
+        }
+        const size_t size = count * q->width - s->partial;
+        const ssize_t rc = recv(s->sock, ptr + s->partial, size, 0);
+        if(rc == 0) {
+
+            // End of stream.  Shut down our side so the sender can close.
+            epoll_ctl(s->epfd, EPOLL_CTL_DEL, s->sock, NULL);
+            shutdown(s->sock, SHUT_WR);
+            sp_store_release(&s->closed, 1);
+            if(s->wait) {
+                spw_signal(s->wait);
+            }
+            return;
+
+        } else if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            perror("recv");
+            exit(-1);
+        }
+        const uint32_t total = s->partial + rc;
+        s->partial = total % q->width;
+        if(total >= q->width) {
+            spaq_finish_write(q, total / q->width);
+            if(s->wait) {
+                spw_signal(s->wait);
+            }
+        }
+        if((size_t)rc < size) {
+            return;
+        }
+    }
+}
+
+/** Body of the receive engine thread. */
+static inline void *sp_sock_receive_thread(void *arg)
+{
+    SPSockEngine *e = (SPSockEngine*)arg;
+    struct epoll_event events[SP_SOCK_EVENTS];
+    for(;;) {
+        const int count = epoll_wait(e->epfd, events, SP_SOCK_EVENTS, -1);
+        if(count < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(-1);
+        }
+        for(int i = 0; i < count; i++) {
+            SPSockStream *s = (SPSockStream*)events[i].data.ptr;
+            if(s == NULL) {
+                if(sp_load_acquire(&e->stop)) {
+                    return NULL;
+                }
+            } else if(s->sock < 0) {
+                sp_sock_accept(s);
+            } else {
+                sp_sock_receive(s);
+            }
+        }
+    }
+}
+
+/** Create a receive engine and start its thread. */
+static inline void sp_sock_engine_start(SPSockEngine *e)
+{
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    e->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(e->epfd < 0 || e->wake < 0) {
+        perror("epoll_create1");
+        exit(-1);
+    }
+    e->stop = 0;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->wake, &ev);
+    pthread_create(&e->thread, NULL, sp_sock_receive_thread, e);
+}
+
+/** Stop a receive engine. */
+static inline void sp_sock_engine_stop(SPSockEngine *e)
+{
+    const uint64_t value = 1;
+    sp_store_release(&e->stop, 1);
+    if(write(e->wake, &value, sizeof(value)) != sizeof(value)) {
+        perror("write");
+    }
+    pthread_join(e->thread, NULL);
+    close(e->wake);
+    close(e->epfd);
+}
+
+/** Add a stream to a receive engine.
+ * The engine accepts the connection on the listening socket.
+ * @param depth The depth of the queue.
+ * @param width The size of an item in bytes.
+ * @param wait Wait object to signal when items arrive (or NULL).
+ */
+static inline void sp_sock_engine_add(SPSockEngine *e, SPSockStream *s,
+                                      int listen_sock, uint32_t depth,
+                                      uint32_t width, SPWait *wait)
+{
+    s->q = spaq_create(depth, width);
+    if(s->q == NULL) {
+        perror("spaq_create");
+        exit(-1);
+    }
+    s->listen_sock = listen_sock;
+    s->sock = -1;
+    s->epfd = e->epfd;
+    s->wait = wait;
+    s->partial = 0;
+    s->stalled = 0;
+    s->closed = 0;
+    s->ended = 0;
+    s->released = 0;
+    s->threshold = s->q->depth >= 4 ? s->q->depth / 4 : 1;
+    sp_sock_poll(s, EPOLL_CTL_ADD, listen_sock);
+}
+
+/** Determine if the consumer has reached the end of a stream.
+ * This returns non-zero once, after the last item has been read.
+ */
+static inline int sp_sock_ended(SPSockStream *s)
+{
+    if(SPLIKELY(!sp_load_acquire(&s->closed)) || s->ended) {
+        return 0;
+    }
+    if(spaq_get_used(s->q) > 0) {
+        return 0;
+    }
+    s->ended = 1;
+    return 1;
+}
+
+/** Release items read by the consumer.
+ * Credits go back to the sender in batches of a quarter of the queue.
+ */
+static inline void sp_sock_release(SPSockStream *s, uint32_t count)
+{
+    spaq_finish_read(s->q, count);
+    s->released += count;
+    if(SPUNLIKELY(s->released >= s->threshold)) {
+        const uint32_t credit = s->released;
+        send(s->sock, &credit, sizeof(credit), MSG_NOSIGNAL);
+        s->released = 0;
+        sp_sock_resume(s);
+    }
+}
+
+/** Close a stream once its engine has stopped. */
+static inline void sp_sock_stream_close(SPSockStream *s)
+{
+    if(s->sock >= 0) {
+        close(s->sock);
+    }
+    close(s->listen_sock);
+    free(s->q);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,14 +5,16 @@
 #include <string.h>
 #include <stdint.h>
 
+#include "TraceOutput.hh"
+
 #include <vector>
 #include <set>
 
 class Stat {
 public:
 
-    Stat(uint16_t id, const char *name, FILE *fd) :
-        m_fd(fd),
+    Stat(uint16_t id, const char *name, TTAOutput *out) :
+        m_out(out),
         m_tap_id(id),
         m_xlabel(NULL)
     {
@@ -38,8 +40,8 @@ public:
 
     virtual void Start()
     {
-        fprintf(m_fd, "s,%hu,%s,%s,%s\n", m_tap_id, GetType(), m_name,
-                m_xlabel == NULL ? "" : m_xlabel);
+        m_out->Start(m_tap_id, GetType(), m_name,
+                     m_xlabel == NULL ? "" : m_xlabel);
     }
 
     virtual void Stop()
@@ -47,6 +49,26 @@ public:
         Log();
     }
 
+    /** Set the number of significant decimal digits to keep. */
+    virtual void SetPrecision(int digits)
+    {
+        // Do nothing by default.
+    }
+
+    /** Determine if values of any magnitude can be recorded.
+     * Measures use this to avoid scaling and clamping values.
+     */
+    virtual bool IsLogScale() const
+    {
+        return false;
+    }
+
+    /** Report events that were not recorded. */
+    void Lost(uint64_t count)
+    {
+        m_out->Lost(m_tap_id, count);
+    }
+
     void SetXLabel(const char *xlabel)
     {
         if(m_xlabel != NULL) {
@@ -59,10 +81,10 @@ protected:
 
     void Print(uint64_t frame, uint64_t index, uint64_t value)
     {
-        fprintf(m_fd, "d,%hu,%lu,%lu,%lu\n", m_tap_id, frame, index, value);
+        m_out->Print(m_tap_id, frame, index, value);
     }
 
-    FILE *m_fd;
+    TTAOutput *m_out;
     const uint16_t m_tap_id;
     char *m_name;
     char *m_xlabel;
@@ -72,12 +94,12 @@ protected:
 class StatAvg : public Stat {
 public:
 
-    static Stat *Create(uint16_t id, const char *name, FILE *fd)
+    static Stat *Create(uint16_t id, const char *name, TTAOutput *out)
     {
-        return new StatAvg(id, name, fd);
+        return new StatAvg(id, name, out);
     }
 
-    StatAvg(uint16_t id, const char *name, FILE *fd) : Stat(id, name, fd)
+    StatAvg(uint16_t id, const char *name, TTAOutput *out) : Stat(id, name, out)
     {
         m_sum     = 0;
         m_count  = 0;
@@ -115,12 +137,12 @@ private:
 class StatMin : public Stat {
 public:
 
-    static Stat *Create(uint16_t id, const char *name, FILE *fd)
+    static Stat *Create(uint16_t id, const char *name, TTAOutput *out)
     {
-        return new StatMin(id, name, fd);
+        return new StatMin(id, name, out);
     }
 
-    StatMin(uint16_t id, const char *name, FILE *fd) : Stat(id, name, fd)
+    StatMin(uint16_t id, const char *name, TTAOutput *out) : Stat(id, name, out)
     {
         m_current    = 0;
         m_index      = 0;
@@ -155,12 +177,12 @@ private:
 class StatMax : public Stat {
 public:
 
-    static Stat *Create(uint16_t id, const char *name, FILE *fd)
+    static Stat *Create(uint16_t id, const char *name, TTAOutput *out)
     {
-        return new StatMax(id, name, fd);
+        return new StatMax(id, name, out);
     }
 
-    StatMax(uint16_t id, const char *name, FILE *fd) : Stat(id, name, fd)
+    StatMax(uint16_t id, const char *name, TTAOutput *out) : Stat(id, name, out)
     {
         m_current    = 0;
         m_index      = 0;
@@ -195,12 +217,12 @@ private:
 class StatSum : public Stat {
 public:
 
-    static Stat *Create(uint16_t id, const char *name, FILE *fd)
+    static Stat *Create(uint16_t id, const char *name, TTAOutput *out)
     {
-        return new StatSum(id, name, fd);
+        return new StatSum(id, name, out);
     }
 
-    StatSum(uint16_t id, const char *name, FILE *fd) : Stat(id, name, fd)
+    StatSum(uint16_t id, const char *name, TTAOutput *out) : Stat(id, name, out)
     {
         m_sum     = 0;
         m_index  = 0;
@@ -233,12 +255,12 @@ private:
 class StatHist : public Stat {
 public:
 
-    static Stat *Create(uint16_t id, const char *name, FILE *fd)
+    static Stat *Create(uint16_t id, const char *name, TTAOutput *out)
     {
-        return new StatHist(id, name, fd);
+        return new StatHist(id, name, out);
     }
 
-    StatHist(uint16_t id, const char *name, FILE *fd) : Stat(id, name, fd)
+    StatHist(uint16_t id, const char *name, TTAOutput *out) : Stat(id, name, out)
     {
         m_buckets.reserve(1 << 16);
         m_frame = 0;
@@ -276,15 +298,248 @@ private:
 
 };
 
+/** Log-linear histogram.
+ * Values below 2^b are counted exactly.  Above that, each power of two
+ * is split into 2^(b-1) buckets, so values are kept to b-1 significant
+ * bits.  Recording is O(1) and histograms with the same precision can
+ * be added together.
+ */
+class HDRHistogram {
+public:
+
+    /** Most significant decimal digits supported. */
+    static const int MAX_DIGITS = 4;
+
+    /** Constructor.
+     * @param digits Significant decimal digits to keep (1 to MAX_DIGITS).
+     */
+    HDRHistogram(int digits = 2)
+    {
+        SetPrecision(digits);
+    }
+
+    /** Set the precision.  This clears the histogram. */
+    void SetPrecision(int digits)
+    {
+        if(digits < 1) {
+            digits = 1;
+        } else if(digits > MAX_DIGITS) {
+            digits = MAX_DIGITS;
+        }
+        uint64_t range = 2;
+        for(int i = 0; i < digits; i++) {
+            range *= 10;
+        }
+        m_bits = 1;
+        while((1ULL << m_bits) < range) {
+            m_bits += 1;
+        }
+        m_half = 1ULL << (m_bits - 1);
+        m_counts.assign((1ULL << m_bits) + (64 - m_bits) * m_half, 0);
+        m_total = 0;
+        Clear();
+    }
+
+    void Clear()
+    {
+        if(m_total > 0) {
+            for(size_t i = m_min_index; i <= m_max_index; i++) {
+                m_counts[i] = 0;
+            }
+        }
+        m_total = 0;
+        m_max = 0;
+        m_min_index = m_counts.size();
+        m_max_index = 0;
+    }
+
+    void Record(uint64_t value, uint64_t count = 1)
+    {
+        const size_t index = GetIndex(value);
+        m_counts[index] += count;
+        m_total += count;
+        if(index < m_min_index) {
+            m_min_index = index;
+        }
+        if(index > m_max_index) {
+            m_max_index = index;
+        }
+        if(value > m_max) {
+            m_max = value;
+        }
+    }
+
+    /** Add the counts from another histogram with the same precision. */
+    void Add(const HDRHistogram &other)
+    {
+        if(other.m_total == 0) {
+            return;
+        }
+        for(size_t i = other.m_min_index; i <= other.m_max_index; i++) {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_total += other.m_total;
+        if(other.m_min_index < m_min_index) {
+            m_min_index = other.m_min_index;
+        }
+        if(other.m_max_index > m_max_index) {
+            m_max_index = other.m_max_index;
+        }
+        if(other.m_max > m_max) {
+            m_max = other.m_max;
+        }
+    }
+
+    uint64_t GetTotal() const
+    {
+        return m_total;
+    }
+
+    uint64_t GetMax() const
+    {
+        return m_max;
+    }
+
+    /** Get the value at a percentile.
+     * @param permille The percentile in tenths of a percent.
+     * @return The largest value in the bucket holding the percentile.
+     */
+    uint64_t GetPercentile(uint32_t permille) const
+    {
+        if(m_total == 0) {
+            return 0;
+        }
+        uint64_t target = (m_total * permille + 999) / 1000;
+        if(target == 0) {
+            target = 1;
+        }
+        uint64_t sum = 0;
+        for(size_t i = m_min_index; i <= m_max_index; i++) {
+            sum += m_counts[i];
+            if(sum >= target) {
+                const uint64_t high = GetHighest(i);
+                return high < m_max ? high : m_max;
+            }
+        }
+        return m_max;
+    }
+
+private:
+
+    size_t GetIndex(uint64_t value) const
+    {
+        if(value < (m_half << 1)) {
+            return value;
+        }
+        const uint32_t msb = 63 - __builtin_clzll(value);
+        const uint32_t shift = msb - (m_bits - 1);
+        return (m_half << 1) + (shift - 1) * m_half
+             + ((value >> shift) - m_half);
+    }
+
+    uint64_t GetHighest(size_t index) const
+    {
+        if(index < (m_half << 1)) {
+            return index;
+        }
+        const uint64_t offset = index - (m_half << 1);
+        const uint32_t shift = offset / m_half + 1;
+        const uint64_t sub = offset % m_half + m_half;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    uint32_t m_bits;
+    uint64_t m_half;
+    std::vector<uint64_t> m_counts;
+    uint64_t m_total;
+    uint64_t m_max;
+    size_t m_min_index;
+    size_t m_max_index;
+
+};
+
+/** Percentiles from a log-linear histogram.
+ * Each frame prints the 50th, 99th, and 99.9th percentiles and the
+ * maximum for the values since the last frame, at indexes 500, 990,
+ * 999, and 1000 (the percentile in tenths of a percent).  The final
+ * frame, printed when the measure stops, covers the whole run.
+ * A non-zero time_ns passed to Record is a weight.
+ */
+class StatHDR : public Stat {
+public:
+
+    static Stat *Create(uint16_t id, const char *name, TTAOutput *out)
+    {
+        return new StatHDR(id, name, out);
+    }
+
+    StatHDR(uint16_t id, const char *name, TTAOutput *out) : Stat(id, name, out)
+    {
+        m_frame = 0;
+    }
+
+    virtual const char *GetType() const
+    {
+        return "hdr";
+    }
+
+    virtual void SetPrecision(int digits)
+    {
+        m_current.SetPrecision(digits);
+        m_total.SetPrecision(digits);
+    }
+
+    virtual bool IsLogScale() const
+    {
+        return true;
+    }
+
+    virtual void Record(uint64_t time_ns, uint64_t value)
+    {
+        m_current.Record(value, time_ns > 0 ? time_ns : 1);
+    }
+
+    virtual void Log()
+    {
+        if(m_current.GetTotal() > 0) {
+            PrintPercentiles(m_current);
+            m_total.Add(m_current);
+            m_current.Clear();
+        }
+        m_frame += 1;
+    }
+
+    virtual void Stop()
+    {
+        Log();
+        PrintPercentiles(m_total);
+    }
+
+private:
+
+    void PrintPercentiles(const HDRHistogram &hist)
+    {
+        Print(m_frame, 500, hist.GetPercentile(500));
+        Print(m_frame, 990, hist.GetPercentile(990));
+        Print(m_frame, 999, hist.GetPercentile(999));
+        Print(m_frame, 1000, hist.GetMax());
+    }
+
+    HDRHistogram m_current;
+    HDRHistogram m_total;
+    uint64_t m_frame;
+
+};
+
 class StatTrace : public Stat {
 public:
 
-    static Stat *Create(uint16_t id, const char *name, FILE *fd)
+    static Stat *Create(uint16_t id, const char *name, TTAOutput *out)
     {
-        return new StatTrace(id, name, fd);
+        return new StatTrace(id, name, out);
     }
 
-    StatTrace(uint16_t id, const char *name, FILE *fd) : Stat(id, name, fd)
+    StatTrace(uint16_t id, const char *name, TTAOutput *out) : Stat(id, name, out)
     {
         m_index = 0;
     }
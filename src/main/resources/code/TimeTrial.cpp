@@ -4,10 +4,12 @@
 #include "Measure.hh"
 #include "Stat.hh"
 
+#include <errno.h>
+
 /** Mapping of stat types to factory methods. */
 static struct StatMap {
     uint16_t type;
-    Stat *(*create)(uint16_t id, const char *name, FILE *fd);
+    Stat *(*create)(uint16_t id, const char *name, TTAOutput *out);
 } g_stat_map[] = {
     { TTA_STAT_AVG,     &StatAvg::Create      },
     { TTA_STAT_MIN,     &StatMin::Create      },
@@ -15,6 +17,7 @@ static struct StatMap {
     { TTA_STAT_SUM,     &StatSum::Create      },
     { TTA_STAT_HIST,    &StatHist::Create     },
     { TTA_STAT_TRACE,   &StatTrace::Create    },
+    { TTA_STAT_HDR,     &StatHDR::Create      },
     { 0,                NULL                  }
 };
 
@@ -33,6 +36,31 @@ static struct MeasureMap {
     { 0,                            NULL                            }
 };
 
+/** Minimum number of entries in a per-thread buffer. */
+#define TTA_MIN_DEPTH 64
+
+/** Number of events between buffer checks when sampling. */
+#define TTA_SAMPLE_INTERVAL 64
+
+/** Largest sampling shift (1 of every 2^shift events is recorded). */
+#define TTA_MAX_SHIFT 16
+
+/** Most buffer slots to process from one buffer before moving on. */
+#define TTA_DRAIN_MAX 4096
+
+/** Handle for the buffer of the current thread.
+ * The instance number identifies the agent that owns the buffer so that
+ * a handle left over from a previous agent is not used.
+ */
+struct TTAHandle {
+    uint32_t instance;
+    TTABuffer *buf;
+};
+static __thread TTAHandle g_handle = { 0, NULL };
+
+/** Source of agent instance numbers (0 is never used). */
+static uint32_t g_instance = 0;
+
 /** Static method to start the thread. */
 void *TimeTrialAgent::StartThread(void *arg)
 {
@@ -40,74 +68,257 @@ void *TimeTrialAgent::StartThread(void *arg)
     return NULL;
 }
 
+/** Static method to start the ticker thread. */
+void *TimeTrialAgent::StartTicker(void *arg)
+{
+    reinterpret_cast<TimeTrialAgent*>(arg)->RunTicker();
+    return NULL;
+}
+
 /** Constructor. */
 TimeTrialAgent::TimeTrialAgent(const size_t buffer_size,
                                const int affinity,
-                               const char *filename) :
+                               const char *filename,
+                               const bool binary,
+                               const int overflow,
+                               const int precision) :
 
     m_buffer_size(buffer_size),
     m_affinity(affinity),
     m_filename(filename),
+    m_binary(binary),
+    m_overflow(overflow),
+    m_precision(precision),
     m_should_stop(false),
-    m_buffers(NULL)
+    m_stat_id(0),
+    m_tick_count(0),
+    m_buffers(NULL),
+    m_metrics_taps(NULL),
+    m_metrics_count(0)
 
 {
 
-    /* Get a rough estimate of how many CPU ticks are in a second. */
-    m_ticks_per_second = sp_get_ticks();
-    sleep(1);
-    m_ticks_per_second = sp_get_ticks() - m_ticks_per_second;
-    m_ticks_per_ns = (double)m_ticks_per_second / 1000000000.0;
     m_start_ticks = sp_get_ticks();
+    m_instance = __atomic_add_fetch(&g_instance, 1, __ATOMIC_RELAXED);
+    spw_init(&m_wait);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_tick_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&m_tick_lock, NULL);
 
-    pthread_key_create(&m_tls_key, NULL);
     pthread_create(&m_tid, NULL, StartThread, this);
+    pthread_create(&m_ticker, NULL, StartTicker, this);
 }
 
 /** Destructor. */
 TimeTrialAgent::~TimeTrialAgent()
 {
 
-    m_should_stop = true;
+    pthread_mutex_lock(&m_tick_lock);
+    __atomic_store_n(&m_should_stop, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&m_tick_cond);
+    pthread_mutex_unlock(&m_tick_lock);
+    spw_signal(&m_wait);
+    pthread_join(m_ticker, NULL);
     pthread_join(m_tid, NULL);
-    pthread_key_delete(m_tls_key);
+    pthread_cond_destroy(&m_tick_cond);
+    pthread_mutex_destroy(&m_tick_lock);
 
     while(m_buffers) {
         TTABuffer *next = m_buffers->next;
-        delete [] m_buffers->q;
+        free(m_buffers->q);
         delete m_buffers;
-        m_buffers = const_cast<TTABuffer*>(next);
+        m_buffers = next;
     }
 
 }
 
-/** Get a buffer for writing. */
-TTAEntry *TimeTrialAgent::StartWrite(uint32_t size)
+/** Get the number of entries in each per-thread buffer. */
+uint32_t TimeTrialAgent::GetBufferDepth() const
+{
+    const uint32_t depth = m_buffer_size / sizeof(TTAEntry);
+    return depth < TTA_MIN_DEPTH ? TTA_MIN_DEPTH : depth;
+}
+
+/** Create and register a buffer for the calling thread. */
+TTABuffer *TimeTrialAgent::AddBuffer()
 {
-    SPQ *q = reinterpret_cast<SPQ*>(pthread_getspecific(m_tls_key));
+    SPAQ *q = spaq_create(GetBufferDepth(), sizeof(TTAEntry));
     if(SPUNLIKELY(q == NULL)) {
-        const size_t qsize = spq_get_size(m_buffer_size, 1);
-        q = reinterpret_cast<SPQ*>(new char[qsize]);
-        spq_init(q, m_buffer_size, 1);
-        pthread_setspecific(m_tls_key, q);
-        TTABuffer *buf = new TTABuffer;
-        buf->q = q;
-        buf->next = const_cast<TTABuffer*>(m_buffers);
-        m_buffers = buf;
+        fprintf(stderr, "ERROR: could not allocate TimeTrial buffer\n");
+        exit(-1);
+    }
+
+    // Push the buffer on to the list.  The agent thread only walks the
+    // list, so a compare-and-swap on the head is all that is needed.
+    TTABuffer *buf = new TTABuffer;
+    buf->q = q;
+    buf->shift = 0;
+    buf->events = 0;
+    buf->has_lost = false;
+    buf->next = __atomic_load_n(&m_buffers, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&m_buffers, &buf->next, buf, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    g_handle.instance = m_instance;
+    g_handle.buf = buf;
+    return buf;
+}
+
+/** Get the buffer for the calling thread. */
+TTABuffer *TimeTrialAgent::GetBuffer()
+{
+    if(SPLIKELY(g_handle.instance == m_instance)) {
+        return g_handle.buf;
+    }
+    return AddBuffer();
+}
+
+/** Get a buffer for writing. */
+TTAEntry *TimeTrialAgent::StartWrite(SPAQ *q, uint32_t data_length)
+{
+    const uint32_t slots = TTA_ENTRY_SLOTS(data_length);
+    int spins = 0;
+    for(;;) {
+        uint32_t count = slots;
+        char *data = spaq_start_write_n(q, &count);
+        if(SPLIKELY(count == slots && data != NULL)) {
+            TTAEntry *entry = reinterpret_cast<TTAEntry*>(data);
+            entry->data_length = data_length;
+            return entry;
+        }
+        const uint32_t offset = q->write_ptr & (q->depth - 1);
+        if(data != NULL && offset + count == q->depth) {
+            // Not enough room before the end of the buffer.
+            // Fill the rest of the buffer with padding.
+            TTAEntry *pad = reinterpret_cast<TTAEntry*>(data);
+            pad->type = TTA_TYPE_PAD;
+            pad->data_length = (count - 1) * sizeof(TTAEntry);
+            spaq_finish_write(q, count);
+        } else {
+            spw_signal(&m_wait);
+            sp_spin_wait(&spins);
+        }
     }
-    const uint32_t total_size = sizeof(TTAEntry) + size;
-    char *data = spq_start_blocking_write(q, total_size);
-    TTAEntry *entry = reinterpret_cast<TTAEntry*>(data);
-    entry->data_length = size;
-    return entry;
 }
 
 /** Mark that we are finished with a write. */
-void TimeTrialAgent::FinishWrite(TTAEntry *entry)
+void TimeTrialAgent::FinishWrite(SPAQ *q, TTAEntry *entry)
 {
-    SPQ *q = reinterpret_cast<SPQ*>(pthread_getspecific(m_tls_key));
-    const uint32_t bytes = sizeof(TTAEntry) + entry->data_length;
-    spq_finish_write(q, bytes);
+    spaq_finish_write(q, TTA_ENTRY_SLOTS(entry->data_length));
+}
+
+/** Determine how many of count events to record when sampling. */
+uint32_t TimeTrialAgent::Sample(TTABuffer *buf, uint32_t count)
+{
+    const uint64_t before = buf->events;
+    buf->events += count;
+
+    // Adjust the rate based on how full the buffer is.
+    if((before / TTA_SAMPLE_INTERVAL) != (buf->events / TTA_SAMPLE_INTERVAL)) {
+        const uint32_t used = spaq_get_used(buf->q);
+        if(used > buf->q->depth / 2) {
+            spw_signal(&m_wait);
+        }
+        if(used > buf->q->depth / 2 && buf->shift < TTA_MAX_SHIFT) {
+            buf->shift += 1;
+        } else if(used < buf->q->depth / 8 && buf->shift > 0) {
+            buf->shift -= 1;
+        }
+    }
+
+    // Record the events that cross a multiple of 2^shift.
+    return (buf->events >> buf->shift) - (before >> buf->shift);
+}
+
+/** Add to the lost event count for a tap. */
+void TimeTrialAgent::AddLost(TTABuffer *buf, uint16_t tap_id, uint64_t count)
+{
+    if(tap_id >= buf->lost.size()) {
+        buf->lost.resize(tap_id + 1, 0);
+    }
+    buf->lost[tap_id] += count;
+    buf->has_lost = true;
+}
+
+/** Send lost event counts that have not been sent. */
+void TimeTrialAgent::SendLost(TTABuffer *buf)
+{
+    const uint64_t time_ns = GetTime();
+    buf->has_lost = false;
+    for(size_t tap_id = 0; tap_id < buf->lost.size(); tap_id++) {
+        if(buf->lost[tap_id] == 0) {
+            continue;
+        }
+        uint32_t n = 1;
+        char *data = spaq_start_write_n(buf->q, &n);
+        if(data == NULL) {
+            buf->has_lost = true;
+            return;
+        }
+        TTAEntry *entry     = reinterpret_cast<TTAEntry*>(data);
+        entry->tap_id       = tap_id;
+        entry->type         = TTA_TYPE_LOST;
+        entry->data_length  = 0;
+        entry->time_ns      = time_ns;
+        entry->value        = buf->lost[tap_id];
+        spaq_finish_write(buf->q, 1);
+        buf->lost[tap_id] = 0;
+    }
+}
+
+/** Write count copies of an event using the overflow policy. */
+void TimeTrialAgent::WriteEvents(TTABuffer *buf,
+                                 const TTAEntry &event,
+                                 uint32_t count)
+{
+
+    SPAQ *q = buf->q;
+    uint32_t left = count;
+    if(m_overflow == TTA_OVERFLOW_SAMPLE) {
+        left = Sample(buf, count);
+    }
+
+    // Send lost counts first so that they are not delayed indefinitely.
+    if(SPUNLIKELY(buf->has_lost)) {
+        SendLost(buf);
+    }
+
+    // Write as many entries as we can with each update.
+    // This is normally one update unless the buffer wraps.
+    int spins = 0;
+    while(left > 0) {
+        uint32_t n = left;
+        char *data = spaq_start_write_n(q, &n);
+        if(SPUNLIKELY(data == NULL)) {
+            spw_signal(&m_wait);
+            if(m_overflow == TTA_OVERFLOW_BLOCK) {
+                sp_spin_wait(&spins);
+                continue;
+            }
+            if(m_overflow == TTA_OVERFLOW_SAMPLE &&
+               buf->shift < TTA_MAX_SHIFT) {
+                buf->shift += 1;
+            }
+            break;
+        }
+        TTAEntry *entry = reinterpret_cast<TTAEntry*>(data);
+        for(uint32_t i = 0; i < n; i++) {
+            entry[i] = event;
+        }
+        spaq_finish_write(q, n);
+        left -= n;
+        count -= n;
+    }
+
+    // Anything not written is lost.
+    if(SPUNLIKELY(count > 0)) {
+        AddLost(buf, event.tap_id, count);
+    }
+
 }
 
 /** Send a startup message. */
@@ -122,8 +333,10 @@ void TimeTrialAgent::SendStart(const uint16_t tap_id,
     const uint64_t time_ns = GetTime();
 
     // Get a buffer.
+    // Startup messages are never dropped.
+    SPAQ *q = GetBuffer()->q;
     const size_t data_length = sizeof(TTAStartup) - sizeof(TTAEntry);
-    TTAEntry *entry = StartWrite(data_length);
+    TTAEntry *entry = StartWrite(q, data_length);
 
     // Write the data.
     TTAStartup *startup     = reinterpret_cast<TTAStartup*>(entry);
@@ -138,7 +351,7 @@ void TimeTrialAgent::SendStart(const uint16_t tap_id,
     startup->measure_type   = measure_type;
 
     // Finish the write.
-    FinishWrite(entry);
+    FinishWrite(q, entry);
 
 }
 
@@ -147,45 +360,181 @@ void TimeTrialAgent::LogEvent(const uint16_t tap_id,
                               const uint16_t type,
                               const uint64_t value)
 {
+    LogEvents(tap_id, type, 1, value);
+}
+
+/** Log the same event for each item in a batch. */
+void TimeTrialAgent::LogEvents(const uint16_t tap_id,
+                               const uint16_t type,
+                               const uint32_t count,
+                               const uint64_t value)
+{
 
     // Get the time stamp first.
-    const uint64_t time_ns = GetTime();
+    TTAEntry event;
+    event.time_ns       = GetTime();
+    event.tap_id        = tap_id;
+    event.type          = type;
+    event.data_length   = 0;
+    event.value         = value;
 
-    // Get a buffer.
-    TTAEntry *entry = StartWrite(0);
+    WriteEvents(GetBuffer(), event, count);
 
-    // Write the entry.
-    entry->tap_id       = tap_id;
-    entry->type         = type;
-    entry->time_ns      = time_ns;
-    entry->value        = value;
+}
 
-    // Finish the write.
-    FinishWrite(entry);
+/** Process the entries available in a buffer. */
+uint32_t TimeTrialAgent::Drain(SPAQ *q, TTAOutput *out)
+{
+    uint32_t total = 0;
+    while(total < TTA_DRAIN_MAX) {
+
+        // Process all of the contiguous entries and release them at once.
+        // Entries never wrap, so each run ends on an entry boundary.
+        char *data;
+        const uint32_t count = spaq_start_read(q, &data);
+        if(count == 0) {
+            break;
+        }
+        const TTAEntry *entries = reinterpret_cast<const TTAEntry*>(data);
+        uint32_t i = 0;
+        while(i < count) {
+            const TTAEntry *entry = &entries[i];
+            if(SPLIKELY(entry->type != TTA_TYPE_PAD)) {
+                ProcessEntry(entry, out);
+            }
+            i += TTA_ENTRY_SLOTS(entry->data_length);
+        }
+        spaq_finish_read(q, count);
+        total += count;
+
+    }
+    return total;
+}
+
+/** Create the measure for a startup message. */
+void TimeTrialAgent::AddMeasure(const TTAStartup *startup, TTAOutput *out)
+{
+
+    // Create the stat object.
+    const uint16_t id = m_stat_id;
+    m_stat_id += 1;
+    Stat *s = NULL;
+    for(int x = 0; g_stat_map[x].create != NULL; x++) {
+        if(g_stat_map[x].type == startup->stat_type) {
+            s = (g_stat_map[x].create)(id, startup->name, out);
+            break;
+        }
+    }
+    if(SPUNLIKELY(s == NULL)) {
+        fprintf(stderr, "ERROR: invalid stat type: %hu\n",
+                startup->stat_type);
+        exit(-1);
+    }
+    s->SetPrecision(m_precision);
+
+    // Create the measure object.
+    Measure *m = NULL;
+    bool hw = false;
+    for(int x = 0; g_measure_map[x].create != NULL; x++) {
+        if(g_measure_map[x].type == startup->measure_type) {
+            m = (g_measure_map[x].create)(s, hw);
+            break;
+        }
+    }
+    if(SPUNLIKELY(m == NULL)) {
+        fprintf(stderr, "ERROR: invalid measure type: %hu\n",
+                startup->measure_type);
+        exit(-1);
+    }
+
+    // Events for a tap come from the buffers of two threads, so one
+    // side can be up to a buffer behind the other.
+    m->SetSlack(GetBufferDepth());
+
+    // Tell the stat object to start.
+    s->Start();
+
+    // Insert the measure into the dispatch table.
+    const uint16_t tap = startup->header.tap_id;
+    if(tap >= m_taps.size()) {
+        m_taps.resize(tap + 1);
+    }
+    m_taps[tap].measures.push_back(m);
+    m_measures.push_back(m);
+
+}
+
+/** Process an entry from a buffer. */
+void TimeTrialAgent::ProcessEntry(const TTAEntry *entry, TTAOutput *out)
+{
+
+    const uint16_t tap = entry->tap_id;
+
+    // Handle startup messages.
+    if(SPUNLIKELY(entry->type == TTA_TYPE_START)) {
+        AddMeasure(reinterpret_cast<const TTAStartup*>(entry), out);
+    }
+
+    // Pass the event to the measures for this tap.
+    if(SPUNLIKELY(tap >= m_taps.size() || m_taps[tap].measures.empty())) {
+        fprintf(stderr, "WARN: no measure for tap %hu\n", tap);
+        return;
+    }
+    TTATap &t = m_taps[tap];
+    for(size_t i = 0; i < t.measures.size(); i++) {
+        t.measures[i]->ProcessEvent(entry);
+    }
+    if(SPUNLIKELY(entry->type == TTA_TYPE_LOST)) {
+        t.lost += entry->value;
+    } else {
+        t.events += 1;
+    }
 
 }
 
+/** Publish tap counts to live metrics. */
+void TimeTrialAgent::SetMetrics(SPMetricsTap *taps, uint32_t count)
+{
+    m_metrics_count = count;
+    __atomic_store_n(&m_metrics_taps, taps, __ATOMIC_RELEASE);
+}
 
-/** Read a buffer entry. */
-TTAEntry *TimeTrialAgent::ReadEntry(SPQ *q)
+/** Copy tap counts to live metrics. */
+void TimeTrialAgent::PublishMetrics()
 {
-    char *data;
-    const uint32_t size = spq_start_read(q, &data);
-    if(size < sizeof(TTAEntry)) {
-        return NULL;
+    SPMetricsTap *taps = __atomic_load_n(&m_metrics_taps, __ATOMIC_ACQUIRE);
+    if(taps == NULL) {
+        return;
     }
-    TTAEntry *entry = reinterpret_cast<TTAEntry*>(data);
-    if(SPUNLIKELY(size < sizeof(TTAEntry) + entry->data_length)) {
-        return NULL;
+    for(uint32_t i = 0; i < m_metrics_count; i++) {
+        const uint32_t tap = taps[i].tap_id;
+        if(tap < m_taps.size()) {
+            __atomic_store_n(&taps[i].events, m_taps[tap].events,
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&taps[i].lost, m_taps[tap].lost,
+                             __ATOMIC_RELAXED);
+        }
     }
-    return entry;
 }
 
-/** Mark that we are finished with a read. */
-void TimeTrialAgent::FinishRead(SPQ *q, TTAEntry *entry)
+/** Body of the thread that drives Tick. */
+void TimeTrialAgent::RunTicker()
 {
-    const uint32_t bytes = sizeof(TTAEntry) + entry->data_length;
-    spq_finish_read(q, bytes);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&m_tick_lock);
+    while(!__atomic_load_n(&m_should_stop, __ATOMIC_ACQUIRE)) {
+        deadline.tv_sec += 1;
+        int rc = 0;
+        while(rc != ETIMEDOUT &&
+              !__atomic_load_n(&m_should_stop, __ATOMIC_ACQUIRE)) {
+            rc = pthread_cond_timedwait(&m_tick_cond, &m_tick_lock,
+                                        &deadline);
+        }
+        __atomic_add_fetch(&m_tick_count, 1, __ATOMIC_RELAXED);
+        spw_signal(&m_wait);
+    }
+    pthread_mutex_unlock(&m_tick_lock);
 }
 
 /** Thread body. */
@@ -205,110 +554,83 @@ void TimeTrialAgent::Run()
         }
     }
 
+    TTAOutput *out = TTAOutput::Create(fd, m_binary);
+
     // Loop processing the buffers.
-    uint16_t stat_id = 0;
-    typedef std::multimap<uint16_t, Measure*>::const_iterator MI;
-    typedef std::list<SPQ*>::const_iterator BI;
-    uint64_t last_ticks = 0;
+    uint32_t last_tick = 0;
     bool data_since_update = false;
-    while(SPLIKELY(!m_should_stop)) {
-
-        const uint64_t ticks = sp_get_ticks();
+    bool flushed = true;
+    SPWaitState state;
+    spw_start(&state);
+    while(SPLIKELY(!__atomic_load_n(&m_should_stop, __ATOMIC_ACQUIRE))) {
 
         // Perform per-second updates.
-        if(ticks - last_ticks >= m_ticks_per_second) {
+        const uint32_t tick = __atomic_load_n(&m_tick_count, __ATOMIC_RELAXED);
+        if(SPUNLIKELY(tick != last_tick)) {
             if(data_since_update) {
-                for(MI it = m_measures.begin(); it != m_measures.end(); ++it) {
-                    it->second->Tick(1.0);
+                for(size_t i = 0; i < m_measures.size(); i++) {
+                    m_measures[i]->Tick(1.0);
                 }
                 data_since_update = false;
             }
-            last_ticks = ticks;
+            PublishMetrics();
+            last_tick = tick;
         }
 
         // Process data from the buffers.
         bool got_data = false;
-        for(TTABuffer *buf = const_cast<TTABuffer*>(m_buffers);
+        for(TTABuffer *buf = __atomic_load_n(&m_buffers, __ATOMIC_ACQUIRE);
             buf != NULL;
             buf = buf->next) {
-
-            TTAEntry *entry = ReadEntry(buf->q);
-            if(entry != NULL) {
-                const uint16_t tap = entry->tap_id;
-
-                // Handle startup messages.
-                if(entry->type == TTA_TYPE_START) {
-
-                    const TTAStartup *startup
-                        = reinterpret_cast<const TTAStartup*>(entry);
-
-                    // Create the stat object.
-                    const uint16_t id = stat_id;
-                    stat_id += 1;
-                    Stat *s = NULL;
-                    for(int x = 0; g_stat_map[x].create != NULL; x++) {
-                        if(g_stat_map[x].type == startup->stat_type) {
-                            s = (g_stat_map[x].create)(id, startup->name, fd);
-                            break;
-                        }
-                    }
-                    if(SPUNLIKELY(s == NULL)) {
-                        fprintf(stderr, "ERROR: invalid stat type: %hu\n",
-                                startup->stat_type);
-                        exit(-1);
-                    }
-
-                    // Create the measure object.
-                    Measure *m = NULL;
-                    bool hw = false;
-                    for(int x = 0; g_measure_map[x].create != NULL; x++) {
-                        if(g_measure_map[x].type == startup->measure_type) {
-                            m = (g_measure_map[x].create)(s, hw);
-                            break;
-                        }
-                    }
-                    if(SPUNLIKELY(m == NULL)) {
-                        fprintf(stderr, "ERROR: invalid measure type: %hu\n",
-                                startup->measure_type);
-                        exit(-1);
-                    }
-
-                    // Tell the stat object to start.
-                    s->Start();
-
-                    // Insert the measure into our mapping.
-                    m_measures.insert(std::make_pair(tap, m));
-
-                }
-
-                // Look up the measure for this tap.
-                std::pair<MI, MI> range = m_measures.equal_range(tap);
-                for(MI mit = range.first; mit != range.second; mit++) {
-                    mit->second->ProcessEvent(entry);
-                }
-                if(SPUNLIKELY(range.first == range.second)) {
-                    fprintf(stderr, "WARN: no measure for tap %hu\n", tap);
-                }
-
-                FinishRead(buf->q, entry);
+            if(Drain(buf->q, out) > 0) {
                 got_data = true;
-
             }
         }
-        if(!got_data) {
-            fflush(fd);
-            sched_yield();
-        } else {
+        if(got_data) {
             data_since_update = true;
+            flushed = false;
+            spw_start(&state);
+        } else {
+            if(!flushed) {
+                out->Idle();
+                flushed = true;
+            }
+            // Block once the spin budget is used up.  Writers only
+            // signal when their buffer fills, so the wait times out to
+            // pick up partial buffers.
+            spw_wait(&m_wait, &state);
         }
 
     }
 
+    // Process what is left in the buffers.  The threads logging events
+    // have stopped, so lost counts they did not send are read directly.
+    for(TTABuffer *buf = __atomic_load_n(&m_buffers, __ATOMIC_ACQUIRE);
+        buf != NULL;
+        buf = buf->next) {
+        while(Drain(buf->q, out) > 0);
+        for(size_t tap_id = 0; tap_id < buf->lost.size(); tap_id++) {
+            if(buf->lost[tap_id] > 0) {
+                TTAEntry lost;
+                lost.tap_id         = tap_id;
+                lost.type           = TTA_TYPE_LOST;
+                lost.data_length    = 0;
+                lost.time_ns        = GetTime();
+                lost.value          = buf->lost[tap_id];
+                ProcessEntry(&lost, out);
+                buf->lost[tap_id] = 0;
+            }
+        }
+    }
+
+    PublishMetrics();
+
     // Destroy measures.
-    for(MI mit = m_measures.begin(); mit != m_measures.end(); ++mit) {
-        mit->second->Stop(1.0);
-        delete mit->second;
+    for(size_t i = 0; i < m_measures.size(); i++) {
+        m_measures[i]->Stop(1.0);
+        delete m_measures[i];
     }
+    delete out;
 
     // Close the file.
     if(m_filename) {
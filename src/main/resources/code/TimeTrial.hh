@@ -4,10 +4,11 @@
 #define TimeTrial_HH_
 
 #include "ScalaPipe.h"
+#include "Metrics.h"
 
 #include <pthread.h>
 #include <unistd.h>
-#include <map>
+#include <vector>
 
 #define TTA_COOKIE          0x1337
 #define TTA_BUFFER_COOKIE   (TTA_COOKIE + 1)
@@ -24,6 +25,12 @@
 #define TTA_TYPE_HFULL      8   // Hardware fulls.
 #define TTA_TYPE_HINTERPUSH 9   // Interpush histogram from hardware.
 #define TTA_TYPE_HINTERPOP  10  // Interpop histogram from hardware.
+#define TTA_TYPE_PAD        11  // Unused space at the end of a buffer.
+#define TTA_TYPE_LOST       12  // Events not recorded due to overflow.
+
+#define TTA_OVERFLOW_BLOCK  0   // Wait for room in the buffer.
+#define TTA_OVERFLOW_DROP   1   // Drop events that do not fit.
+#define TTA_OVERFLOW_SAMPLE 2   // Record fewer events as the buffer fills.
 
 #define TTA_STAT_AVG    0
 #define TTA_STAT_MIN    1
@@ -31,6 +38,7 @@
 #define TTA_STAT_SUM    3
 #define TTA_STAT_HIST   4
 #define TTA_STAT_TRACE  5
+#define TTA_STAT_HDR    6
 
 #define TTA_MEASURE_RATE            0
 #define TTA_MEASURE_UTILIZATION     1
@@ -50,6 +58,10 @@ struct TTAEntry {
     uint64_t value;
 };
 
+/** Number of buffer slots used by an entry with data_length bytes. */
+#define TTA_ENTRY_SLOTS( data_length ) \
+    (1 + ((data_length) + sizeof(TTAEntry) - 1) / sizeof(TTAEntry))
+
 /** Event for describing an edge to be measured. */
 struct TTAStartup {
     TTAEntry header;
@@ -59,12 +71,33 @@ struct TTAStartup {
     uint32_t queue_depth;   /**< Depth of the queue. */
 };
 
+/** Per-thread buffer.
+ * Each thread logging events gets its own single-producer buffer, so
+ * threads never contend with each other.  Buffers are only added to
+ * the list and are freed when the agent is destroyed.
+ * Fields other than q and next are only used by the producer.
+ */
 struct TTABuffer {
-    SPQ *q;
+    SPAQ *q;
     struct TTABuffer *next;
+    uint32_t shift;                 /**< Record 1 of every 2^shift events. */
+    uint64_t events;                /**< Events seen (for sampling). */
+    bool has_lost;                  /**< Set if lost has a count to send. */
+    std::vector<uint64_t> lost;     /**< Unreported lost events by tap. */
 };
 
 class Measure;
+class TTAOutput;
+
+/** Measures and counts for a tap. */
+struct TTATap {
+    TTATap() : events(0), lost(0)
+    {
+    }
+    std::vector<Measure*> measures;
+    uint64_t events;        /**< Events processed. */
+    uint64_t lost;          /**< Events reported lost. */
+};
 
 class TimeTrialAgent {
 public:
@@ -73,10 +106,16 @@ public:
      * @param buffer_size The size of each buffer in bytes.
      * @param affinity CPU to use (-1 for any CPU).
      * @param filename File name (NULL for stdout).
+     * @param binary Set to write the binary trace format.
+     * @param overflow What to do when a buffer is full (TTA_OVERFLOW_*).
+     * @param precision Significant digits for log-scale statistics.
      */
     TimeTrialAgent(const size_t buffer_size,
                    const int affinity,
-                   const char *filename);
+                   const char *filename,
+                   const bool binary = false,
+                   const int overflow = TTA_OVERFLOW_BLOCK,
+                   const int precision = 2);
 
     /** Destructor. */
     ~TimeTrialAgent();
@@ -93,35 +132,75 @@ public:
                   const uint16_t type,
                   const uint64_t value = 0);
 
+    /** Publish tap counts to live metrics.
+     * The counts for each tap in the array are updated once per second.
+     * @param taps The taps to update, identified by tap_id.
+     * @param count The number of taps.
+     */
+    void SetMetrics(SPMetricsTap *taps, uint32_t count);
+
+    /** Log the same event for each item in a batch.
+     * This publishes all of the events with one buffer update.
+     */
+    void LogEvents(const uint16_t tap_id,
+                   const uint16_t type,
+                   const uint32_t count,
+                   const uint64_t value = 0);
+
 private:
 
     /** Get time since startup in nanoseconds. */
     uint64_t GetTime() const
     {
-        const uint64_t ticks = sp_get_ticks() - m_start_ticks;
-        return (uint64_t)(ticks * m_ticks_per_ns);
+        return sp_ticks_to_ns(sp_get_ticks() - m_start_ticks);
     }
 
-    /** Read a buffer entry.
-     * Note that FinishRead must be called before calling this again.
-     * @param q The queue to read.
-     * @return A pointer to the entry (NULL if none are available).
+    /** Get the buffer for the calling thread, creating it if needed. */
+    TTABuffer *GetBuffer();
+
+    /** Get the number of entries in each per-thread buffer. */
+    uint32_t GetBufferDepth() const;
+
+    /** Create and register a buffer for the calling thread. */
+    TTABuffer *AddBuffer();
+
+    /** Write count copies of an event using the overflow policy. */
+    void WriteEvents(TTABuffer *buf, const TTAEntry &event, uint32_t count);
+
+    /** Determine how many of count events to record when sampling. */
+    uint32_t Sample(TTABuffer *buf, uint32_t count);
+
+    /** Add to the lost event count for a tap. */
+    void AddLost(TTABuffer *buf, uint16_t tap_id, uint64_t count);
+
+    /** Send lost event counts that have not been sent. */
+    void SendLost(TTABuffer *buf);
+
+    /** Process the entries available in a buffer.
+     * @return The number of buffer slots consumed.
      */
-    TTAEntry *ReadEntry(SPQ *q);
+    uint32_t Drain(SPAQ *q, TTAOutput *out);
+
+    /** Process an entry from a buffer. */
+    void ProcessEntry(const TTAEntry *entry, TTAOutput *out);
+
+    /** Create the measure for a startup message. */
+    void AddMeasure(const TTAStartup *startup, TTAOutput *out);
 
-    /** Mark that we are finished with a read. */
-    void FinishRead(SPQ *q, TTAEntry *entry);
+    /** Copy tap counts to live metrics. */
+    void PublishMetrics();
 
     /** Get a buffer for writing.
      * Note that FinishWrite must be called before calling this again.
-     * @param buffer The buffer to use.
+     * This blocks until there is room.
+     * @param q The buffer to use.
      * @param data_length The data length in bytes (may be zero).
-     * @return A pointer to an entry or NULL if there is no room.
+     * @return A pointer to the entry.
      */
-    TTAEntry *StartWrite(uint32_t size);
+    TTAEntry *StartWrite(SPAQ *q, uint32_t data_length);
 
     /** Mark that we are finished with a write. */
-    void FinishWrite(TTAEntry *entry);
+    void FinishWrite(SPAQ *q, TTAEntry *entry);
 
     /** The thread body. */
     void Run();
@@ -129,22 +208,46 @@ private:
     /** Static method to start the thread. */
     static void *StartThread(void *arg);
 
+    /** Body of the thread that drives Tick. */
+    void RunTicker();
+
+    /** Static method to start the ticker thread. */
+    static void *StartTicker(void *arg);
+
     const size_t    m_buffer_size;
     const int       m_affinity;
     const char     *m_filename;
-    volatile bool   m_should_stop;
+    const bool      m_binary;
+    const int       m_overflow;
+    const int       m_precision;
+    bool            m_should_stop;
 
     uint64_t        m_start_ticks;
-    uint64_t        m_ticks_per_second;
-    double          m_ticks_per_ns;
-    pthread_key_t   m_tls_key;
+    uint32_t        m_instance;
+    uint16_t        m_stat_id;
     pthread_t       m_tid;
 
-    // Per-thread buffers.
-    volatile TTABuffer *m_buffers;
+    // Ticker state.  m_tick_count is incremented once per second.
+    pthread_t       m_ticker;
+    pthread_mutex_t m_tick_lock;
+    pthread_cond_t  m_tick_cond;
+    uint32_t        m_tick_count;
+
+    // Signaled to wake the agent thread when it is idle.
+    SPWait          m_wait;
+
+    // Per-thread buffers (updated atomically).
+    TTABuffer      *m_buffers;
+
+    // Taps indexed by tap ID.
+    std::vector<TTATap> m_taps;
+
+    // Live metrics for taps (set atomically).
+    SPMetricsTap   *m_metrics_taps;
+    uint32_t        m_metrics_count;
 
-    // Mapping of tap IDs to measure objects.
-    std::multimap<uint16_t, Measure*> m_measures;
+    // All measures.
+    std::vector<Measure*> m_measures;
 
 
 };
@@ -0,0 +1,166 @@
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__i386) || defined(__x86_64__)
+#   include <cpuid.h>
+#   define SP_HAS_TSC 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Timebase for ticks.
+ * Ticks come from the TSC if it is invariant, that is, if it runs at a
+ * constant rate in all P- and C-states.  Otherwise ticks are nanoseconds
+ * from the monotonic clock.  sp_timebase_init must be called before
+ * ticks from the TSC are used, but ticks are nanoseconds until then.
+ *
+ * There is one timebase per process, shared by every translation unit.
+ * It is defined with SP_TIMEBASE_DEFINE in the generated process code,
+ * which initializes it from main before any threads start.
+ */
+typedef struct {
+    int use_tsc;                /**< Set if ticks come from the TSC. */
+    uint64_t ticks_per_second;  /**< Number of ticks per second. */
+    double ns_per_tick;         /**< Nanoseconds per tick. */
+} SPTimebase;
+
+extern SPTimebase sp_timebase;
+
+/** Define the timebase (in exactly one translation unit). */
+#define SP_TIMEBASE_DEFINE \
+    SPTimebase sp_timebase = { 0, 1000000000ULL, 1.0 }
+
+/** Time to spend calibrating the TSC (in nanoseconds). */
+#ifndef SP_TIMEBASE_CALIBRATE_NS
+#   define SP_TIMEBASE_CALIBRATE_NS 10000000
+#endif
+
+/** Get nanoseconds from the monotonic clock. */
+static inline uint64_t sp_get_clock_ns()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Read the TSC. */
+static inline uint64_t sp_read_tsc()
+{
+#ifdef SP_HAS_TSC
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+/** Method to get CPU ticks. */
+static inline uint64_t sp_get_ticks()
+{
+#ifdef SP_HAS_TSC
+    if(__builtin_expect(sp_timebase.use_tsc, 1)) {
+        return sp_read_tsc();
+    }
+#endif
+    return sp_get_clock_ns();
+}
+
+/** Convert ticks to nanoseconds. */
+static inline uint64_t sp_ticks_to_ns(uint64_t ticks)
+{
+    return (uint64_t)(ticks * sp_timebase.ns_per_tick);
+}
+
+#ifdef SP_HAS_TSC
+
+/** Determine if the TSC is invariant. */
+static inline int sp_tsc_is_invariant()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx)
+        || eax < 0x80000007) {
+        return 0;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx & (1 << 8)) != 0;
+}
+
+/** Get the TSC frequency from the CPU or the kernel (0 if unknown). */
+static inline uint64_t sp_tsc_get_frequency()
+{
+
+    /* Leaf 0x15 gives the TSC to crystal clock ratio. */
+    unsigned int eax, ebx, ecx, edx;
+    if(__get_cpuid(0, &eax, &ebx, &ecx, &edx) && eax >= 0x15) {
+        __get_cpuid(0x15, &eax, &ebx, &ecx, &edx);
+        if(eax != 0 && ebx != 0 && ecx != 0) {
+            return (uint64_t)ecx * ebx / eax;
+        }
+    }
+
+    /* Some kernels export the frequency they calibrated. */
+    uint64_t khz = 0;
+    FILE *fd = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+    if(fd != NULL) {
+        if(fscanf(fd, "%llu", (unsigned long long*)&khz) != 1) {
+            khz = 0;
+        }
+        fclose(fd);
+    }
+    return khz * 1000;
+
+}
+
+/** Measure the TSC frequency against the monotonic clock. */
+static inline uint64_t sp_tsc_calibrate()
+{
+    const uint64_t start_ns = sp_get_clock_ns();
+    const uint64_t start_ticks = sp_read_tsc();
+    uint64_t stop_ns;
+    do {
+        stop_ns = sp_get_clock_ns();
+    } while(stop_ns - start_ns < SP_TIMEBASE_CALIBRATE_NS);
+    const uint64_t stop_ticks = sp_read_tsc();
+    return (uint64_t)((double)(stop_ticks - start_ticks) * 1000000000.0
+                      / (double)(stop_ns - start_ns));
+}
+
+#endif
+
+/** Initialize the timebase.
+ * This is safe to call more than once.
+ */
+static inline void sp_timebase_init()
+{
+#ifdef SP_HAS_TSC
+    if(sp_timebase.use_tsc || !sp_tsc_is_invariant()) {
+        return;
+    }
+    uint64_t freq = sp_tsc_get_frequency();
+    if(freq == 0) {
+        freq = sp_tsc_calibrate();
+    }
+    if(freq > 0) {
+        sp_timebase.ticks_per_second = freq;
+        sp_timebase.ns_per_tick = 1000000000.0 / (double)freq;
+        sp_timebase.use_tsc = 1;
+    }
+#endif
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef TRACEOUTPUT_HH_
+#define TRACEOUTPUT_HH_
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <vector>
+
+/** Binary trace format.
+ * A binary trace starts with a TTAFileHeader followed by blocks.  Each
+ * block starts with a TTABlockHeader.  A TTA_BLOCK_TAP block holds a
+ * TTATapHeader describing a tap and comes before any data for the tap.
+ * A TTA_BLOCK_DATA block holds data points for one tap.  Each point is
+ * three varints: the frame delta, the zigzag-encoded index delta, and
+ * the value.  Deltas start from zero in each block so that blocks can
+ * be decoded independently.  A TTA_BLOCK_LOST block holds a varint
+ * count of events for the tap that were not recorded.
+ */
+#define TTA_FILE_MAGIC      0x54545053  // "SPTT"
+#define TTA_FILE_VERSION    1
+
+#define TTA_BLOCK_TAP       1
+#define TTA_BLOCK_DATA      2
+#define TTA_BLOCK_LOST      3
+
+/** Size at which a data block for a tap is written (in bytes). */
+#ifndef TTA_BLOCK_SIZE
+#   define TTA_BLOCK_SIZE   4096
+#endif
+
+/** Size of the buffer for writing blocks (in bytes). */
+#ifndef TTA_WRITE_SIZE
+#   define TTA_WRITE_SIZE   (1 << 20)
+#endif
+
+struct TTAFileHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+};
+
+struct TTABlockHeader {
+    uint16_t kind;          /**< TTA_BLOCK_*. */
+    uint16_t tap_id;        /**< Tap the block belongs to. */
+    uint32_t length;        /**< Length of the data after the header. */
+};
+
+struct TTATapHeader {
+    char type[16];          /**< Statistic type. */
+    char name[64];          /**< Name of the edge. */
+    char xlabel[64];        /**< Label for the values. */
+};
+
+/** Append a varint to a buffer. */
+static inline void tta_put_varint(std::vector<uint8_t> &buf, uint64_t v)
+{
+    while(v >= 0x80) {
+        buf.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((uint8_t)v);
+}
+
+/** Read a varint.
+ * @return The number of bytes read (0 if the varint is truncated).
+ */
+static inline size_t tta_get_varint(const uint8_t *ptr, size_t size,
+                                    uint64_t *v)
+{
+    uint64_t result = 0;
+    for(size_t i = 0; i < size && i < 10; i++) {
+        result |= (uint64_t)(ptr[i] & 0x7F) << (7 * i);
+        if((ptr[i] & 0x80) == 0) {
+            *v = result;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/** Encode a signed delta so that small magnitudes are small. */
+static inline uint64_t tta_zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+/** Decode a zigzag-encoded delta. */
+static inline int64_t tta_unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/** Destination for statistics. */
+class TTAOutput {
+public:
+
+    /** Create an output.
+     * @param fd The file to write.
+     * @param binary Set to write the binary format instead of text.
+     */
+    static TTAOutput *Create(FILE *fd, bool binary);
+
+    virtual ~TTAOutput()
+    {
+    }
+
+    /** Describe a tap. */
+    virtual void Start(uint16_t tap_id, const char *type, const char *name,
+                       const char *xlabel) = 0;
+
+    /** Record a data point. */
+    virtual void Print(uint16_t tap_id, uint64_t frame, uint64_t index,
+                       uint64_t value) = 0;
+
+    /** Record a count of events that were not recorded. */
+    virtual void Lost(uint16_t tap_id, uint64_t count) = 0;
+
+    /** Called when the agent has nothing else to do. */
+    virtual void Idle()
+    {
+    }
+
+    /** Write everything that is buffered. */
+    virtual void Flush() = 0;
+
+};
+
+/** Output in text (CSV) format. */
+class TTATextOutput : public TTAOutput {
+public:
+
+    TTATextOutput(FILE *fd) : m_fd(fd)
+    {
+    }
+
+    virtual ~TTATextOutput()
+    {
+        Flush();
+    }
+
+    virtual void Start(uint16_t tap_id, const char *type, const char *name,
+                       const char *xlabel)
+    {
+        fprintf(m_fd, "s,%hu,%s,%s,%s\n", tap_id, type, name, xlabel);
+    }
+
+    virtual void Print(uint16_t tap_id, uint64_t frame, uint64_t index,
+                       uint64_t value)
+    {
+        fprintf(m_fd, "d,%hu,%lu,%lu,%lu\n", tap_id, frame, index, value);
+    }
+
+    virtual void Lost(uint16_t tap_id, uint64_t count)
+    {
+        fprintf(m_fd, "l,%hu,%lu\n", tap_id, count);
+    }
+
+    virtual void Idle()
+    {
+        fflush(m_fd);
+    }
+
+    virtual void Flush()
+    {
+        fflush(m_fd);
+    }
+
+private:
+
+    FILE *m_fd;
+
+};
+
+/** Output in the binary format.
+ * Points are encoded into a block per tap.  Full blocks are collected
+ * in a large buffer that is written in one call when it fills.
+ */
+class TTABinaryOutput : public TTAOutput {
+public:
+
+    TTABinaryOutput(FILE *fd) : m_fd(fd)
+    {
+        m_buffer.reserve(TTA_WRITE_SIZE);
+        TTAFileHeader header;
+        header.magic = TTA_FILE_MAGIC;
+        header.version = TTA_FILE_VERSION;
+        header.reserved = 0;
+        Append(&header, sizeof(header));
+    }
+
+    virtual ~TTABinaryOutput()
+    {
+        Flush();
+    }
+
+    virtual void Start(uint16_t tap_id, const char *type, const char *name,
+                       const char *xlabel)
+    {
+        TTATapHeader tap;
+        memset(&tap, 0, sizeof(tap));
+        strncpy(tap.type, type, sizeof(tap.type) - 1);
+        strncpy(tap.name, name, sizeof(tap.name) - 1);
+        strncpy(tap.xlabel, xlabel, sizeof(tap.xlabel) - 1);
+        AppendBlock(TTA_BLOCK_TAP, tap_id, &tap, sizeof(tap));
+    }
+
+    virtual void Print(uint16_t tap_id, uint64_t frame, uint64_t index,
+                       uint64_t value)
+    {
+        if(tap_id >= m_taps.size()) {
+            m_taps.resize(tap_id + 1);
+        }
+        Tap &tap = m_taps[tap_id];
+        tta_put_varint(tap.data, frame - tap.last_frame);
+        tta_put_varint(tap.data,
+                       tta_zigzag((int64_t)(index - tap.last_index)));
+        tta_put_varint(tap.data, value);
+        tap.last_frame = frame;
+        tap.last_index = index;
+        if(tap.data.size() >= TTA_BLOCK_SIZE) {
+            FlushTap(tap_id);
+        }
+    }
+
+    virtual void Lost(uint16_t tap_id, uint64_t count)
+    {
+        std::vector<uint8_t> data;
+        tta_put_varint(data, count);
+        AppendBlock(TTA_BLOCK_LOST, tap_id, &data[0], data.size());
+    }
+
+    virtual void Flush()
+    {
+        for(size_t i = 0; i < m_taps.size(); i++) {
+            FlushTap(i);
+        }
+        Write();
+        fflush(m_fd);
+    }
+
+private:
+
+    struct Tap {
+        Tap() : last_frame(0), last_index(0)
+        {
+        }
+        std::vector<uint8_t> data;
+        uint64_t last_frame;
+        uint64_t last_index;
+    };
+
+    void FlushTap(size_t tap_id)
+    {
+        Tap &tap = m_taps[tap_id];
+        if(!tap.data.empty()) {
+            AppendBlock(TTA_BLOCK_DATA, tap_id, &tap.data[0], tap.data.size());
+            tap.data.clear();
+            tap.last_frame = 0;
+            tap.last_index = 0;
+        }
+    }
+
+    void AppendBlock(uint16_t kind, uint16_t tap_id, const void *data,
+                     size_t length)
+    {
+        TTABlockHeader header;
+        header.kind = kind;
+        header.tap_id = tap_id;
+        header.length = length;
+        Append(&header, sizeof(header));
+        Append(data, length);
+    }
+
+    void Append(const void *data, size_t length)
+    {
+        if(m_buffer.size() + length > TTA_WRITE_SIZE) {
+            Write();
+        }
+        const uint8_t *ptr = (const uint8_t*)data;
+        m_buffer.insert(m_buffer.end(), ptr, ptr + length);
+    }
+
+    void Write()
+    {
+        if(!m_buffer.empty()) {
+            fwrite(&m_buffer[0], 1, m_buffer.size(), m_fd);
+            m_buffer.clear();
+        }
+    }
+
+    FILE *m_fd;
+    std::vector<uint8_t> m_buffer;
+    std::vector<Tap> m_taps;
+
+};
+
+inline TTAOutput *TTAOutput::Create(FILE *fd, bool binary)
+{
+    if(binary) {
+        return new TTABinaryOutput(fd);
+    } else {
+        return new TTATextOutput(fd);
+    }
+}
+
+#endif
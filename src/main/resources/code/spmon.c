@@ -0,0 +1,153 @@
+/** Watch the live metrics of a running ScalaPipe process. */
+
+#include "Metrics.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+/** Map the segment for a process.
+ * @return The segment (NULL if it does not exist).
+ */
+static SPMetrics *Open(int pid, size_t *size)
+{
+    char name[64];
+    sp_metrics_name(name, sizeof(name), pid);
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(SPMetrics)) {
+        close(fd);
+        return NULL;
+    }
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        return NULL;
+    }
+    SPMetrics *m = (SPMetrics*)ptr;
+    if(__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != SP_METRICS_MAGIC
+        || m->version != SP_METRICS_VERSION
+        || sp_metrics_size(m->kernel_count, m->queue_count, m->tap_count)
+            > (size_t)st.st_size) {
+        munmap(ptr, st.st_size);
+        return NULL;
+    }
+    *size = sp_metrics_size(m->kernel_count, m->queue_count, m->tap_count);
+    return m;
+}
+
+/** Determine if the segment for a process still exists. */
+static int Exists(int pid)
+{
+    char name[64];
+    sp_metrics_name(name, sizeof(name), pid);
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) {
+        return 0;
+    }
+    close(fd);
+    return 1;
+}
+
+/** Show the change between two snapshots. */
+static void Show(SPMetrics *last, SPMetrics *current)
+{
+
+    const double seconds = (double)(current->ticks - last->ticks)
+                         / (double)current->ticks_per_second;
+    if(seconds <= 0.0) {
+        return;
+    }
+    const uint64_t elapsed = current->ticks - last->ticks;
+    printf("time: %.3f s\n", (double)current->ticks
+                             / (double)current->ticks_per_second);
+
+    // Kernels.  The busiest kernel is the likely bottleneck.
+    SPMetricsKernel *lk = sp_metrics_kernels(last);
+    SPMetricsKernel *ck = sp_metrics_kernels(current);
+    uint32_t busiest = current->kernel_count;
+    double busiest_percent = 0.0;
+    for(uint32_t i = 0; i < current->kernel_count; i++) {
+        const double percent = 100.0 * (double)(ck[i].ticks - lk[i].ticks)
+                             / (double)elapsed;
+        if(percent > busiest_percent) {
+            busiest = i;
+            busiest_percent = percent;
+        }
+    }
+    for(uint32_t i = 0; i < current->kernel_count; i++) {
+        const double percent = 100.0 * (double)(ck[i].ticks - lk[i].ticks)
+                             / (double)elapsed;
+        const double rate = (double)(ck[i].reads - lk[i].reads) / seconds;
+        printf("  %c %-40s %6.1f%% busy %12.0f reads/s",
+               i == busiest ? '*' : ' ', ck[i].name, percent, rate);
+        const uint64_t cycles = ck[i].counters[0] - lk[i].counters[0];
+        if(cycles > 0) {
+            const uint64_t insts = ck[i].counters[1] - lk[i].counters[1];
+            const uint64_t misses = ck[i].counters[2] - lk[i].counters[2];
+            printf(" %5.2f IPC %12.0f LLC misses/s",
+                   (double)insts / cycles, misses / seconds);
+        }
+        printf("\n");
+    }
+
+    // Queues.
+    SPMetricsQueue *cq = sp_metrics_queues(current);
+    for(uint32_t i = 0; i < current->queue_count; i++) {
+        const double percent = cq[i].depth > 0
+                             ? 100.0 * cq[i].used / cq[i].depth : 0.0;
+        printf("    %-40s %6.1f%% full (%u / %u)\n",
+               cq[i].name, percent, cq[i].used, cq[i].depth);
+    }
+
+    // TimeTrial taps.
+    SPMetricsTap *lt = sp_metrics_taps(last);
+    SPMetricsTap *ct = sp_metrics_taps(current);
+    for(uint32_t i = 0; i < current->tap_count; i++) {
+        const double rate = (double)(ct[i].events - lt[i].events) / seconds;
+        printf("    %-40s %12.0f events/s %llu lost\n", ct[i].name, rate,
+               (unsigned long long)ct[i].lost);
+    }
+
+    printf("\n");
+    fflush(stdout);
+
+}
+
+int main(int argc, char **argv)
+{
+
+    if(argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <pid> [interval ms]\n", argv[0]);
+        return -1;
+    }
+    const int pid = atoi(argv[1]);
+    const int interval = argc > 2 ? atoi(argv[2]) : 1000;
+
+    size_t size = 0;
+    SPMetrics *m = Open(pid, &size);
+    if(m == NULL) {
+        fprintf(stderr, "ERROR: no metrics for process %d\n", pid);
+        return -1;
+    }
+
+    SPMetrics *last = (SPMetrics*)malloc(size);
+    SPMetrics *current = (SPMetrics*)malloc(size);
+    sp_metrics_read(m, last, size);
+    while(Exists(pid)) {
+        usleep(interval * 1000);
+        sp_metrics_read(m, current, size);
+        Show(last, current);
+        SPMetrics *temp = last;
+        last = current;
+        current = temp;
+    }
+
+    free(last);
+    free(current);
+    munmap(m, size);
+    return 0;
+
+}
@@ -0,0 +1,136 @@
+/** Convert a binary TimeTrial trace to the text format. */
+
+#include "TraceOutput.hh"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Decode the data points in a block. */
+static bool DecodeData(TTAOutput *out, uint16_t tap_id,
+                       const uint8_t *ptr, size_t size)
+{
+    uint64_t frame = 0;
+    uint64_t index = 0;
+    while(size > 0) {
+        uint64_t frame_delta, index_delta, value;
+        size_t n;
+        if((n = tta_get_varint(ptr, size, &frame_delta)) == 0) {
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        if((n = tta_get_varint(ptr, size, &index_delta)) == 0) {
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        if((n = tta_get_varint(ptr, size, &value)) == 0) {
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        frame += frame_delta;
+        index += tta_unzigzag(index_delta);
+        out->Print(tap_id, frame, index, value);
+    }
+    return true;
+}
+
+/** Decode a trace that has been mapped into memory. */
+static bool Decode(TTAOutput *out, const uint8_t *ptr, size_t size)
+{
+
+    const TTAFileHeader *header = (const TTAFileHeader*)ptr;
+    if(size < sizeof(TTAFileHeader) || header->magic != TTA_FILE_MAGIC) {
+        fprintf(stderr, "ERROR: not a TimeTrial trace\n");
+        return false;
+    }
+    if(header->version != TTA_FILE_VERSION) {
+        fprintf(stderr, "ERROR: unsupported trace version: %hu\n",
+                header->version);
+        return false;
+    }
+    size_t offset = sizeof(TTAFileHeader);
+
+    while(offset + sizeof(TTABlockHeader) <= size) {
+        TTABlockHeader block;
+        memcpy(&block, ptr + offset, sizeof(block));
+        offset += sizeof(block);
+        if(offset + block.length > size) {
+            break;
+        }
+        const uint8_t *data = ptr + offset;
+        switch(block.kind) {
+        case TTA_BLOCK_TAP:
+            if(block.length >= sizeof(TTATapHeader)) {
+                TTATapHeader tap;
+                memcpy(&tap, data, sizeof(tap));
+                out->Start(block.tap_id, tap.type, tap.name, tap.xlabel);
+            }
+            break;
+        case TTA_BLOCK_DATA:
+            if(!DecodeData(out, block.tap_id, data, block.length)) {
+                fprintf(stderr, "ERROR: invalid data block\n");
+                return false;
+            }
+            break;
+        case TTA_BLOCK_LOST:
+            {
+                uint64_t count;
+                if(tta_get_varint(data, block.length, &count) == 0) {
+                    fprintf(stderr, "ERROR: invalid lost block\n");
+                    return false;
+                }
+                out->Lost(block.tap_id, count);
+            }
+            break;
+        default:
+            break;
+        }
+        offset += block.length;
+    }
+
+    if(offset != size) {
+        fprintf(stderr, "WARN: trace is truncated\n");
+    }
+    return true;
+
+}
+
+int main(int argc, char **argv)
+{
+
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+        return -1;
+    }
+
+    const int fd = open(argv[1], O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "ERROR: could not open %s\n", argv[1]);
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: could not stat %s\n", argv[1]);
+        close(fd);
+        return -1;
+    }
+    const size_t size = st.st_size;
+    void *ptr = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                         : MAP_FAILED;
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map %s\n", argv[1]);
+        return -1;
+    }
+
+    TTAOutput *out = TTAOutput::Create(stdout, false);
+    const bool result = Decode(out, (const uint8_t*)ptr, size);
+    delete out;
+    munmap(ptr, size);
+    return result ? 0 : -1;
+
+}
@@ -228,6 +228,21 @@ private[scalapipe] case class ASTAvailableNode(
 
 }
 
+/** Acquire or release the current item of a port in place.
+ * Ports used with these statements are not read or written implicitly.
+ */
+private[scalapipe] case class ASTPortNode(
+        _op: NodeType.Value,
+        val symbol: String,
+        _kernel: Kernel = null
+    ) extends ASTNode(_op, _kernel) with ASTStartNode {
+
+    override private[scalapipe] def children = Seq()
+
+    private[scalapipe] override def pure = false
+
+}
+
 private[scalapipe] case class ASTSymbolNode(
         val symbol: String,
         _kernel: Kernel = null
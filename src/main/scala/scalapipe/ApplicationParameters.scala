@@ -3,12 +3,23 @@ package scalapipe
 private[scalapipe] class ApplicationParameters extends Parameters {
 
     add('queueDepth, 256)
+    add('queueProfile, null: String)    // Queue profile to write at exit.
+    add('queueTune, null: String)       // Queue profile to size queues from.
+    add('queueBudget, 0)                // Bytes for tuned queues (0 = any).
     add('fpgaQueueDepth, 1)
     add('defaultPlatform, "C")
     add('defaultHost, "localhost")
     add('timeTrialOutput, null: String)
     add('timeTrialBufferSize, 8192)
     add('timeTrialAffinity, -1)
+    add('timeTrialFormat, "text")   // TimeTrial output format:
+                                    //  text   - CSV
+                                    //  binary - decode with ttdecode
+    add('timeTrialOverflow, "block")    // When a TimeTrial buffer is full:
+                                        //  block  - wait for room
+                                        //  drop   - drop new events
+                                        //  sample - record fewer events
+    add('timeTrialPrecision, 2)         // Significant digits for 'hdr (1-4).
     add('share, 1)              // Share FPGA resources within a kernel:
                                 //  0 - no sharing
                                 //  1 - share independent resources
@@ -16,8 +27,33 @@ private[scalapipe] class ApplicationParameters extends Parameters {
     add('profile, false)        // Insert counters for profiling.
     add('fpga, "Simulation")    // Default FPGA device to target.
     add('trace, false)          // Set to generate address traces from C code.
+    add('batchSize, 1)          // Items per port transfer in C kernels.
+    add('lockFree, false)       // Use lock-free queues for C edges.
+    add('wait, "yield")         // How C kernels wait on ports:
+                                //  yield - call sched_yield
+                                //  spin  - spin, then yield
+                                //  block - spin, then block (C edges only)
+    add('fuse, false)           // Fuse chains of C kernels on a device.
+    add('specialize, false)     // Bind C kernel ports at compile time.
+    add('clock, "full")        // Kernel execution time in C kernels:
+                                //  off     - no timing
+                                //  sampled - time every clockPeriod ops
+                                //  full    - time every port operation
+    add('clockPeriod, 64)       // Port operations per clock sample.
+    add('metrics, 0)            // Publish live metrics every n ms (0 = off).
+    add('counters, false)       // Count hardware events per kernel thread.
+    add('report, 0)             // Sample queues every n ms for a bottleneck
+                                // report at exit (0 = off).
+    add('workers, 0)            // Worker threads for C kernels:
+                                //  0 - one thread per kernel
+                                //  n - run kernels as tasks on n threads
     add('wave, false)           // Dump waveform from simulation.
     add('basePort, 9000)        // First port number to use.
+    add('transport, "socket")   // Transport for C edges between processes:
+                                //  socket - TCP
+                                //  shm    - shared memory (same machine)
+    add('sockBatch, 65536)      // Bytes to collect before a socket send.
+    add('sockLatency, 100)      // Longest a socket send is held (in us).
     add('memoryAddrWidth, 30)   // FPGA memory address width.
     add('memoryWidth, 32)       // FPGA memory port width.
     add('bram, true)            // Set to use block RAM for memories.
@@ -0,0 +1,89 @@
+package scalapipe
+
+import scala.collection.mutable.HashSet
+
+/** Find the local variables of a kernel that carry values from one
+ * firing to the next.  A local is carried if it has an initial value or
+ * if it may be read before it is assigned in the kernel body.
+ */
+private[scalapipe] object CarriedState {
+
+    def find(kt: InternalKernelType): Seq[String] = {
+        val checker = new CarriedState(kt)
+        checker.find
+    }
+
+}
+
+private[scalapipe] class CarriedState(val kt: InternalKernelType) {
+
+    private val locals = kt.states.map(_.name).toSet
+    private val carried = new HashSet[String]
+
+    def find: Seq[String] = {
+        kt.states.filter(_.value != null).foreach { s => carried += s.name }
+        visit(kt.expression, Set())
+        kt.states.map(_.name).filter(carried.contains)
+    }
+
+    // Note a local that is read before it is assigned.
+    private def use(name: String, assigned: Set[String]) {
+        if (locals.contains(name) && !assigned.contains(name)) {
+            carried += name
+        }
+    }
+
+    // Note locals read by an expression.
+    private def read(node: ASTNode, assigned: Set[String]) {
+        node match {
+            case null               => ()
+            case sn: ASTSymbolNode  => use(sn.symbol, assigned)
+            case _                  => ()
+        }
+        if (node != null) {
+            node.children.foreach { c => read(c, assigned) }
+        }
+    }
+
+    // Walk a statement and return the locals assigned on every path.
+    // Loops may run zero times, so their assignments are not counted.
+    private def visit(node: ASTNode, assigned: Set[String]): Set[String] = {
+        node match {
+            case null => assigned
+            case an: ASTAssignNode =>
+                read(an.src, assigned)
+                an.dest.indexes.foreach { i => read(i, assigned) }
+                if (an.dest.indexes.isEmpty) {
+                    assigned + an.dest.symbol
+                } else {
+                    // Assigning part of a value keeps the rest.
+                    use(an.dest.symbol, assigned)
+                    assigned
+                }
+            case in: ASTIfNode =>
+                read(in.cond, assigned)
+                visit(in.iTrue, assigned) & visit(in.iFalse, assigned)
+            case sw: ASTSwitchNode =>
+                read(sw.cond, assigned)
+                val paths = sw.cases.map { case (cond, body) =>
+                    read(cond, assigned)
+                    visit(body, assigned)
+                }
+                if (sw.cases.exists(_._1 == null)) {
+                    paths.reduce(_ & _)
+                } else {
+                    assigned
+                }
+            case wn: ASTWhileNode =>
+                read(wn.cond, assigned)
+                visit(wn.body, assigned)
+                assigned
+            case bn: ASTBlockNode =>
+                bn.children.foldLeft(assigned) { (a, c) => visit(c, a) }
+            case _ =>
+                read(node, assigned)
+                assigned
+        }
+    }
+
+}
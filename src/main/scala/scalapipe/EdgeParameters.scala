@@ -6,5 +6,8 @@ private[scalapipe] class EdgeParameters(
 
     add('queueDepth, defaults.get[Int]('queueDepth))
     add('fpgaQueueDepth, defaults.get[Int]('fpgaQueueDepth))
+    add('lockFree, defaults.get[Boolean]('lockFree))
+    add('wait, defaults.get[String]('wait))
+    add('transport, defaults.get[String]('transport))
 
 }
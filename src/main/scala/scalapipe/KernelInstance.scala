@@ -14,6 +14,7 @@ private[scalapipe] class KernelInstance(
     private[this] var outputs = Map[IntPortName, Stream]()
     private[this] var inputs = Map[IntPortName, Stream]()
     private[scalapipe] var configs = Map[String, Literal]()
+    private[scalapipe] var fusedInto: KernelInstance = null
 
     collectDebugInfo
 
@@ -157,6 +158,10 @@ private[scalapipe] class KernelInstance(
 
     private[scalapipe] def getOutputs: Seq[Stream] = outputs.toSeq.map(_._2)
 
+    /** Get the kernel whose thread runs this kernel. */
+    private[scalapipe] def threadOwner: KernelInstance =
+        if (fusedInto == null) this else fusedInto.threadOwner
+
     override def toString = name
 
     private[scalapipe] def validate {
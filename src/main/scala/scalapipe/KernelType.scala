@@ -1,6 +1,7 @@
 package scalapipe
 
 import scalapipe.dsl._
+import scala.collection.mutable.HashSet
 
 private[scalapipe] abstract class KernelType(
         val sp: ScalaPipe,
@@ -17,6 +18,9 @@ private[scalapipe] abstract class KernelType(
     private[scalapipe] val label = LabelMaker.getTypeLabel
     private[scalapipe] val inputs = symbols.inputs
     private[scalapipe] val outputs = symbols.outputs
+    private[scalapipe] var replicas = 1
+    private[scalapipe] var fused = false   // An instance runs by steps.
+    private[scalapipe] val heldPorts = new HashSet[String]
 
     def this(sp: ScalaPipe, kernel: Kernel, p: Platforms.Value) = {
         this(sp, kernel.name, new SymbolTable(kernel), p)
@@ -35,10 +39,19 @@ private[scalapipe] abstract class KernelType(
             symbols.addState(s.name, s.valueType, lit)
         }
         dependencies.add(kernel.dependencies)
+        replicas = kernel.replicas
+        heldPorts ++= kernel.heldPorts
     }
 
     def pure: Boolean
 
+    /** Items per port transfer for C instances of this kernel.
+     * Replicas buffer outputs per firing, so they are not batched.
+     * Fused instances run the unbatched step function instead.
+     */
+    private[scalapipe] def batchSize: Int =
+        if (replicas > 1) 1 else parameters.get[Int]('batchSize)
+
     private[scalapipe] def ramDepth(vt: ValueType): Int = {
         val ramWidth = sp.parameters.get[Int]('memoryWidth)
         if (vt.flat) {
@@ -158,6 +171,9 @@ private[scalapipe] abstract class KernelType(
 
     def isPort(n: String) = isInput(n) || isOutput(n)
 
+    // Ports accessed in place with acquire and release.
+    def isHeld(n: String) = heldPorts.contains(n)
+
     def isState(n: String) = states.exists(_.name == n)
 
     def isConfig(n: String) = configs.exists(_.name == n)
@@ -14,6 +14,8 @@ private[scalapipe] object NodeType extends Enumeration {
     val STOP         = Value("STOP")
     val BLOCK        = Value("BLOCK")
     val RETURN      = Value("RETURN")
+    val ACQUIRE     = Value("ACQUIRE")
+    val RELEASE     = Value("RELEASE")
     val avail        = Value("avail")
     val addr         = Value("addr")
     val sizeof      = Value("sizeof")
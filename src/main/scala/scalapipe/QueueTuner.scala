@@ -0,0 +1,110 @@
+package scalapipe
+
+import scala.io.Source
+
+/** Assign queue depths from a queue profile.
+ * The profile is written by a process generated with 'queueProfile set.
+ * Each edge gets enough room for the 99th percentile of its sampled fill
+ * level.  Edges that were often nearly full are then grown, most full
+ * first, while the total fits in the memory budget.
+ */
+private[scalapipe] class QueueTuner(
+        val filename: String,
+        val budget: Int
+    ) {
+
+    // Fraction of samples nearly full for an edge to be grown.
+    private val fullThreshold = 0.01
+
+    private case class EdgeProfile(depth: Int, width: Int,
+                                   p99: Long, full: Double)
+
+    private def nextPowerOfTwo(v: Long): Int = {
+        var result = 1
+        while (result < v) {
+            result *= 2
+        }
+        result
+    }
+
+    private def readProfile: Map[String, EdgeProfile] = {
+        val source = try {
+            Source.fromFile(filename)
+        } catch {
+            case ex: java.io.IOException =>
+                Error.raise(s"could not read queue profile: $filename")
+                return Map()
+        }
+        val lines = try {
+            source.getLines.toList
+        } finally {
+            source.close
+        }
+        lines.filter { l =>
+            !l.trim.isEmpty && !l.startsWith("#")
+        }.flatMap { l =>
+            l.trim.split("\\s+") match {
+                case Array(label, depth, width, _, _, _, p99, full) =>
+                    try {
+                        Some(label -> EdgeProfile(depth.toInt, width.toInt,
+                                                  p99.toLong, full.toDouble))
+                    } catch {
+                        case ex: NumberFormatException =>
+                            Error.raise(s"invalid queue profile entry: $l")
+                            None
+                    }
+                case _ =>
+                    Error.raise(s"invalid queue profile entry: $l")
+                    None
+            }
+        }.toMap
+    }
+
+    def tune(streams: Traversable[Stream]) {
+
+        val profile = readProfile
+        val profiled = streams.filter { s =>
+            profile.contains(s.label)
+        }.toSeq
+        if (profiled.isEmpty) {
+            Error.warn(s"no edges in queue profile: $filename")
+            return
+        }
+
+        def bytes(s: Stream, depth: Int): Long = {
+            depth.toLong * profile(s.label).width
+        }
+
+        // Start with room for the 99th percentile of each edge.
+        var depths = profiled.map { s =>
+            s -> nextPowerOfTwo(math.max(2, profile(s.label).p99 + 1))
+        }.toMap
+        var total = profiled.map { s => bytes(s, depths(s)) }.sum
+        if (budget > 0 && total > budget) {
+            Error.warn(s"queue budget of $budget bytes is too small: " +
+                       s"$total bytes needed")
+        }
+
+        // Grow edges that were often nearly full, most full first.
+        val full = profiled.filter { s =>
+            profile(s.label).full > fullThreshold
+        }.sortBy { s => -profile(s.label).full }
+        for (s <- full) {
+            val p = profile(s.label)
+            val current = depths(s)
+            var depth = math.max(current, nextPowerOfTwo(p.depth * 2))
+            while (depth > current && budget > 0 &&
+                   total - bytes(s, current) + bytes(s, depth) > budget) {
+                depth /= 2
+            }
+            total += bytes(s, depth) - bytes(s, current)
+            depths += (s -> depth)
+        }
+
+        for ((s, depth) <- depths) {
+            s.addParameter('queueDepth, depth)
+        }
+
+    }
+
+}
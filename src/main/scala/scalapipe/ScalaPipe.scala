@@ -129,6 +129,11 @@ private[scalapipe] class ScalaPipe {
         resourceManager.getPort(stream)
     }
 
+    // Determine if a stream between processes uses shared memory.
+    private[scalapipe] def usesSharedMemory(stream: Stream): Boolean = {
+        stream.parameters.get[String]('transport) == "shm"
+    }
+
     private def insertEdges {
 
         val anyName = ANY_KERNEL.name
@@ -164,6 +169,38 @@ private[scalapipe] class ScalaPipe {
         }
     }
 
+    private def checkTransports {
+        for (s <- streams) {
+            val transport = s.parameters.get[String]('transport)
+            if (transport != "socket" && transport != "shm") {
+                Error.raise(s"invalid transport: $transport", s)
+            }
+        }
+    }
+
+    // Borrowed references are only valid in the process that made them
+    // and are not copied into replica pools.
+    private def checkBorrowed {
+        for (s <- streams if s.borrowed) {
+            val src = s.sourceKernel.device
+            val dest = s.destKernel.device
+            if (src.platform != Platforms.C || dest.platform != Platforms.C ||
+                src.host != dest.host) {
+                Error.raise("borrowed references must stay in one process", s)
+            } else if (s.destKernel.kernelType.replicas > 1) {
+                Error.raise("borrowed references cannot feed replicas", s)
+            }
+        }
+    }
+
+    private def tuneQueues {
+        val filename = parameters.get[String]('queueTune)
+        if (filename != null) {
+            val budget = parameters.get[Int]('queueBudget)
+            new QueueTuner(filename, budget).tune(streams)
+        }
+    }
+
     private def insertMeasures {
 
         // Insert measures specified using edge aspects.
@@ -414,6 +451,49 @@ private[scalapipe] class ScalaPipe {
         }
     }
 
+    // Fuse chains of C kernels mapped to the same device.
+    // A stream is fused if its producer has no other outputs and its
+    // consumer has no other inputs.  The consumer then runs the producer
+    // on its own thread whenever it needs another item.
+    private def fuseKernels {
+
+        if (!parameters.get[Boolean]('fuse)) {
+            return
+        }
+
+        def canFuse(s: Stream): Boolean = {
+            val src = s.sourceKernel
+            val dest = s.destKernel
+            src != dest &&
+            src.device == dest.device &&
+            src.device.platform == Platforms.C &&
+            s.edge == null &&
+            s.measures.isEmpty &&
+            !s.borrowed &&
+            src.getOutputs.size == 1 &&
+            dest.getInputs.size == 1 &&
+            src.kernelType.internal &&
+            src.kernelType.replicas == 1 &&
+            dest.kernelType.replicas == 1
+        }
+
+        // Determine if a kernel already runs a kernel through fused streams.
+        def runs(k: KernelInstance, other: KernelInstance): Boolean = {
+            k.getInputs.filter(_.fused).exists { s =>
+                s.sourceKernel == other || runs(s.sourceKernel, other)
+            }
+        }
+
+        for (s <- streams if canFuse(s)) {
+            if (!runs(s.sourceKernel, s.destKernel)) {
+                s.fused = true
+                s.sourceKernel.fusedInto = s.destKernel
+                s.sourceKernel.kernelType.fused = true
+            }
+        }
+
+    }
+
     private def checkStreams {
         streams.foreach { _.checkType }
     }
@@ -422,6 +502,25 @@ private[scalapipe] class ScalaPipe {
         instances.foreach { _.validate }
     }
 
+    // Each replica gets its own copy of the kernel state and takes input
+    // items in turn, so locals may only be used within a firing and
+    // kernels must have one input and one output to run as replicas.
+    private def checkParallel {
+        for (kt <- kernelTypes.values if kt.replicas > 1) {
+            val carried = kt match {
+                case ikt: InternalKernelType    => CarriedState.find(ikt)
+                case _                          => Seq()
+            }
+            if (!carried.isEmpty) {
+                Error.raise(s"parallel kernel ${kt.name} carries state " +
+                            s"between firings: ${carried.mkString(", ")}", kt)
+            } else if (kt.inputs.size != 1 || kt.outputs.size != 1) {
+                Error.raise("parallel kernels must have one input and " +
+                            "one output: " + kt.name, kt)
+            }
+        }
+    }
+
     private def emitKernels(dir: File) {
         kernelTypes.values.foreach { kt =>
             kt.emit(dir)
@@ -457,6 +556,8 @@ private[scalapipe] class ScalaPipe {
             RawFileGenerator.emitFile(dir, "TimeTrial.cpp")
             RawFileGenerator.emitFile(dir, "Measure.hh")
             RawFileGenerator.emitFile(dir, "Stat.hh")
+            RawFileGenerator.emitFile(dir, "TraceOutput.hh")
+            RawFileGenerator.emitFile(dir, "ttdecode.cpp")
         }
 
     }
@@ -468,14 +569,49 @@ private[scalapipe] class ScalaPipe {
         createKernelTypes
         checkStreams
         checkKernels
+        checkParallel
         insertParameters
+        checkTransports
+        checkBorrowed
+        tuneQueues
         insertMeasures
+        fuseKernels
 
         // Create the directory.
         val dir = new File(dirname)
         dir.mkdir
 
         RawFileGenerator.emitFile(dir, "ScalaPipe.h")
+        RawFileGenerator.emitFile(dir, "Timebase.h")
+        RawFileGenerator.emitFile(dir, "Metrics.h")
+        RawFileGenerator.emitFile(dir, "FileIO.h")
+        if (parameters.get[Int]('metrics) > 0) {
+            RawFileGenerator.emitFile(dir, "spmon.c")
+        }
+        if (parameters.get[Boolean]('counters)) {
+            RawFileGenerator.emitFile(dir, "Counters.h")
+        }
+        if (parameters.get[Int]('report) > 0 ||
+            parameters.get[String]('queueProfile) != null) {
+            RawFileGenerator.emitFile(dir, "Report.h")
+        }
+        if (parameters.get[Int]('workers) > 0) {
+            RawFileGenerator.emitFile(dir, "Scheduler.h")
+        }
+        if (kernelTypes.values.exists { kt =>
+                kt.replicas > 1 && kt.platform == Platforms.C
+            }) {
+            RawFileGenerator.emitFile(dir, "Parallel.h")
+        }
+        val remoteStreams = streams.filter { s =>
+            s.sourceKernel.device.host != s.destKernel.device.host
+        }
+        if (remoteStreams.exists(!usesSharedMemory(_))) {
+            RawFileGenerator.emitFile(dir, "Socket.h")
+        }
+        if (remoteStreams.exists(usesSharedMemory)) {
+            RawFileGenerator.emitFile(dir, "Shm.h")
+        }
         RawFileGenerator.emitFile(dir, "scalapipe.v")
 
         val fpga = parameters.get[String]('fpga)
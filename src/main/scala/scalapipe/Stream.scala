@@ -14,6 +14,7 @@ class Stream private[scalapipe](
     private[scalapipe] var destPort: PortName = null
     private[scalapipe] var measures = Set[Measure]()
     private[scalapipe] var edge: Edge = null
+    private[scalapipe] var fused = false
     private[scalapipe] val parameters = new EdgeParameters(sp.parameters)
 
     collectDebugInfo
@@ -44,10 +45,22 @@ class Stream private[scalapipe](
 
     private[scalapipe] def valueType = sourceKernel.outputType(sourcePort)
 
+    /** Determine if this stream carries borrowed references.
+     * A Pointer(t) output may feed a t input.  The queue then holds the
+     * pointers and the destination reads the values through them.
+     */
+    private[scalapipe] def borrowed: Boolean = {
+        sourceKernel.outputType(sourcePort) match {
+            case p: PointerValueType =>
+                p.itemType == destKernel.inputType(destPort)
+            case _ => false
+        }
+    }
+
     private[scalapipe] def checkType {
         val st = sourceKernel.outputType(sourcePort)
         val dt = destKernel.inputType(destPort)
-        if (st != dt) {
+        if (st != dt && !borrowed) {
             Error.raise(s"stream type mismatch: $st vs $dt", this)
         }
     }
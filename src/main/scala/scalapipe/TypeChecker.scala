@@ -139,6 +139,7 @@ private[scalapipe] class TypeChecker(kt: KernelType) {
             case in: ASTIfNode          => ValueType.void
             case sw: ASTSwitchNode      => ValueType.void
             case hn: ASTStopNode        => ValueType.void
+            case pn: ASTPortNode        => ValueType.void
             case bn: ASTBlockNode       => ValueType.void
             case op: ASTOpNode          => getOpType(op)
             case li: Literal            => li.valueType
@@ -237,7 +238,7 @@ private[scalapipe] class TypeChecker(kt: KernelType) {
 
     private def checkSymbol(node: ASTSymbolNode,
                             lhs: Boolean): ASTSymbolNode = {
-        if (!lhs && kt.isOutput(node)) {
+        if (!lhs && kt.isOutput(node) && !kt.isHeld(node.symbol)) {
             Error.raise("reading from output port not allowed", node)
         }
         val result = ASTSymbolNode(node.symbol)
@@ -331,6 +332,13 @@ private[scalapipe] class TypeChecker(kt: KernelType) {
         ASTConvertNode(a, node.valueType)
     }
 
+    private def checkPort(node: ASTPortNode): ASTPortNode = {
+        if (!kt.isPort(node.symbol)) {
+            Error.raise(s"not a port: ${node.symbol}", node)
+        }
+        node
+    }
+
     private def checkReturn(node: ASTReturnNode,
                             lhs: Boolean): ASTReturnNode = {
         if (lhs) {
@@ -353,6 +361,7 @@ private[scalapipe] class TypeChecker(kt: KernelType) {
             case sw: ASTSwitchNode      => checkSwitch(sw, lhs)
             case wn: ASTWhileNode       => checkWhile(wn, lhs)
             case sn: ASTStopNode        => sn
+            case pn: ASTPortNode        => checkPort(pn)
             case bn: ASTBlockNode       => checkBlock(bn, lhs)
             case cn: ASTCallNode        => checkCall(cn, lhs)
             case sn: ASTSymbolNode      => checkSymbol(sn, lhs)
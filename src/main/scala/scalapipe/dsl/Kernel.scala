@@ -18,6 +18,8 @@ class Kernel(val name: String) extends LowPriorityImplicits with DebugInfo {
     private[scalapipe] val externals = new ListBuffer[Platforms.Value]
     private[scalapipe] val dependencies = new DependencySet
     private[scalapipe] val scopeStack = new ListBuffer[scalapipe.Scope]
+    private[scalapipe] var replicas = 1
+    private[scalapipe] val heldPorts = new HashSet[String]
 
     def this() = this(LabelMaker.getKernelLabel)
 
@@ -69,6 +71,18 @@ class Kernel(val name: String) extends LowPriorityImplicits with DebugInfo {
         })
     }
 
+    /** Run C instances of this kernel as n replicas.
+     * The kernel must have one input and one output.  Each replica has
+     * its own locals, so locals must be assigned before they are read in
+     * each firing and may not have initial values.  Each firing must read
+     * one input item and outputs are kept in input order.  Replicas are
+     * not bound to the CPU of their device.
+     */
+    def parallel(n: Int) {
+        DSLHelper.ifThen(n < 1, Error.raise("invalid replica count", this))
+        replicas = n
+    }
+
     def local(t: Type, v: Any = null): Variable = {
         val label = getLabel
         states += new KernelLocal(label, t.create(), v)
@@ -161,6 +175,26 @@ class Kernel(val name: String) extends LowPriorityImplicits with DebugInfo {
 
     def avail(s: ASTSymbolNode) = ASTAvailableNode(s.symbol, this)
 
+    /** Access the next item of a port in place.
+     * For an output, this allocates the item in the queue so that it
+     * can be built without a copy.  For an input, this waits for the
+     * next item and leaves it in the queue.  Either way, the port then
+     * refers to that item until it is released.
+     */
+    def acquire(s: ASTSymbolNode) {
+        heldPorts += s.symbol
+        ASTPortNode(NodeType.ACQUIRE, s.symbol, this)
+    }
+
+    /** Release the item acquired on a port.
+     * For an output, this sends the item.  For an input, this
+     * consumes it.
+     */
+    def release(s: ASTSymbolNode) {
+        heldPorts += s.symbol
+        ASTPortNode(NodeType.RELEASE, s.symbol, this)
+    }
+
     def addr(n: ASTNode) = ASTOpNode(NodeType.addr, n, null, this)
 
     def sizeof(t: Type) = IntLiteral(t.create.bits / 8, this)
@@ -5,12 +5,31 @@ import scalapipe._
 /** Edge generator for edges mapped to CPUs on the same host.
  * Note that the sending and receiving sides will always be in
  * the same process (but likely in different threads).
+ * If tasks is set, the kernels run as tasks on a worker pool and
+ * every transfer signals the kernel on the other side.
  */
-private[scalapipe] class CEdgeGenerator
+private[scalapipe] class CEdgeGenerator(val tasks: Boolean = false)
     extends EdgeGenerator(Platforms.C) with CGenerator {
 
     private def queueName(stream: Stream) = s"q_${stream.label}"
 
+    private def isLockFree(stream: Stream): Boolean =
+        stream.parameters.get[Boolean]('lockFree)
+
+    // Prefix for the queue functions used by a stream.
+    private def queuePrefix(stream: Stream): String =
+        if (isLockFree(stream)) "spaq" else "spq"
+
+    // Determine if the kernels on a stream may block waiting on it.
+    private def isBlocking(stream: Stream): Boolean =
+        stream.parameters.get[String]('wait) == "block"
+
+    override def batched: Boolean = true
+
+    /** Get an expression for the number of items in a stream's queue. */
+    def queueUsed(stream: Stream): String =
+        s"${queuePrefix(stream)}_get_used(${queueName(stream)})"
+
     override def emitGlobals(streams: Traversable[Stream]) {
         streams.foreach { s => writeGlobals(s) }
     }
@@ -30,9 +49,25 @@ private[scalapipe] class CEdgeGenerator
         val vtype = stream.valueType
 
         // Initialize the queue.
-        write(s"$qname = (SPQ*)malloc(spq_get_size($depth, sizeof($vtype)));")
-        write(s"spq_init($qname, $depth, sizeof($vtype));")
+        if (isLockFree(stream)) {
+            write(s"$qname = spaq_create($depth, sizeof($vtype));")
+        } else {
+            write(s"$qname = (SPQ*)malloc(spq_get_size($depth, " +
+                  s"sizeof($vtype)));")
+            write(s"spq_init($qname, $depth, sizeof($vtype));")
+        }
+
+    }
 
+    // Fused kernels run on the task of the kernel that runs them.
+    private def writeSignal(stream: Stream,
+                            kernel: KernelInstance,
+                            wait: String) {
+        if (tasks) {
+            write(s"spt_signal(&${kernel.threadOwner.label}.task);")
+        } else if (isBlocking(stream)) {
+            write(s"spw_signal(&${kernel.label}.$wait);")
+        }
     }
 
     private def writeGlobals(stream: Stream) {
@@ -50,40 +85,45 @@ private[scalapipe] class CEdgeGenerator
         val destDevice = stream.destKernel.device
         val sourceDevice = stream.sourceKernel.device
         val vtype = stream.valueType
+        val qtype = queuePrefix(stream).toUpperCase
+        val prefix = queuePrefix(stream)
 
         // Define the queue data structure.
-        write(s"static SPQ *$qname;")
+        write(s"static $qtype *$qname;")
 
         // "get_free"
         write(s"static int ${label}_get_free()")
         enter
-        writeReturn(s"spq_get_free($qname);")
+        writeReturn(s"${prefix}_get_free($qname);")
         leave
 
         // "allocate"
         write(s"static void *${label}_allocate()")
         enter
-        writeReturn(s"spq_start_write($qname, 1);")
+        writeReturn(s"${prefix}_start_write($qname, 1);")
         leave
 
         // "send"
         write(s"static void ${label}_send()")
         enter
-        write(s"spq_finish_write($qname, 1);")
+        write(s"${prefix}_finish_write($qname, 1);")
+        writeSignal(stream, destKernel, "input_wait")
         leave
 
         // "get_available"
         write(s"static int ${label}_get_available()")
         enter
-        writeReturn(s"spq_get_used($qname);")
+        writeReturn(s"${prefix}_get_used($qname);")
         leave
 
         // "read_value"
+        // The queue of a borrowed stream holds pointers to the values.
+        val item = if (stream.borrowed) "*(char**)buffer" else "buffer"
         write(s"static void *${label}_read_value()")
         enter
         write(s"char *buffer = NULL;")
-        writeIf(s"spq_start_read($qname, &buffer) > 0")
-        writeReturn(s"buffer")
+        writeIf(s"${prefix}_start_read($qname, &buffer) > 0")
+        writeReturn(item)
         writeElse
         writeReturn(s"NULL")
         writeEnd
@@ -92,13 +132,69 @@ private[scalapipe] class CEdgeGenerator
         // "release"
         write(s"static void ${label}_release()")
         enter
-        write(s"spq_finish_read($qname, 1);")
+        write(s"${prefix}_finish_read($qname, 1);")
+        writeSignal(stream, sourceKernel, "output_wait")
+        leave
+
+        // "allocate_n"
+        write(s"static void *${label}_allocate_n(int *count)")
+        enter
+        if (isLockFree(stream)) {
+            write(s"uint32_t n = *count;")
+            write(s"char *ptr = spaq_start_write_n($qname, &n);")
+        } else {
+            write(s"const int free = spq_get_free($qname);")
+            writeIf(s"free <= 0")
+            writeReturn(s"NULL")
+            writeEnd
+            write(s"const int n = *count < free ? *count : free;")
+            write(s"char *ptr = spq_start_write($qname, n);")
+        }
+        writeIf(s"ptr != NULL")
+        write(s"*count = n;")
+        writeEnd
+        writeReturn(s"ptr")
+        leave
+
+        // "send_n"
+        write(s"static void ${label}_send_n(int count)")
+        enter
+        write(s"${prefix}_finish_write($qname, count);")
+        writeSignal(stream, destKernel, "input_wait")
+        leave
+
+        // "read_n"
+        write(s"static void *${label}_read_n(int *count)")
+        enter
+        write(s"char *buffer = NULL;")
+        write(s"const int available = ${prefix}_start_read($qname, &buffer);")
+        writeIf(s"available > 0")
+        if (stream.borrowed) {
+            // Borrowed values need not be contiguous.
+            write(s"*count = 1;")
+        } else {
+            writeIf(s"*count > available")
+            write(s"*count = available;")
+            writeEnd
+        }
+        writeReturn(item)
+        writeElse
+        writeReturn(s"NULL")
+        writeEnd
+        leave
+
+        // "release_n"
+        write(s"static void ${label}_release_n(int count)")
+        enter
+        write(s"${prefix}_finish_read($qname, count);")
+        writeSignal(stream, sourceKernel, "output_wait")
         leave
 
         // "finish"
         write(s"static void ${label}_finish()")
         enter
         write(s"sp_decrement(&${destLabel}.active_inputs);")
+        writeSignal(stream, destKernel, "input_wait")
         leave
 
     }
@@ -12,6 +12,9 @@ private[scalapipe] class CFunctionGenerator(
         if (cond) Some(value) else None
     }
 
+    // Functions are not instantiated.
+    protected override def specialize: Boolean = false
+
     protected override def emitFunctionHeader {
 
         val typeEmitter = new CTypeEmitter
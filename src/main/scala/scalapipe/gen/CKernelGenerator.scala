@@ -9,12 +9,17 @@ private[scalapipe] class CKernelGenerator(
         _kt: InternalKernelType
     ) extends KernelGenerator(_kt) with CGenerator with ASTUtils {
 
+    private val batchSize = kt.batchSize
+
     protected def emitFunctionHeader {
     }
 
     protected def emitFunctionSource {
     }
 
+    // Determine if code for specialized instances is needed.
+    protected def specialize: Boolean = kt.parameters.get[Boolean]('specialize)
+
     private def emitHeader: String = {
 
         val kname = s"sp_${kt.name}"
@@ -54,12 +59,23 @@ private[scalapipe] class CKernelGenerator(
             write(s"FILE *trace_fd;")
             write(s"int trace_streams[$streamCount];")
         }
+        if (batchSize > 1) {
+            if (!kt.inputs.isEmpty) {
+                write(s"SPBatch sp_in_batch[${kt.inputs.size}];")
+            }
+            if (!kt.outputs.isEmpty) {
+                write(s"SPBatch sp_out_batch[${kt.outputs.size}];")
+            }
+        }
         leave
         write(";")
 
         write(s"void ${kname}_init($sname*);")
         write(s"void ${kname}_destroy($sname*);")
         write(s"void ${kname}_run($sname*);")
+        if (kt.fused) {
+            write(s"int ${kname}_step($sname*);")
+        }
         emitFunctionHeader
         write(s"#endif")
 
@@ -83,9 +99,81 @@ private[scalapipe] class CKernelGenerator(
             // We initialize the clocks to one to account for the start state.
             write(s"kernel->sp_clocks = 1;")
         }
+        if (batchSize > 1) {
+            for (i <- 0 until kt.inputs.size) {
+                write(s"spb_init(&kernel->sp_in_batch[$i]);")
+            }
+            for (i <- 0 until kt.outputs.size) {
+                write(s"spb_init(&kernel->sp_out_batch[$i]);")
+            }
+        }
         leave
     }
 
+    private def emitBatchFunctions {
+
+        val kname = kt.name
+        val sname = s"struct sp_${kname}_data"
+
+        // Send pending outputs and release consumed inputs.
+        // This is done before blocking on any port to prevent deadlock.
+        write(s"static void sp_${kname}_sync($sname *kernel)")
+        enter
+        for (o <- kt.outputs) {
+            val index = o.id
+            val vtype = o.valueType
+            write(s"spb_flush(kernel, $index, &kernel->sp_out_batch[$index], " +
+                  s"sizeof($vtype));")
+        }
+        for (i <- kt.inputs) {
+            val index = i.id
+            val vtype = i.valueType
+            write(s"spb_release(kernel, $index, &kernel->sp_in_batch[$index], " +
+                  s"sizeof($vtype));")
+        }
+        leave
+
+        // Create input functions.
+        // sp_acquire_input leaves the item in the window.
+        for (i <- kt.inputs) {
+            val index = i.id
+            val vtype = i.valueType
+            write(s"static inline $vtype *sp_acquire_input$index" +
+                  s"($sname *kernel)")
+            enter
+            write(s"SPBatch *b = &kernel->sp_in_batch[$index];")
+            writeIf(s"SPUNLIKELY(spb_is_empty(b))")
+            write(s"sp_${kname}_sync(kernel);")
+            write(s"spb_read(kernel, $index, b, $batchSize);")
+            writeEnd
+            writeReturn(s"($vtype*)spb_next(b, sizeof($vtype))")
+            leave
+            write(s"static inline $vtype sp_read_input$index($sname *kernel)")
+            enter
+            write(s"const $vtype result = *sp_acquire_input$index(kernel);")
+            write(s"kernel->sp_in_batch[$index].used += 1;")
+            writeReturn("result")
+            leave
+        }
+
+        // Create output functions.
+        for (o <- kt.outputs) {
+            val index = o.id
+            val vtype = o.valueType
+            write(s"static inline $vtype *sp_allocate_output$index" +
+                  s"($sname *kernel)")
+            enter
+            write(s"SPBatch *b = &kernel->sp_out_batch[$index];")
+            writeIf(s"SPUNLIKELY(spb_is_empty(b))")
+            write(s"sp_${kname}_sync(kernel);")
+            write(s"spb_allocate(kernel, $index, b, $batchSize);")
+            writeEnd
+            writeReturn(s"($vtype*)spb_next(b, sizeof($vtype))")
+            leave
+        }
+
+    }
+
     private def emitDestroy {
         val kname = kt.name
         write(s"void sp_${kname}_destroy(struct sp_${kname}_data *kernel)")
@@ -106,15 +194,60 @@ private[scalapipe] class CKernelGenerator(
             } else null
 
         // Create input functions.
-        for (i <- kt.inputs) {
-            val index = i.id
-            val vtype = i.valueType
-            val ktype = s"sp_${kname}_data"
-            write(s"SP_READ_FUNCTION($vtype, $ktype, $index);")
+        if (batchSize > 1) {
+            emitBatchFunctions
+        } else {
+            for (i <- kt.inputs) {
+                val index = i.id
+                val vtype = i.valueType
+                val ktype = s"sp_${kname}_data"
+                write(s"SP_READ_FUNCTION($vtype, $ktype, $index);")
+            }
         }
 
         write(s"void sp_${kname}_run(struct sp_${kname}_data *kernel)")
         enter
+        emitLocals
+
+        // Generate the code.
+        val nodeEmitter = new CKernelNodeEmitter(kt, timing)
+        nodeEmitter.emit(kt.expression)
+        write(s"for(;;)")
+        enter
+        write(nodeEmitter)
+        leave
+        leave
+
+        // Fused kernels are run one iteration at a time by their consumer.
+        // The step function returns zero once the kernel stops.
+        if (kt.fused) {
+            if (batchSize > 1) {
+                for (i <- kt.inputs) {
+                    val index = i.id
+                    val vtype = i.valueType
+                    write(s"static inline $vtype sp_step_input$index" +
+                          s"(struct sp_${kname}_data *kernel)")
+                    enter
+                    write(s"const $vtype result = " +
+                          s"*($vtype*)sp_read_value(kernel, $index);")
+                    write(s"sp_release(kernel, $index);")
+                    writeReturn("result")
+                    leave
+                }
+            }
+            write(s"int sp_${kname}_step(struct sp_${kname}_data *kernel)")
+            enter
+            emitLocals
+            val stepEmitter = new CKernelNodeEmitter(kt, timing, true)
+            stepEmitter.emit(kt.expression)
+            write(stepEmitter)
+            write(s"return 1;")
+            leave
+        }
+
+    }
+
+    private def emitLocals {
 
         // Declare locals.
         for (l <- kt.states if l.isLocal) {
@@ -123,21 +256,17 @@ private[scalapipe] class CKernelGenerator(
             write(s"$vtype $name;")
         }
 
-        // Declare outputs.
+        // Declare outputs and inputs that are accessed in place.
         for (o <- kt.outputs) {
             val name = o.name
             val vtype = o.valueType
             write(s"$vtype *$name;")
         }
-
-        // Generate the code.
-        val nodeEmitter = new CKernelNodeEmitter(kt, timing)
-        nodeEmitter.emit(kt.expression)
-        write(s"for(;;)")
-        enter
-        write(nodeEmitter)
-        leave
-        leave
+        for (i <- kt.inputs if kt.isHeld(i.name)) {
+            val name = i.name
+            val vtype = i.valueType
+            write(s"$vtype *$name;")
+        }
 
     }
 
@@ -149,6 +278,18 @@ private[scalapipe] class CKernelGenerator(
         getOutput
     }
 
+    // The kernel code for specialized instances.
+    // This is included in the resource code once for each instance with
+    // the port macros bound directly to the port functions of the
+    // instance so that port access can be inlined.
+    private def emitSpecialized: String = {
+        write(s"/* Kernel code to specialize for an instance of ${kt.name}.")
+        write(s" * This is included once for each instance.")
+        write(s" */")
+        emitRun
+        getOutput
+    }
+
     override def emit(dir: File) {
 
         import java.io.{FileOutputStream, PrintStream}
@@ -170,6 +311,14 @@ private[scalapipe] class CKernelGenerator(
         sourcePS.print(emitSource)
         sourcePS.close
 
+        // Generate the code for specialized instances.
+        if (specialize) {
+            val runFile = new File(parent, s"${kt.name}_run.h")
+            val runPS = new PrintStream(new FileOutputStream(runFile))
+            runPS.print(emitSpecialized)
+            runPS.close
+        }
+
     }
 
 }
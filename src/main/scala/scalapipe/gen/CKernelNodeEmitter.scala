@@ -4,17 +4,52 @@ import scalapipe._
 
 private[scalapipe] class CKernelNodeEmitter(
         _kt: InternalKernelType,
-        _timing: Map[ASTNode, Int]
+        _timing: Map[ASTNode, Int],
+        val step: Boolean = false
     ) extends CNodeEmitter(_kt, _timing) with ASTUtils with CTrace {
 
+    // Step functions hand each output to the consumer directly,
+    // so they are not batched.
+    private val batched = kt.batchSize > 1 && !step
+
+    private val readInput =
+        if (step && kt.batchSize > 1) "sp_step_input" else "sp_read_input"
+
+    private def emitAllocate(oindex: Int): String = {
+        val vtype = kt.outputs(oindex).valueType.name
+        if (batched) {
+            s"sp_allocate_output$oindex(kernel)"
+        } else {
+            s"($vtype*)sp_allocate(kernel, $oindex)"
+        }
+    }
+
+    private def emitSend(oindex: Int): String = {
+        if (batched) {
+            s"kernel->sp_out_batch[$oindex].used += 1;"
+        } else {
+            s"sp_send(kernel, $oindex);"
+        }
+    }
+
     override def emitAvailable(node: ASTAvailableNode): String = {
         val name = node.symbol
         if (kt.isInput(name)) {
             val index = kt.inputIndex(name)
-            s"sp_get_available(kernel, $index)"
+            if (batched) {
+                s"(sp_get_available(kernel, $index) - " +
+                s"kernel->sp_in_batch[$index].used)"
+            } else {
+                s"sp_get_available(kernel, $index)"
+            }
         } else if (kt.isOutput(name)) {
             val index = kt.outputIndex(name)
-            s"sp_get_free(kernel, $index)"
+            if (batched) {
+                s"(sp_get_free(kernel, $index) - " +
+                s"kernel->sp_out_batch[$index].used)"
+            } else {
+                s"sp_get_free(kernel, $index)"
+            }
         } else {
             Error.raise("argument to avail must be an input or output", node)
         }
@@ -49,9 +84,11 @@ private[scalapipe] class CKernelNodeEmitter(
         val name = node.symbol
         if (kt.isLocal(name)) {
             return s"$name"
+        } else if (kt.isHeld(name)) {
+            return s"(*$name)"
         } else if (kt.isInput(name)) {
             val index = kt.inputIndex(name)
-            return s"sp_read_input$index(kernel)"
+            return s"$readInput$index(kernel)"
         } else if (kt.isOutput(name)) {
             return s"*$name"
         } else if (kt.isState(name) || kt.isConfig(name)) {
@@ -73,34 +110,71 @@ private[scalapipe] class CKernelNodeEmitter(
     }
 
     override def emitAssign(node: ASTAssignNode) {
-        val outputs = localOutputs(node)
+        val outputs = localOutputs(node).filterNot(kt.isHeld)
         for (o <- outputs) {
             val oindex = kt.outputIndex(o)
-            val vtype = kt.outputs(oindex).valueType.name
-            write(s"$o = ($vtype*)sp_allocate(kernel, $oindex);")
+            write(s"$o = ${emitAllocate(oindex)};")
         }
         val dest = emitExpr(node.dest)
         val src = emitExpr(node.src)
         write(s"$dest = $src;")
         updateClocks(getTiming(node))
         for (oindex <- outputs.map(kt.outputIndex)) {
-            write(s"sp_send(kernel, $oindex);")
+            write(emitSend(oindex))
         }
     }
 
     override def emitStop(node: ASTStopNode) {
         updateClocks(getTiming(node))
-        write(s"return;")
+        if (batched) {
+            write(s"sp_${kt.name}_sync(kernel);")
+        }
+        if (step) {
+            write(s"return 0;")
+        } else {
+            write(s"return;")
+        }
     }
 
     override def emitReturn(node: ASTReturnNode) {
         val name = kt.outputs(0).name
-        val vtype = kt.outputs(0).valueType.name
         val src = emitExpr(node.a)
-        write(s"$name = ($vtype*)sp_allocate(kernel, 0);")
-        write(s"*$name = $src;")
-        updateClocks(getTiming(node))
-        write(s"sp_send(kernel, 0);")
+        if (kt.isHeld(name)) {
+            write(s"*$name = $src;")
+            updateClocks(getTiming(node))
+        } else {
+            write(s"$name = ${emitAllocate(0)};")
+            write(s"*$name = $src;")
+            updateClocks(getTiming(node))
+            write(emitSend(0))
+        }
+    }
+
+    // Held ports point directly at the item in the queue.
+    override def emitPort(node: ASTPortNode) {
+        val name = node.symbol
+        if (kt.isOutput(name)) {
+            val index = kt.outputIndex(name)
+            node.op match {
+                case NodeType.ACQUIRE   =>
+                    write(s"$name = ${emitAllocate(index)};")
+                case _                  =>
+                    write(emitSend(index))
+            }
+        } else {
+            val index = kt.inputIndex(name)
+            val vtype = kt.inputs(index).valueType
+            node.op match {
+                case NodeType.ACQUIRE if batched    =>
+                    write(s"$name = sp_acquire_input$index(kernel);")
+                case NodeType.ACQUIRE               =>
+                    write(s"$name = ($vtype*)sp_read_value(kernel, $index);")
+                case _ if batched                   =>
+                    write(s"kernel->sp_in_batch[$index].used += 1;")
+                case _                              =>
+                    write(s"sp_release(kernel, $index);")
+            }
+        }
     }
 
     override def updateClocks(count: Int) {
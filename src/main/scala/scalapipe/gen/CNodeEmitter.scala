@@ -18,6 +18,10 @@ private[scalapipe] abstract class CNodeEmitter(
     def emitReturn(node: ASTReturnNode)
     def updateClocks(count: Int)
 
+    def emitPort(node: ASTPortNode) {
+        Error.raise("acquire and release are only valid in C kernels", node)
+    }
+
     private def emitBinaryOp(op: String, node: ASTOpNode): String =
         "(" + emitExpr(node.a) + ") " + op + " (" + emitExpr(node.b) + ")"
 
@@ -187,6 +191,11 @@ private[scalapipe] abstract class CNodeEmitter(
             case (at: IntegerValueType, bt: PointerValueType) =>
                 subexpr
 
+            // Kernel code may be compiled as C++, which requires a cast
+            // from void pointers.
+            case (at: PointerValueType, bt: PointerValueType) =>
+                "(" + bt + ")(" + subexpr + ")"
+
             case _ =>
                 Error.raise("invalid (ast) conversion from " + srcType +
                             " to " + destType, node)
@@ -306,6 +315,7 @@ private[scalapipe] abstract class CNodeEmitter(
             case stop:  ASTStopNode     => emitStop(stop)
             case block: ASTBlockNode    => emitBlock(block)
             case ret:   ASTReturnNode   => emitReturn(ret)
+            case port:  ASTPortNode     => emitPort(port)
             case null                   => ()
             case _                      =>
                 Error.raise("invalid start statement: " + node, node)
@@ -16,13 +16,26 @@ private[scalapipe] class CPUResourceGenerator(
     private val edgeGenerators = new HashMap[EdgeGenerator, HashSet[Stream]]
     private val emittedKernelTypes = new HashSet[KernelType]
     private val threadIds = new HashMap[KernelInstance, Int]
+    private val replicaCounts = new HashMap[KernelInstance, Int]
+    private val workers = sp.parameters.get[Int]('workers)
+    private val useTasks = workers > 0
+    private val specialize = sp.parameters.get[Boolean]('specialize)
+    private val clock = sp.parameters.get[String]('clock)
+    private val metrics = sp.parameters.get[Int]('metrics)
+    private val report = sp.parameters.get[Int]('report)
+    private val queueProfile = sp.parameters.get[String]('queueProfile)
+    private val sampleQueues = report > 0 || queueProfile != null
+    private val counters = sp.parameters.get[Boolean]('counters)
 
     private lazy val openCLEdgeGenerator = new OpenCLEdgeGenerator(sp)
     private lazy val smartFusionEdgeGenerator = new SmartFusionEdgeGenerator(sp)
     private lazy val simulationEdgeGenerator = new SimulationEdgeGenerator(sp)
     private lazy val saturnEdgeGenerator = new SaturnEdgeGenerator(sp)
-    private lazy val sockEdgeGenerator = new SockEdgeGenerator(sp, host)
-    private lazy val cEdgeGenerator = new CEdgeGenerator
+    private lazy val sockEdgeGenerator =
+        new SockEdgeGenerator(sp, host, useTasks)
+    private lazy val shmEdgeGenerator = new ShmEdgeGenerator(sp, host)
+    private lazy val cEdgeGenerator = new CEdgeGenerator(useTasks)
+    private lazy val fusedEdgeGenerator = new FusedEdgeGenerator(specialize)
 
     private def getHDLEdgeGenerator: EdgeGenerator = {
         val fpga = sp.parameters.get[String]('fpga)
@@ -42,11 +55,17 @@ private[scalapipe] class CPUResourceGenerator(
         val src = stream.sourceKernel.device
 
         val generator: EdgeGenerator = stream.edge match {
+            case _ if stream.fused                      => fusedEdgeGenerator
             case c2f: CPU2FPGA                          => getHDLEdgeGenerator
             case f2c: FPGA2CPU                          => getHDLEdgeGenerator
             case c2g: CPU2GPU                           => openCLEdgeGenerator
             case g2c: GPU2CPU                           => openCLEdgeGenerator
-            case c2c: CPU2CPU if dest.host != src.host  => sockEdgeGenerator
+            case c2c: CPU2CPU if dest.host != src.host  =>
+                if (sp.usesSharedMemory(stream)) {
+                    shmEdgeGenerator
+                } else {
+                    sockEdgeGenerator
+                }
             case _                                      => cEdgeGenerator
         }
 
@@ -57,6 +76,158 @@ private[scalapipe] class CPUResourceGenerator(
 
     }
 
+    private def isBatched(stream: Stream): Boolean = {
+        edgeGenerators.exists { case (generator, streams) =>
+            generator.batched && streams.contains(stream)
+        }
+    }
+
+    private def isCEdge(stream: Stream): Boolean = {
+        edgeGenerators.get(cEdgeGenerator) match {
+            case Some(streams)  => streams.contains(stream)
+            case None           => false
+        }
+    }
+
+    private def isSockEdge(stream: Stream): Boolean = {
+        edgeGenerators.get(sockEdgeGenerator) match {
+            case Some(streams)  => streams.contains(stream)
+            case None           => false
+        }
+    }
+
+    private def isShmEdge(stream: Stream): Boolean = {
+        edgeGenerators.get(shmEdgeGenerator) match {
+            case Some(streams)  => streams.contains(stream)
+            case None           => false
+        }
+    }
+
+    private def queueUsed(stream: Stream): String = {
+        if (stream.fused) {
+            fusedEdgeGenerator.queueUsed(stream)
+        } else if (isCEdge(stream)) {
+            cEdgeGenerator.queueUsed(stream)
+        } else if (isSockEdge(stream)) {
+            sockEdgeGenerator.queueUsed(stream)
+        } else if (isShmEdge(stream)) {
+            shmEdgeGenerator.queueUsed(stream)
+        } else {
+            s"spq_get_used(q_${stream.label})"
+        }
+    }
+
+    // Determine if the other side of a stream signals waiters.
+    private def signalsWaiters(stream: Stream): Boolean = {
+        isCEdge(stream) ||
+            (isSockEdge(stream) && sockEdgeGenerator.canBlock(stream))
+    }
+
+    // Get the wait strategy to use for a stream.
+    // Only C edges and incoming socket edges signal waiters, so other
+    // edges spin instead of block.
+    private def waitStrategy(stream: Stream): String = {
+        val strategy = stream.parameters.get[String]('wait)
+        strategy match {
+            case "yield" | "spin"               => strategy
+            case "block" if signalsWaiters(stream) => strategy
+            case "block"                        => "spin"
+            case _ =>
+                Error.raise(s"invalid wait strategy: $strategy", stream)
+                "yield"
+        }
+    }
+
+    private def usesWaitState(streams: Seq[Stream]): Boolean = {
+        useTasks || streams.exists { s => waitStrategy(s) != "yield" }
+    }
+
+    // Statement to let other kernels run.
+    private def yieldCall: String =
+        if (useTasks) "spt_yield();" else "sched_yield();"
+
+    private def writeWaitState(streams: Seq[Stream]) {
+        if (usesWaitState(streams)) {
+            write(s"SPWaitState wait;")
+            write(s"spw_start(&wait);")
+        }
+    }
+
+    // Tasks park on C edges since only C edges signal the other side.
+    // Fused kernels park the task of the kernel that runs them.
+    private def writeWait(streams: Seq[Stream],
+                          port: String,
+                          index: Stream => Int,
+                          kernel: KernelInstance,
+                          wait: String) {
+        val instance = kernel.label
+        val task = s"${kernel.threadOwner.label}.task"
+        if (usesWaitState(streams)) {
+            write(s"switch($port) {")
+            for (stream <- streams) {
+                write(s"case ${index(stream)}:")
+                enter
+                if (useTasks && isCEdge(stream)) {
+                    write(s"spt_wait(&$task, &wait);")
+                } else if (useTasks) {
+                    write(s"spt_yield();")
+                } else {
+                    waitStrategy(stream) match {
+                        case "block"    =>
+                            write(s"spw_wait(&$instance.$wait, &wait);")
+                        case "spin"     =>
+                            write(s"sp_spin_wait(&wait.spins);")
+                        case _          =>
+                            write(s"sched_yield();")
+                    }
+                }
+                write(s"break;")
+                leave
+            }
+            write(s"}")
+        } else {
+            write(s"sched_yield();")
+        }
+    }
+
+    // Get the number of replicas to run for a kernel.
+    private def replicas(kernel: KernelInstance): Int = {
+        replicaCounts.getOrElseUpdate(kernel, {
+            val count = kernel.kernelType.replicas
+            val trace = sp.parameters.get[Boolean]('trace)
+            if (count > 1 && (useTasks || trace)) {
+                Error.warn(s"not replicating ${kernel.name}: replicas " +
+                           "require one thread per kernel and no trace")
+                1
+            } else {
+                count
+            }
+        })
+    }
+
+    // Determine if a kernel uses kernel code specialized for its ports.
+    // Replicas share their port functions, so they use the vtable.
+    private def specialized(kernel: KernelInstance): Boolean = {
+        specialize && kernel.kernelType.internal && replicas(kernel) == 1
+    }
+
+    // Determine if hardware counters are opened for a kernel.
+    // Counters are per thread, so tasks, fused kernels, and replicated
+    // kernels are not counted.
+    private def hasCounters(kernel: KernelInstance): Boolean = {
+        counters && !useTasks && kernel.fusedInto == null &&
+        replicas(kernel) == 1
+    }
+
+    // Get the name of the run function for a kernel.
+    private def runFunction(kernel: KernelInstance): String = {
+        if (specialized(kernel)) {
+            s"sp_${kernel.label}::sp_${kernel.name}_run"
+        } else {
+            s"sp_${kernel.name}_run"
+        }
+    }
+
     private def shouldEmit(device: Device): Boolean = {
         device.platform == Platforms.C && device.host == host
     }
@@ -78,12 +249,33 @@ private[scalapipe] class CPUResourceGenerator(
         write(s"static struct {")
         enter
         write(s"SPC clock;")
+        if (hasCounters(kernel)) {
+            write(s"SPCounters counters;")
+        }
         write(s"jmp_buf env;")
         write(s"volatile uint32_t active_inputs;")
+        write(s"SPWait input_wait;")
+        write(s"SPWait output_wait;")
+        if (useTasks) {
+            write(s"SPTask task;")
+        }
         write(s"SPKernelData data;")
         write(s"struct sp_${kernel.kernelType.name}_data priv;")
+        if (replicas(kernel) > 1) {
+            write(s"SPPool pool;")
+            write(s"struct {")
+            enter
+            write(s"jmp_buf env;")
+            write(s"SPKernelData data;")
+            write(s"struct sp_${kernel.kernelType.name}_data priv;")
+            leave
+            write(s"} replicas[${replicas(kernel)}];")
+        }
         leave
         write(s"} ${kernel.label};")
+        if (replicas(kernel) > 1) {
+            write(s"static __thread int ${kernel.label}_replica = 0;")
+        }
 
     }
 
@@ -134,6 +326,8 @@ private[scalapipe] class CPUResourceGenerator(
         // initialized before any producer threads start.
         val inPortCount = kernel.getInputs.size
         write(s"$instance.active_inputs = $inPortCount;")
+        write(s"spw_init(&$instance.input_wait);")
+        write(s"spw_init(&$instance.output_wait);")
 
         // The rest is initialized in the thread.
 
@@ -170,6 +364,7 @@ private[scalapipe] class CPUResourceGenerator(
         enter
         write(s"spc_stop(&$instance.clock);")
         write(s"void *ptr = NULL;")
+        writeWaitState(kernel.getOutputs)
         if (!kernel.getOutputs.filter(_.useFull).isEmpty) {
             write(s"bool first = true;")
         }
@@ -196,11 +391,19 @@ private[scalapipe] class CPUResourceGenerator(
         write(s"}")
         write(s"if(SPLIKELY(ptr != NULL)) {")
         enter
+        if (report > 0) {
+            write(s"spc_output_done(&$instance.clock);")
+        }
         write(s"spc_start(&$instance.clock);")
         write(s"return ptr;")
         leave
         write(s"}")
-        write(s"sched_yield();");
+        if (report > 0) {
+            write(s"spc_wait(&$instance.clock);")
+        }
+        writeWait(kernel.getOutputs, "out_port",
+                  s => kernel.outputIndex(s.sourcePort),
+                  kernel, "output_wait")
         leave
         write(s"}")
         leave
@@ -239,6 +442,102 @@ private[scalapipe] class CPUResourceGenerator(
 
     }
 
+    private def emitKernelAllocateN(kernel: KernelInstance) {
+
+        val instance = kernel.label
+
+        write(s"static void *${instance}_allocate_n(int out_port, int *count)")
+        write(s"{")
+        enter
+        write(s"spc_stop(&$instance.clock);")
+        write(s"void *ptr = NULL;")
+        writeWaitState(kernel.getOutputs)
+        if (!kernel.getOutputs.filter(_.useFull).isEmpty) {
+            write(s"bool first = true;")
+        }
+        write(s"for(;;) {")
+        enter
+
+        write(s"switch(out_port) {")
+        for (stream <- kernel.getOutputs) {
+            val index = kernel.outputIndex(stream.sourcePort)
+            write(s"case $index:")
+            enter
+            if (isBatched(stream)) {
+                write(s"ptr = ${stream.label}_allocate_n(count);")
+            } else {
+                write(s"*count = 1;")
+                write(s"ptr = ${stream.label}_allocate();")
+            }
+            if (stream.useFull) {
+                write(s"if(first && ptr == NULL) {")
+                enter
+                write(s"first = false;")
+                write(s"tta->LogEvent(${stream.index}, TTA_TYPE_FULL);")
+                leave
+                write(s"}")
+            }
+            write(s"break;")
+            leave
+        }
+        write(s"}")
+        write(s"if(SPLIKELY(ptr != NULL)) {")
+        enter
+        if (report > 0) {
+            write(s"spc_output_done(&$instance.clock);")
+        }
+        write(s"spc_start(&$instance.clock);")
+        write(s"return ptr;")
+        leave
+        write(s"}")
+        if (report > 0) {
+            write(s"spc_wait(&$instance.clock);")
+        }
+        writeWait(kernel.getOutputs, "out_port",
+                  s => kernel.outputIndex(s.sourcePort),
+                  kernel, "output_wait")
+        leave
+        write(s"}")
+        leave
+        write(s"}")
+
+    }
+
+    private def emitKernelSendN(kernel: KernelInstance) {
+
+        val instance = kernel.label
+
+        write(s"static void ${instance}_send_n(int out_port, int count)")
+        write(s"{")
+        enter
+        val outputCount = kernel.getOutputs.size
+        if (outputCount > 0) {
+            write(s"spc_stop(&$instance.clock);")
+            write(s"switch(out_port) {")
+            for (stream <- kernel.getOutputs) {
+                val index = kernel.outputIndex(stream.sourcePort)
+                write(s"case $index:")
+                enter
+                if (stream.usePush) {
+                    write(s"tta->LogEvents(${stream.index}, TTA_TYPE_PUSH, " +
+                          s"count, ${stream.label}_get_free() == 0);")
+                }
+                if (isBatched(stream)) {
+                    write(s"${stream.label}_send_n(count);")
+                } else {
+                    write(s"${stream.label}_send();")
+                }
+                write(s"break;")
+                leave
+            }
+            write(s"}")
+            write(s"spc_start(&$instance.clock);")
+        }
+        leave
+        write(s"}")
+
+    }
+
     private def emitKernelAvailable(kernel: KernelInstance) {
 
         val instance = kernel.label
@@ -276,6 +575,7 @@ private[scalapipe] class CPUResourceGenerator(
         enter
         write(s"void *ptr = NULL;")
         write(s"int end_count = 0;")
+        writeWaitState(kernel.getInputs)
         write(s"spc_stop(&$instance.clock);")
         write(s"for(;;) {")
         enter
@@ -294,6 +594,9 @@ private[scalapipe] class CPUResourceGenerator(
         write(s"if(SPLIKELY(ptr != NULL)) {")
         enter
         write(s"$instance.clock.count += 1;");
+        if (report > 0) {
+            write(s"spc_input_done(&$instance.clock);")
+        }
         write(s"spc_start(&$instance.clock);")
         write(s"return ptr;")
         leave
@@ -306,9 +609,18 @@ private[scalapipe] class CPUResourceGenerator(
         leave
         write(s"}")
         write(s"end_count += 1;")
+        if (usesWaitState(kernel.getInputs)) {
+            write(yieldCall)
+            write(s"continue;")
+        }
         leave
         write(s"}")
-        write(s"sched_yield();")
+        if (report > 0) {
+            write(s"spc_wait(&$instance.clock);")
+        }
+        writeWait(kernel.getInputs, "in_port",
+                  s => kernel.inputIndex(s.destPort),
+                  kernel, "input_wait")
         leave
         write(s"}")
         leave
@@ -344,123 +656,651 @@ private[scalapipe] class CPUResourceGenerator(
         write(s"}")
 
     }
-    private def emitThread(kernel: KernelInstance) {
 
-        val id = threadIds(kernel)
-        val name = kernel.name
+    private def emitKernelReadN(kernel: KernelInstance) {
+
         val instance = kernel.label
-        val kernelType = kernel.kernelType
-        val inPortCount = kernel.getInputs.size
-        val outPortCount = kernel.getOutputs.size
-        val affinity = kernel.device.index
 
-        write(s"static void *run_thread$id(void *arg)")
+        write(s"static void *${instance}_read_n(int in_port, int *count)")
         write(s"{")
         enter
-
-        // Thread affinity.
-        write(s"sp_set_affinity($affinity);")
-
-        // Open the trace file and set up the stream mapping.
-        if (sp.parameters.get[Boolean]('trace)) {
-            val fname = s"${name}${kernel.index}.trace"
-            write(s"""$instance.priv.trace_fd = fopen("$fname", "w");""")
-            val inputOffset = 0
-            for (i <- kernel.getInputs) {
-                val key = kernel.inputIndex(i) + inputOffset
-                val value = i.index
-                write(s"$instance.priv.trace_streams[$key] = $value;")
-            }
-            val outputOffset = kernel.getInputs.size
-            for (o <- kernel.getOutputs) {
-                val key = kernel.outputIndex(o) + outputOffset
-                val value = o.index
-                write(s"$instance.priv.trace_streams[$key] = $value;")
+        write(s"void *ptr = NULL;")
+        write(s"int end_count = 0;")
+        writeWaitState(kernel.getInputs)
+        write(s"spc_stop(&$instance.clock);")
+        write(s"for(;;) {")
+        enter
+        if (!kernel.getInputs.isEmpty) {
+            write(s"switch(in_port) {")
+            for (stream <- kernel.getInputs) {
+                val index = kernel.inputIndex(stream.destPort)
+                write(s"case $index:")
+                enter
+                if (isBatched(stream)) {
+                    write(s"ptr = ${stream.label}_read_n(count);")
+                } else {
+                    write(s"*count = 1;")
+                    write(s"ptr = ${stream.label}_read_value();")
+                }
+                write(s"break;")
+                leave
             }
+            write(s"}")
+        }
+        write(s"if(SPLIKELY(ptr != NULL)) {")
+        enter
+        write(s"$instance.clock.count += *count;");
+        if (report > 0) {
+            write(s"spc_input_done(&$instance.clock);")
         }
-
-        // SP_kernel_data
-        write(s"$instance.data.in_port_count = $inPortCount;")
-        write(s"$instance.data.out_port_count = $outPortCount;")
-        write(s"$instance.data.get_free = ${instance}_get_free;")
-        write(s"$instance.data.allocate = ${instance}_allocate;")
-        write(s"$instance.data.send = ${instance}_send;")
-        write(s"$instance.data.get_available = ${instance}_get_available;")
-        write(s"$instance.data.read_value = ${instance}_read_value;")
-        write(s"$instance.data.release = ${instance}_release;")
-
-        // Clock
-        write(s"spc_init(&${instance}.clock);")
-
         write(s"spc_start(&$instance.clock);")
-        write(s"sp_${name}_init(&$instance.priv);")
-        write(s"if(setjmp($instance.env) == 0) {")
+        write(s"return ptr;")
+        leave
+        write(s"}")
+        write(s"if(SPUNLIKELY($instance.active_inputs == 0)) {")
+        enter
+        write(s"if(end_count > 1) {")
         enter
-        write(s"sp_${name}_run(&$instance.priv);")
+        write(s"longjmp($instance.env, 1);")
         leave
         write(s"}")
-        write(s"sp_${name}_destroy(&$instance.priv);")
-        write(s"spc_stop(&$instance.clock);")
-        if (sp.parameters.get[Boolean]('trace)) {
-            write(s"fclose($instance.priv.trace_fd);")
+        write(s"end_count += 1;")
+        if (usesWaitState(kernel.getInputs)) {
+            write(yieldCall)
+            write(s"continue;")
         }
-        kernel.getOutputs.map(_.label).foreach { label =>
-            write(s"${label}_finish();")
+        leave
+        write(s"}")
+        if (report > 0) {
+            write(s"spc_wait(&$instance.clock);")
         }
-        write(s"return NULL;")
+        writeWait(kernel.getInputs, "in_port",
+                  s => kernel.inputIndex(s.destPort),
+                  kernel, "input_wait")
+        leave
+        write(s"}")
         leave
         write(s"}")
 
     }
 
-    private def writeShutdown(instances: Traversable[KernelInstance],
-                              edgeStats: ListBuffer[Generator]) {
+    private def emitKernelReleaseN(kernel: KernelInstance) {
 
-        def writeKernelStats(k: KernelInstance) {
-            write(s"ticks = ${k.label}.clock.total_ticks;");
-            write(s"reads = ${k.label}.clock.count;")
-            write(s"us = (ticks * total_us) / total_ticks;")
-            write(s"""fprintf(stderr, \"     ${k.kernelType.name}(""" +
-                  s"""${k.label}): %llu ticks, %llu reads, %llu us\\n\", """ +
-                  s"""ticks, reads, us);""")
-            if (k.kernelType.parameters.get('profile)) {
-                write(s"""fprintf(stderr, \"        HDL Clocks: %lu\\n\", """ +
-                      s"""${k.label}.priv.sp_clocks);""")
-            }
-            write(s"if (show_extra_stats) {")
+        val instance = kernel.label
+
+        write(s"static void ${instance}_release_n(int in_port, int count)")
+        write(s"{")
+        enter
+        write(s"spc_stop(&$instance.clock);")
+        write(s"switch(in_port) {")
+        for (stream <- kernel.getInputs) {
+            val index = kernel.inputIndex(stream.destPort)
+            write(s"case $index:")
             enter
-            k.getInputs.foreach { i =>
-                val index = k.inputIndex(i)
-                write(s"q_size = q_${i.label}->depth;")
-                write(s"q_usage = spq_get_used(q_${i.label});")
-                write(s"""fprintf(stderr, \"          Input $index: """ +
-                      s"""%llu / %llu\\n\", q_usage, q_size);""")
+            if (stream.usePop) {
+                write(s"tta->LogEvents(${stream.index}, TTA_TYPE_POP, " +
+                      s"count, ${stream.label}_get_free() == 0);")
             }
+            if (isBatched(stream)) {
+                write(s"${stream.label}_release_n(count);")
+            } else {
+                write(s"${stream.label}_release();")
+            }
+            write(s"break;")
             leave
-            write(s"}")
         }
+        write(s"}")
+        write(s"spc_start(&$instance.clock);")
+        leave
+        write(s"}")
 
-        write("static void showStats()")
-        write("{")
+    }
+
+    private def emitReplicaFill(kernel: KernelInstance) {
+
+        val instance = kernel.label
+        val stream = kernel.getInputs.head
+        val vtype = stream.valueType
+
+        // Read up to max items from the input.
+        // Returns 0 once the input is finished.
+        write(s"static int ${instance}_fill(char *dest, int max)")
+        write(s"{")
         enter
-        write("struct timeval stop_time;")
-        write("unsigned long long q_usage;")
+        write(s"void *ptr = NULL;")
+        write(s"int count = max;")
+        write(s"int end_count = 0;")
+        writeWaitState(kernel.getInputs)
+        write(s"for(;;) {")
+        enter
+        if (isBatched(stream)) {
+            write(s"ptr = ${stream.label}_read_n(&count);")
+        } else {
+            write(s"count = 1;")
+            write(s"ptr = ${stream.label}_read_value();")
+        }
+        write(s"if(SPLIKELY(ptr != NULL)) {")
+        enter
+        write(s"break;")
+        leave
+        write(s"}")
+        write(s"if(SPUNLIKELY($instance.active_inputs == 0)) {")
+        enter
+        write(s"if(end_count > 1) {")
+        enter
+        write(s"return 0;")
+        leave
+        write(s"}")
+        write(s"end_count += 1;")
+        if (usesWaitState(kernel.getInputs)) {
+            write(yieldCall)
+            write(s"continue;")
+        }
+        leave
+        write(s"}")
+        writeWait(kernel.getInputs, "0", s => 0, kernel, "input_wait")
+        leave
+        write(s"}")
+        write(s"memcpy(dest, ptr, count * sizeof($vtype));")
+        if (stream.usePop) {
+            write(s"tta->LogEvents(${stream.index}, TTA_TYPE_POP, " +
+                  s"count, ${stream.label}_get_free() == 0);")
+        }
+        if (isBatched(stream)) {
+            write(s"${stream.label}_release_n(count);")
+        } else {
+            write(s"${stream.label}_release();")
+        }
+        write(s"$instance.clock.count += count;")
+        write(s"return count;")
+        leave
+        write(s"}")
+
+    }
+
+    private def emitReplicaDrain(kernel: KernelInstance) {
+
+        val instance = kernel.label
+        val stream = kernel.getOutputs.head
+        val vtype = stream.valueType
+
+        // Write count items to the output.
+        write(s"static void ${instance}_drain(const char *src, int count)")
+        write(s"{")
+        enter
+        write(s"while(count > 0) {")
+        enter
+        write(s"void *ptr = NULL;")
+        write(s"int n = count;")
+        writeWaitState(kernel.getOutputs)
+        if (stream.useFull) {
+            write(s"bool first = true;")
+        }
+        write(s"for(;;) {")
+        enter
+        if (isBatched(stream)) {
+            write(s"ptr = ${stream.label}_allocate_n(&n);")
+        } else {
+            write(s"n = 1;")
+            write(s"ptr = ${stream.label}_allocate();")
+        }
+        write(s"if(SPLIKELY(ptr != NULL)) {")
+        enter
+        write(s"break;")
+        leave
+        write(s"}")
+        if (stream.useFull) {
+            write(s"if(first) {")
+            enter
+            write(s"first = false;")
+            write(s"tta->LogEvent(${stream.index}, TTA_TYPE_FULL);")
+            leave
+            write(s"}")
+        }
+        writeWait(kernel.getOutputs, "0", s => 0, kernel, "output_wait")
+        leave
+        write(s"}")
+        write(s"memcpy(ptr, src, n * sizeof($vtype));")
+        if (stream.usePush) {
+            write(s"tta->LogEvents(${stream.index}, TTA_TYPE_PUSH, " +
+                  s"n, ${stream.label}_get_free() == 0);")
+        }
+        if (isBatched(stream)) {
+            write(s"${stream.label}_send_n(n);")
+        } else {
+            write(s"${stream.label}_send();")
+        }
+        write(s"src += n * sizeof($vtype);")
+        write(s"count -= n;")
+        leave
+        write(s"}")
+        leave
+        write(s"}")
+
+    }
+
+    // Port functions for replicas.
+    // Inputs are taken from the replica pool and outputs are buffered
+    // until the firing is complete.
+    private def emitReplicaPorts(kernel: KernelInstance) {
+
+        val instance = kernel.label
+        val input = kernel.getInputs.head
+        val output = kernel.getOutputs.head
+        val pool = s"&$instance.pool"
+        val replica = s"${instance}_replica"
+
+        write(s"static int ${instance}_r_get_free(int out_port)")
+        write(s"{")
+        enter
+        write(s"return ${output.label}_get_free();")
+        leave
+        write(s"}")
+
+        write(s"static void *${instance}_r_allocate_n(int out_port, " +
+              s"int *count)")
+        write(s"{")
+        enter
+        write(s"return spp_allocate($pool, $replica, count);")
+        leave
+        write(s"}")
+
+        write(s"static void *${instance}_r_allocate(int out_port)")
+        write(s"{")
+        enter
+        write(s"int count = 1;")
+        write(s"return spp_allocate($pool, $replica, &count);")
+        leave
+        write(s"}")
+
+        write(s"static void ${instance}_r_send_n(int out_port, int count)")
+        write(s"{")
+        enter
+        write(s"spp_send($pool, $replica, count);")
+        leave
+        write(s"}")
+
+        write(s"static void ${instance}_r_send(int out_port)")
+        write(s"{")
+        enter
+        write(s"spp_send($pool, $replica, 1);")
+        leave
+        write(s"}")
+
+        write(s"static int ${instance}_r_get_available(int in_port)")
+        write(s"{")
+        enter
+        write(s"return spp_available($pool, $replica) + " +
+              s"${input.label}_get_available();")
+        leave
+        write(s"}")
+
+        write(s"static void *${instance}_r_read_value(int in_port)")
+        write(s"{")
+        enter
+        write(s"void *ptr = spp_read($pool, $replica);")
+        write(s"if(SPUNLIKELY(ptr == NULL)) {")
+        enter
+        write(s"longjmp($instance.replicas[$replica].env, 1);")
+        leave
+        write(s"}")
+        write(s"return ptr;")
+        leave
+        write(s"}")
+
+        write(s"static void *${instance}_r_read_n(int in_port, int *count)")
+        write(s"{")
+        enter
+        write(s"*count = 1;")
+        write(s"return ${instance}_r_read_value(in_port);")
+        leave
+        write(s"}")
+
+        // Items are copied out of the queue when claimed,
+        // so there is nothing to release.
+        write(s"static void ${instance}_r_release(int in_port)")
+        write(s"{")
+        write(s"}")
+
+        write(s"static void ${instance}_r_release_n(int in_port, int count)")
+        write(s"{")
+        write(s"}")
+
+    }
+
+    private def emitReplicaThread(kernel: KernelInstance) {
+
+        val id = threadIds(kernel)
+        val name = kernel.name
+        val instance = kernel.label
+        val count = replicas(kernel)
+        val batch = sp.parameters.get[Int]('batchSize)
+        val inType = kernel.getInputs.head.valueType
+        val outType = kernel.getOutputs.head.valueType
+        val replica = s"$instance.replicas[id]"
+
+        emitReplicaFill(kernel)
+        emitReplicaDrain(kernel)
+        emitReplicaPorts(kernel)
+
+        write(s"static void *${instance}_run_replica(void *arg)")
+        write(s"{")
+        enter
+        write(s"const int id = (int)(intptr_t)arg;")
+        write(s"${instance}_replica = id;")
+        write(s"$replica.data.in_port_count = 1;")
+        write(s"$replica.data.out_port_count = 1;")
+        for (f <- Seq("get_free", "allocate", "send", "get_available",
+                      "read_value", "release", "allocate_n", "send_n",
+                      "read_n", "release_n")) {
+            write(s"$replica.data.$f = ${instance}_r_$f;")
+        }
+        write(s"$replica.priv = $instance.priv;")
+        write(s"sp_${name}_init(&$replica.priv);")
+        write(s"if(setjmp($replica.env) == 0) {")
+        enter
+        write(s"sp_${name}_run(&$replica.priv);")
+        leave
+        write(s"}")
+        write(s"spp_exit(&$instance.pool, id);")
+        write(s"sp_${name}_destroy(&$replica.priv);")
+        write(s"return NULL;")
+        leave
+        write(s"}")
+
+        // Threads inherit the affinity of their creator, so no affinity
+        // is set here to let the replicas spread across CPUs.
+        write(s"static void *run_thread$id(void *arg)")
+        write(s"{")
+        enter
+        write(s"pthread_t threads[$count];")
+        write(s"spc_init(&$instance.clock);")
+        write(s"spc_start(&$instance.clock);")
+        write(s"spp_init(&$instance.pool, $count, $batch, sizeof($inType), " +
+              s"sizeof($outType), ${instance}_fill, ${instance}_drain);")
+        write(s"for(int i = 1; i < $count; i++) {")
+        enter
+        write(s"pthread_create(&threads[i], NULL, ${instance}_run_replica, " +
+              s"(void*)(intptr_t)i);")
+        leave
+        write(s"}")
+        write(s"${instance}_run_replica(NULL);")
+        write(s"for(int i = 1; i < $count; i++) {")
+        enter
+        write(s"pthread_join(threads[i], NULL);")
+        leave
+        write(s"}")
+        write(s"spc_stop(&$instance.clock);")
+        write(s"spp_destroy(&$instance.pool);")
+        kernel.getOutputs.map(_.label).foreach { label =>
+            write(s"${label}_finish();")
+        }
+        write(s"return NULL;")
+        leave
+        write(s"}")
+
+    }
+
+    // Include the kernel code specialized for the ports of a kernel.
+    // The port macros are bound directly to the port functions of the
+    // instance so that the compiler can inline port access.
+    private def emitSpecialized(kernel: KernelInstance) {
+
+        if (!specialized(kernel)) {
+            return
+        }
+
+        val name = kernel.name
+        val instance = kernel.label
+        val macros = Seq(
+            ("sp_get_free", "out_port", "get_free"),
+            ("sp_allocate", "out_port", "allocate"),
+            ("sp_send", "out_port", "send"),
+            ("sp_get_available", "in_port", "get_available"),
+            ("sp_read_value", "in_port", "read_value"),
+            ("sp_release", "in_port", "release"),
+            ("sp_allocate_n", "out_port, count", "allocate_n"),
+            ("sp_send_n", "out_port, count", "send_n"),
+            ("sp_read_n", "in_port, count", "read_n"),
+            ("sp_release_n", "in_port, count", "release_n")
+        )
+
+        for ((m, args, f) <- macros) {
+            write(s"#undef $m")
+            write(s"#define $m(kernel, $args) ${instance}_$f($args)")
+        }
+        write(s"namespace sp_$instance {")
+        write("#include \"" + name + "/" + name + "_run.h\"")
+        write(s"}")
+        for ((m, _, _) <- macros) {
+            write(s"#undef $m")
+        }
+
+    }
+
+    // Set up the trace file, port functions, and clock for a kernel.
+    private def writeKernelSetup(kernel: KernelInstance) {
+
+        val name = kernel.name
+        val instance = kernel.label
+        val inPortCount = kernel.getInputs.size
+        val outPortCount = kernel.getOutputs.size
+
+        // Open the trace file and set up the stream mapping.
+        if (sp.parameters.get[Boolean]('trace)) {
+            val fname = s"${name}${kernel.index}.trace"
+            write(s"""$instance.priv.trace_fd = fopen("$fname", "w");""")
+            val inputOffset = 0
+            for (i <- kernel.getInputs) {
+                val key = kernel.inputIndex(i) + inputOffset
+                val value = i.index
+                write(s"$instance.priv.trace_streams[$key] = $value;")
+            }
+            val outputOffset = kernel.getInputs.size
+            for (o <- kernel.getOutputs) {
+                val key = kernel.outputIndex(o) + outputOffset
+                val value = o.index
+                write(s"$instance.priv.trace_streams[$key] = $value;")
+            }
+        }
+
+        // SP_kernel_data
+        write(s"$instance.data.in_port_count = $inPortCount;")
+        write(s"$instance.data.out_port_count = $outPortCount;")
+        write(s"$instance.data.get_free = ${instance}_get_free;")
+        write(s"$instance.data.allocate = ${instance}_allocate;")
+        write(s"$instance.data.send = ${instance}_send;")
+        write(s"$instance.data.get_available = ${instance}_get_available;")
+        write(s"$instance.data.read_value = ${instance}_read_value;")
+        write(s"$instance.data.release = ${instance}_release;")
+        write(s"$instance.data.allocate_n = ${instance}_allocate_n;")
+        write(s"$instance.data.send_n = ${instance}_send_n;")
+        write(s"$instance.data.read_n = ${instance}_read_n;")
+        write(s"$instance.data.release_n = ${instance}_release_n;")
+
+        // Clock
+        write(s"spc_init(&${instance}.clock);")
+
+    }
+
+    // Shut down a kernel once it has stopped.
+    private def writeKernelExit(kernel: KernelInstance) {
+        val name = kernel.name
+        val instance = kernel.label
+        write(s"sp_${name}_destroy(&$instance.priv);")
+        write(s"spc_stop(&$instance.clock);")
+        if (sp.parameters.get[Boolean]('trace)) {
+            write(s"fclose($instance.priv.trace_fd);")
+        }
+        kernel.getOutputs.map(_.label).foreach { label =>
+            write(s"${label}_finish();")
+        }
+    }
+
+    // Get the fused kernels run by a kernel, furthest upstream first.
+    private def fusedProducers(kernel: KernelInstance): Seq[KernelInstance] = {
+        kernel.getInputs.filter(_.fused).flatMap { s =>
+            fusedProducers(s.sourceKernel) :+ s.sourceKernel
+        }
+    }
+
+    // Fused kernels do not get a thread.
+    // They are set up by the kernel that runs them and are shut down
+    // from the step function of their output stream.
+    private def emitFusedKernel(kernel: KernelInstance) {
+
+        val name = kernel.name
+        val instance = kernel.label
+
+        write(s"static void ${instance}_setup()")
+        write(s"{")
+        enter
+        writeKernelSetup(kernel)
+        write(s"sp_${name}_init(&$instance.priv);")
+        leave
+        write(s"}")
+
+        write(s"static void ${instance}_exit()")
+        write(s"{")
+        enter
+        writeKernelExit(kernel)
+        leave
+        write(s"}")
+
+    }
+
+    private def emitThread(kernel: KernelInstance) {
+
+        if (kernel.fusedInto != null) {
+            emitFusedKernel(kernel)
+            return
+        }
+
+        if (replicas(kernel) > 1) {
+            emitReplicaThread(kernel)
+            return
+        }
+
+        val id = threadIds(kernel)
+        val name = kernel.name
+        val instance = kernel.label
+        val affinity = kernel.device.index
+
+        write(s"static void *run_thread$id(void *arg)")
+        write(s"{")
+        enter
+
+        // Thread affinity.
+        // Tasks move between workers, so affinity is not used for tasks.
+        if (!useTasks) {
+            write(s"sp_set_affinity($affinity);")
+        }
+
+        // Set up the kernels fused into this thread.
+        for (k <- fusedProducers(kernel)) {
+            write(s"${k.label}_setup();")
+        }
+
+        writeKernelSetup(kernel)
+        if (hasCounters(kernel)) {
+            write(s"sp_counters_open(&$instance.counters);")
+        }
+        write(s"spc_start(&$instance.clock);")
+        write(s"sp_${name}_init(&$instance.priv);")
+        if (hasCounters(kernel)) {
+            write(s"sp_counters_start(&$instance.counters);")
+        }
+        write(s"if(setjmp($instance.env) == 0) {")
+        enter
+        write(s"${runFunction(kernel)}(&$instance.priv);")
+        leave
+        write(s"}")
+        if (hasCounters(kernel)) {
+            write(s"sp_counters_stop(&$instance.counters);")
+        }
+        writeKernelExit(kernel)
+        write(s"return NULL;")
+        leave
+        write(s"}")
+
+    }
+
+    private def writeShutdown(instances: Traversable[KernelInstance],
+                              edgeStats: ListBuffer[Generator]) {
+
+        def writeKernelStats(k: KernelInstance) {
+            write(s"reads = ${k.label}.clock.count;")
+            if (clock == "off") {
+                write(s"""fprintf(stderr, \"     ${k.kernelType.name}(""" +
+                      s"""${k.label}): %llu reads\\n\", reads);""")
+            } else {
+                write(s"ticks = spc_get_total(&${k.label}.clock);")
+                write(s"us = sp_ticks_to_ns(ticks) / 1000;")
+                write(s"""fprintf(stderr, \"     ${k.kernelType.name}(""" +
+                      s"""${k.label}): %llu ticks, %llu reads, """ +
+                      s"""%llu us\\n\", ticks, reads, us);""")
+            }
+            if (hasCounters(k)) {
+                write(s"if(sp_counters_read(&${k.label}.counters, counts)) {")
+                enter
+                write(s"""fprintf(stderr, "        Cycles: %llu, """ +
+                      s"""instructions: %llu (IPC %.2f)\\n", """ +
+                      s"""(unsigned long long)counts[0], """ +
+                      s"""(unsigned long long)counts[1], """ +
+                      s"""counts[0] > 0 ? (double)counts[1] / counts[0] """ +
+                      s""": 0.0);""")
+                write(s"""fprintf(stderr, "        LLC misses: %llu, """ +
+                      s"""branch misses: %llu\\n", """ +
+                      s"""(unsigned long long)counts[2], """ +
+                      s"""(unsigned long long)counts[3]);""")
+                leave
+                write(s"}")
+            }
+            if (k.kernelType.parameters.get('profile)) {
+                write(s"""fprintf(stderr, \"        HDL Clocks: %lu\\n\", """ +
+                      s"""${k.label}.priv.sp_clocks);""")
+            }
+            write(s"if (show_extra_stats) {")
+            enter
+            k.getInputs.foreach { i =>
+                val index = k.inputIndex(i)
+                write(s"q_size = q_${i.label}->depth;")
+                write(s"q_usage = ${queueUsed(i)};")
+                write(s"""fprintf(stderr, \"          Input $index: """ +
+                      s"""%llu / %llu\\n\", q_usage, q_size);""")
+            }
+            leave
+            write(s"}")
+        }
+
+        write("static void showStats()")
+        write("{")
+        enter
+        write("unsigned long long q_usage;")
         write("unsigned long long q_size;")
         write("unsigned long long ticks;")
         write("unsigned long long reads;")
         write("unsigned long long us;")
         write("unsigned long long total_ticks;")
         write("unsigned long long total_us;")
+        if (instances.exists(hasCounters)) {
+            write("uint64_t counts[SP_COUNTER_COUNT];")
+        }
         write("unsigned long long stop_ticks = sp_get_ticks();")
-        write("gettimeofday(&stop_time, NULL);")
         write("total_ticks = stop_ticks - start_ticks;")
-        write("total_us = (stop_time.tv_sec - start_time.tv_sec) * 1000000")
-        write("         + (stop_time.tv_usec - start_time.tv_usec);")
+        write("total_us = sp_ticks_to_ns(total_ticks) / 1000;")
         write("""fprintf(stderr, "Statistics:\n");""")
         write("fprintf(stderr, \"Total CPU ticks: %llu\\n\", total_ticks);")
         write("fprintf(stderr, \"Total time:      %llu us\\n\", total_us);")
+        if (clock == "sampled") {
+            write(s"""fprintf(stderr, "Kernel ticks estimated from """ +
+                  s"""1 in %d intervals\\n", SP_CLOCK_PERIOD);""")
+        }
         instances.foreach(writeKernelStats)
         write(edgeStats)
+        if (sampleQueues) {
+            write("finish_report(total_ticks);")
+        }
         leave
         write("}")
 
@@ -475,6 +1315,201 @@ private[scalapipe] class CPUResourceGenerator(
 
     }
 
+    private def writeReport(instances: Traversable[KernelInstance]) {
+
+        val kernels = instances.toSeq
+        val inputs = kernels.flatMap(_.getInputs)
+
+        write(s"static SPReportKernel report_kernels[${kernels.size}] = {")
+        enter
+        for (k <- kernels) {
+            write(s"""{ "${k.kernelType.name}(${k.label})", 0, 0, 0, 0 },""")
+        }
+        leave
+        write("};")
+        write(s"static SPReportEdge report_edges[${inputs.size + 1}] = {")
+        enter
+        for (s <- inputs) {
+            val source = kernels.indexOf(s.sourceKernel)
+            val dest = kernels.indexOf(s.destKernel)
+            write(s"""{ "${s.label}", $source, $dest, 0, """ +
+                  s"""sizeof(${s.valueType}) },""")
+        }
+        leave
+        write("};")
+        write("static SPReport report = {")
+        enter
+        write(s"report_kernels, ${kernels.size},")
+        write(s"report_edges, ${inputs.size},")
+        write(s"0, 0, ${if (clock == "off") 0 else 1}")
+        leave
+        write("};")
+
+        write("static void sample_report()")
+        write("{")
+        enter
+        for ((s, i) <- inputs.zipWithIndex) {
+            write(s"sp_report_sample(&report_edges[$i], ${queueUsed(s)});")
+        }
+        write("report.samples += 1;")
+        leave
+        write("}")
+
+        write("static void *run_report(void *arg)")
+        write("{")
+        enter
+        write("for(;;) {")
+        enter
+        val interval = if (report > 0) report else 10
+        write(s"usleep(${interval * 1000});")
+        write("sample_report();")
+        leave
+        write("}")
+        write("return NULL;")
+        leave
+        write("}")
+
+        write("static void finish_report(unsigned long long ticks)")
+        write("{")
+        enter
+        for ((k, i) <- kernels.zipWithIndex) {
+            write(s"report_kernels[$i].ticks = " +
+                  s"spc_get_total(&${k.label}.clock);")
+            write(s"report_kernels[$i].input_ticks = " +
+                  s"${k.label}.clock.input_ticks;")
+            write(s"report_kernels[$i].output_ticks = " +
+                  s"${k.label}.clock.output_ticks;")
+            write(s"report_kernels[$i].reads = ${k.label}.clock.count;")
+        }
+        write("report.ticks = ticks;")
+        if (report > 0) {
+            write("sp_report_print(stderr, &report);")
+        }
+        if (queueProfile != null) {
+            write(s"""sp_report_write_profile("$queueProfile", &report);""")
+        }
+        leave
+        write("}")
+
+    }
+
+    private def writeReportStart(instances: Traversable[KernelInstance]) {
+        val inputs = instances.toSeq.flatMap(_.getInputs)
+        for ((s, i) <- inputs.zipWithIndex) {
+            write(s"report_edges[$i].depth = q_${s.label}->depth;")
+        }
+        write("{")
+        enter
+        write("pthread_t report_thread;")
+        write("pthread_create(&report_thread, NULL, run_report, NULL);")
+        write("pthread_detach(report_thread);")
+        leave
+        write("}")
+    }
+
+    private def writeMetrics(instances: Traversable[KernelInstance]) {
+
+        val inputs = instances.toSeq.flatMap(_.getInputs)
+
+        write("static SPMetrics *metrics = NULL;")
+
+        write("static void update_metrics()")
+        write("{")
+        enter
+        write("SPMetricsKernel *kernels = sp_metrics_kernels(metrics);")
+        write("SPMetricsQueue *queues = sp_metrics_queues(metrics);")
+        write("sp_metrics_begin(metrics);")
+        write("metrics->ticks = sp_get_ticks() - start_ticks;")
+        for ((k, i) <- instances.toSeq.zipWithIndex) {
+            write(s"kernels[$i].ticks = spc_get_total(&${k.label}.clock);")
+            write(s"kernels[$i].reads = ${k.label}.clock.count;")
+            if (hasCounters(k)) {
+                write(s"sp_counters_read(&${k.label}.counters, " +
+                      s"kernels[$i].counters);")
+            }
+        }
+        for ((s, i) <- inputs.zipWithIndex) {
+            write(s"queues[$i].used = ${queueUsed(s)};")
+        }
+        write("sp_metrics_end(metrics);")
+        leave
+        write("}")
+
+        write("static void *run_metrics(void *arg)")
+        write("{")
+        enter
+        write("for(;;) {")
+        enter
+        write(s"usleep(${metrics * 1000});")
+        write("update_metrics();")
+        leave
+        write("}")
+        write("return NULL;")
+        leave
+        write("}")
+
+        write("static void stop_metrics()")
+        write("{")
+        enter
+        write("sp_metrics_remove(metrics);")
+        leave
+        write("}")
+
+    }
+
+    private def writeMetricsStart(instances: Traversable[KernelInstance],
+                                  measures: Seq[Measure],
+                                  needTimeTrial: Boolean) {
+
+        val kernels = instances.toSeq
+        val inputs = kernels.flatMap(_.getInputs)
+
+        write(s"metrics = sp_metrics_create(${kernels.size}, " +
+              s"${inputs.size}, ${measures.size});")
+        write("if(metrics == NULL) {")
+        enter
+        write("""fprintf(stderr, "ERROR: could not create metrics\n");""")
+        write("exit(-1);")
+        leave
+        write("}")
+        write("metrics->ticks_per_second = sp_timebase.ticks_per_second;")
+        write("{")
+        enter
+        write("SPMetricsKernel *kernels = sp_metrics_kernels(metrics);")
+        write("SPMetricsQueue *queues = sp_metrics_queues(metrics);")
+        write("SPMetricsTap *taps = sp_metrics_taps(metrics);")
+        for ((k, i) <- kernels.zipWithIndex) {
+            write(s"""strncpy(kernels[$i].name, \"${k.kernelType.name}(""" +
+                  s"""${k.label})\", SP_METRICS_NAME - 1);""")
+        }
+        for ((s, i) <- inputs.zipWithIndex) {
+            write(s"""strncpy(queues[$i].name, \"${s.label}\", """ +
+                  s"""SP_METRICS_NAME - 1);""")
+            write(s"queues[$i].depth = q_${s.label}->depth;")
+        }
+        for ((m, i) <- measures.zipWithIndex) {
+            write(s"""strncpy(taps[$i].name, \"${m.getName} """ +
+                  s"""(${m.stream.label})\", SP_METRICS_NAME - 1);""")
+            write(s"taps[$i].tap_id = ${m.stream.index};")
+        }
+        if (needTimeTrial) {
+            write(s"tta->SetMetrics(taps, ${measures.size});")
+        }
+        leave
+        write("}")
+        write("update_metrics();")
+        write("atexit(stop_metrics);")
+        write("{")
+        enter
+        write("pthread_t metrics_thread;")
+        write("pthread_create(&metrics_thread, NULL, run_metrics, NULL);")
+        write("pthread_detach(metrics_thread);")
+        leave
+        write("}")
+        write("""fprintf(stderr, "Metrics: spmon %d\n", getpid());""")
+
+    }
+
     private def emitGetArg {
 
         write("template<typename T>")
@@ -500,6 +1535,25 @@ private[scalapipe] class CPUResourceGenerator(
 
     }
 
+    private def emitClockMode {
+        clock match {
+            case "off"      =>
+                write("#define SP_CLOCK SP_CLOCK_OFF")
+            case "sampled"  =>
+                val period = sp.parameters.get[Int]('clockPeriod)
+                if (period <= 0 || (period & (period - 1)) != 0) {
+                    Error.raise(s"clock period must be a power of two: " +
+                                s"$period")
+                }
+                write("#define SP_CLOCK SP_CLOCK_SAMPLED")
+                write(s"#define SP_CLOCK_PERIOD $period")
+            case "full"     =>
+                write("#define SP_CLOCK SP_CLOCK_FULL")
+            case _          =>
+                Error.raise(s"invalid clock mode: $clock")
+        }
+    }
+
     override def getRules: String = ""
 
     private def emitMemorySpec(dir: File) {
@@ -523,10 +1577,30 @@ private[scalapipe] class CPUResourceGenerator(
         val cpuInstances = localInstances.filter { instance =>
             shouldEmit(instance.device)
         }
-        threadIds ++= cpuInstances.zipWithIndex
+        threadIds ++= cpuInstances.filter(_.fusedInto == null).zipWithIndex
 
         // Write include files that we need.
+        // The clock mode must be set before ScalaPipe.h is included.
+        emitClockMode
         write("#include \"ScalaPipe.h\"")
+        if (metrics > 0) {
+            write("#include \"Metrics.h\"")
+        }
+        if (sampleQueues) {
+            write("#include \"Report.h\"")
+        }
+        if (counters) {
+            if (useTasks) {
+                Error.warn("hardware counters are not used with workers")
+            }
+            write("#include \"Counters.h\"")
+        }
+        if (useTasks) {
+            write("#include \"Scheduler.h\"")
+        }
+        if (cpuInstances.exists { i => replicas(i) > 1 }) {
+            write("#include \"Parallel.h\"")
+        }
         write("#include <pthread.h>")
         write("#include <signal.h>")
         write("#include <sstream>")
@@ -546,6 +1620,12 @@ private[scalapipe] class CPUResourceGenerator(
             s.destKernel.device.host == host
         }.exists { s => !s.measures.isEmpty }
 
+        // Measures sent to TimeTrial from this host.
+        val localMeasures = localStreams.filter { s =>
+            shouldEmit(s.sourceKernel.device) &&
+            shouldEmit(s.destKernel.device)
+        }.toSeq.flatMap(_.measures)
+
         if (needTimeTrial) {
             write("#include \"TimeTrial.hh\"")
             write("static TimeTrialAgent *tta = NULL;;")
@@ -589,26 +1669,44 @@ private[scalapipe] class CPUResourceGenerator(
         // Create kernel structures.
         cpuInstances.foreach(emitKernelStruct)
 
+        write("SP_TIMEBASE_DEFINE;")
         write("static unsigned long long start_ticks;")
-        write("static struct timeval start_time;")
 
         // Write the edge globals.
         write(edgeGlobals)
 
+        // Bottleneck report and queue profile.
+        if (sampleQueues) {
+            writeReport(cpuInstances)
+        }
+
         writeShutdown(cpuInstances, edgeStats)
 
+        // Live metrics.
+        if (metrics > 0) {
+            writeMetrics(cpuInstances)
+        }
+
         // Write the kernel functions.
-        val funcs = Seq[Function[KernelInstance, Unit]](
+        // Replicas have their own port functions (see emitReplicaPorts).
+        val portFuncs = Seq[Function[KernelInstance, Unit]](
             emitKernelGetFree,
             emitKernelAllocate,
             emitKernelSend,
             emitKernelAvailable,
             emitKernelRead,
             emitKernelRelease,
-            emitThread
+            emitKernelAllocateN,
+            emitKernelSendN,
+            emitKernelReadN,
+            emitKernelReleaseN
         )
         cpuInstances.foreach { i =>
-            funcs.foreach { f => f.apply(i) }
+            if (replicas(i) == 1) {
+                portFuncs.foreach { f => f.apply(i) }
+            }
+            emitSpecialized(i)
+            emitThread(i)
         }
 
         // Create the "get_arg" function.
@@ -620,12 +1718,14 @@ private[scalapipe] class CPUResourceGenerator(
         enter
 
         // Declare threads.
-        for (t <- threadIds.values) {
-            write(s"pthread_t thread$t;")
+        if (!useTasks) {
+            for (t <- threadIds.values) {
+                write(s"pthread_t thread$t;")
+            }
         }
 
+        write("sp_timebase_init();")
         write("start_ticks = sp_get_ticks();")
-        write("gettimeofday(&start_time, NULL);")
 
         write("signal(SIGINT, shutdown);")
 
@@ -639,12 +1739,30 @@ private[scalapipe] class CPUResourceGenerator(
                 }
             val ttSize = sp.parameters.get[Int]('timeTrialBufferSize)
             val ttAffinity = sp.parameters.get[Int]('timeTrialAffinity)
-            write(s"tta = new TimeTrialAgent($ttSize, $ttAffinity, $ttFile);")
+            val ttBinary = sp.parameters.get[String]('timeTrialFormat) match {
+                case "text"     => false
+                case "binary"   => true
+                case other      =>
+                    Error.raise(s"invalid timeTrialFormat: $other")
+                    false
+            }
+            val ttOverflow = sp.parameters.get[String]('timeTrialOverflow)
+            val ttPolicy = ttOverflow match {
+                case "block"    => "TTA_OVERFLOW_BLOCK"
+                case "drop"     => "TTA_OVERFLOW_DROP"
+                case "sample"   => "TTA_OVERFLOW_SAMPLE"
+                case other      =>
+                    Error.raise(s"invalid timeTrialOverflow: $other")
+                    "TTA_OVERFLOW_BLOCK"
+            }
+            val ttPrecision = sp.parameters.get[Int]('timeTrialPrecision)
+            if (ttPrecision < 1 || ttPrecision > 4) {
+                Error.raise(s"invalid timeTrialPrecision: $ttPrecision")
+            }
+            write(s"tta = new TimeTrialAgent($ttSize, $ttAffinity, $ttFile, " +
+                  s"$ttBinary, $ttPolicy, $ttPrecision);")
 
-            val sl = localStreams.filter { s =>
-                shouldEmit(s.sourceKernel.device) &&
-                shouldEmit(s.destKernel.device)
-            }.flatMap(_.measures).foreach { measure =>
+            localMeasures.foreach { measure =>
                 val id = measure.stream.index
                 val stat = measure.getTTAStat
                 val metric = measure.getTTAMetric
@@ -661,14 +1779,32 @@ private[scalapipe] class CPUResourceGenerator(
         // Call the kernel init functions.
         cpuInstances.foreach(emitKernelInit)
 
+        // Start sampling for the bottleneck report and queue profile.
+        if (sampleQueues) {
+            writeReportStart(cpuInstances)
+        }
+
+        // Start publishing live metrics.
+        if (metrics > 0) {
+            val measures = if (needTimeTrial) localMeasures else Seq()
+            writeMetricsStart(cpuInstances, measures, needTimeTrial)
+        }
+
         write("atexit(showStats);")
 
         // Start the threads.
-        for (t <- threadIds.values) {
-            write(s"pthread_create(&thread$t, NULL, run_thread$t, NULL);")
-        }
-        for (t <- threadIds.values) {
-            write(s"pthread_join(thread$t, NULL);")
+        if (useTasks) {
+            for ((k, t) <- threadIds) {
+                write(s"spt_create(&${k.label}.task, run_thread$t);")
+            }
+            write(s"spt_run($workers);")
+        } else {
+            for (t <- threadIds.values) {
+                write(s"pthread_create(&thread$t, NULL, run_thread$t, NULL);")
+            }
+            for (t <- threadIds.values) {
+                write(s"pthread_join(thread$t, NULL);")
+            }
         }
 
         // Destroy the edges.
@@ -18,13 +18,20 @@ trait CTrace extends CNodeEmitter with ASTUtils {
         return s"((unsigned)($location - $base) + $baseOffset)"
     }
 
+    private def heldRelease(node: ASTNode): Seq[String] = node match {
+        case pn: ASTPortNode if pn.op == NodeType.RELEASE   => Seq(pn.symbol)
+        case _                                              => Seq()
+    }
+
     override def emit(node: ASTNode) {
 
         if (kt.parameters.get[Boolean]('trace)) {
 
             // Trace inputs.
+            // Held ports are traced when they are released.
             val inputOffset = 0
-            for (i <- localInputs(node)) {
+            for (i <- heldRelease(node).filter(kt.isInput) ++
+                      localInputs(node).filterNot(kt.isHeld)) {
                 val offset = kt.inputIndex(i) + inputOffset
                 val size = kt.inputType(i).bytes.toHexString
                 write(s"""fprintf(kernel->trace_fd, "C%x:$size\\n", """ +
@@ -49,7 +56,8 @@ trait CTrace extends CNodeEmitter with ASTUtils {
 
             // Trace outputs.
             val outputOffset = kt.inputs.size
-            for (o <- localOutputs(node)) {
+            for (o <- heldRelease(node).filter(kt.isOutput) ++
+                      localOutputs(node).filterNot(kt.isHeld)) {
                 val offset = kt.outputIndex(o) + outputOffset
                 val size = kt.outputType(o).bytes.toHexString
                 write(s"""fprintf(kernel->trace_fd, "P%x:$size\\n", """ +
@@ -50,6 +50,11 @@ private[scalapipe] abstract class EdgeGenerator(
         kernels.filter(_.device == device)
     }
 
+    /** Determine if this generator emits the batched port functions
+     * (allocate_n, send_n, read_n, and release_n) for its streams.
+     */
+    def batched: Boolean = false
+
     /** Emit common code. */
     def emitCommon() {
     }
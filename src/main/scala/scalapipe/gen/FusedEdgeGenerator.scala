@@ -0,0 +1,140 @@
+package scalapipe.gen
+
+import scalapipe._
+
+/** Edge generator for edges between fused kernels.
+ * The producer does not have a thread of its own.  Instead, the
+ * consumer runs the producer one step at a time whenever it finds
+ * the queue empty.
+ * @param specialize Set if the producer uses specialized kernel code.
+ */
+private[scalapipe] class FusedEdgeGenerator(val specialize: Boolean = false)
+    extends EdgeGenerator(Platforms.C) with CGenerator {
+
+    private def queueName(stream: Stream) = s"q_${stream.label}"
+
+    /** Get an expression for the number of items in a stream's queue. */
+    def queueUsed(stream: Stream): String =
+        s"splq_get_used(${queueName(stream)})"
+
+    override def emitGlobals(streams: Traversable[Stream]) {
+        streams.foreach { s => writeGlobals(s) }
+    }
+
+    override def emitInit(streams: Traversable[Stream]) {
+        streams.foreach { s => writeInit(s) }
+    }
+
+    override def emitDestroy(streams: Traversable[Stream]) {
+        streams.foreach { s => writeDestroy(s) }
+    }
+
+    private def writeInit(stream: Stream) {
+        val qname = queueName(stream)
+        val depth = stream.parameters.get[Int]('queueDepth)
+        val vtype = stream.valueType
+        write(s"$qname = splq_create($depth, sizeof($vtype));")
+    }
+
+    private def writeGlobals(stream: Stream) {
+
+        val qname = queueName(stream)
+        val label = stream.label
+        val destLabel = stream.destKernel.label
+        val sourceLabel = stream.sourceKernel.label
+        val sourceName = stream.sourceKernel.name
+        val sourceType = s"struct sp_${sourceName}_data"
+        val step = if (specialize) {
+                s"sp_$sourceLabel::sp_${sourceName}_step"
+            } else {
+                s"sp_${sourceName}_step"
+            }
+
+        // Define the queue data structure.
+        write(s"static SPLQ *$qname;")
+        write(s"static bool ${label}_done = false;")
+
+        // Shutdown for the producer (emitted with the kernel).
+        write(s"static void ${sourceLabel}_exit();")
+
+        // The specialized step function is emitted with the kernel.
+        if (specialize) {
+            write(s"namespace sp_$sourceLabel {")
+            write(s"int sp_${sourceName}_step($sourceType *kernel);")
+            write(s"}")
+        }
+
+        // "step"
+        // Run one iteration of the producer.
+        write(s"static void ${label}_step()")
+        enter
+        write(s"spc_start(&$sourceLabel.clock);")
+        writeIf(s"setjmp($sourceLabel.env) == 0")
+        writeIf(s"$step(&$sourceLabel.priv)")
+        write(s"spc_stop(&$sourceLabel.clock);")
+        writeReturn()
+        writeEnd
+        writeEnd
+        write(s"${sourceLabel}_exit();")
+        leave
+
+        // "get_free"
+        write(s"static int ${label}_get_free()")
+        enter
+        writeReturn(s"splq_get_free($qname)")
+        leave
+
+        // "allocate"
+        write(s"static void *${label}_allocate()")
+        enter
+        writeReturn(s"splq_start_write($qname)")
+        leave
+
+        // "send"
+        write(s"static void ${label}_send()")
+        enter
+        write(s"splq_finish_write($qname);")
+        leave
+
+        // "get_available"
+        // The producer is stepped so that polling consumers make progress.
+        write(s"static int ${label}_get_available()")
+        enter
+        writeIf(s"splq_get_used($qname) == 0 && !${label}_done")
+        write(s"${label}_step();")
+        writeEnd
+        writeReturn(s"splq_get_used($qname)")
+        leave
+
+        // "read_value"
+        write(s"static void *${label}_read_value()")
+        enter
+        write(s"char *buffer = splq_start_read($qname);")
+        writeWhile(s"SPUNLIKELY(buffer == NULL) && !${label}_done")
+        write(s"${label}_step();")
+        write(s"buffer = splq_start_read($qname);")
+        writeEnd
+        writeReturn(s"buffer")
+        leave
+
+        // "release"
+        write(s"static void ${label}_release()")
+        enter
+        write(s"splq_finish_read($qname);")
+        leave
+
+        // "finish"
+        write(s"static void ${label}_finish()")
+        enter
+        write(s"${label}_done = true;")
+        write(s"sp_decrement(&${destLabel}.active_inputs);")
+        leave
+
+    }
+
+    private def writeDestroy(stream: Stream) {
+        val qname = queueName(stream)
+        write(s"splq_destroy($qname);")
+    }
+
+}
@@ -495,6 +495,9 @@ private[scalapipe] case class IRNodeEmitter(
             case stop:  ASTStopNode     => emitStop(stop)
             case ret:    ASTReturnNode  => emitReturn(ret)
             case block: ASTBlockNode    => emitBlock(block)
+            case port:  ASTPortNode     =>
+                Error.raise("acquire and release are only valid in C kernels",
+                            node)
             case null                        => ()
             case _                            =>
                 Error.raise("invalid start statement", node)
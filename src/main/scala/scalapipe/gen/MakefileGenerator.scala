@@ -108,12 +108,23 @@ clean:
         write("FPGA_BLOCKS=" + localHDL.mkString(" "))
         write("TTOBJ=" + (if (needTimeTrial) "TimeTrial.o" else ""))
 
+        // Determine which tools to build.
+        val needMetrics = sp.parameters.get[Int]('metrics) > 0
+        val tools = (if (needTimeTrial) Seq("ttdecode") else Seq()) ++
+                    (if (needMetrics) Seq("spmon") else Seq())
+        write("TOOLS=" + tools.mkString(" "))
+
         val ipaths_str = ipaths.foldLeft("") { (a, p) => a + " -I" + p }
         write("EXTRA_CFLAGS=" + ipaths_str)
         write("EXTRA_CXXFLAGS=" + ipaths_str)
 
         val lpaths_str = lpaths.foldLeft("") { (a, p) => a + " -L" + p }
-        val libs_str = libraries.foldLeft("") { (a, l) => a + " -l" + l }
+        val needShm = sp.streams.exists { s =>
+            s.sourceKernel.device.host != s.destKernel.device.host &&
+            sp.usesSharedMemory(s)
+        }
+        val libs_str = libraries.foldLeft("") { (a, l) => a + " -l" + l } +
+                       (if (needMetrics || needShm) " -lrt" else "")
         write("EXTRA_LDFLAGS=" + lpaths_str + libs_str)
 
         write("""
@@ -186,7 +197,7 @@ clean_blocks:
 
 # Rule for compiling everything.
 compile: blocks
-	$(MAKE) $(TARGETS)
+	$(MAKE) $(TARGETS) $(TOOLS)
 
 # Rule for compiling C++ code.
 %.o: %.cpp
@@ -200,6 +211,14 @@ compile: blocks
 proc_%: proc_%.o $(OBJECTS)
 	$(CXX) $(CXXFLAGS) -o $@ $@.o $(OBJECTS) $(LDFLAGS)
 
+# Rule for the TimeTrial trace decoder.
+ttdecode: ttdecode.cpp TraceOutput.hh
+	$(CXX) $(CXXFLAGS) -o $@ $<
+
+# Rule for the live metrics monitor.
+spmon: spmon.c Metrics.h
+	$(CC) $(CFLAGS) -o $@ $< $(LDFLAGS)
+
 """)
 
         writeLeft(sp.getRules)
@@ -207,7 +226,7 @@ proc_%: proc_%.o $(OBJECTS)
         write("""
 # Rule for cleaning up.
 clean: clean_blocks
-	rm -f $(TARGETS) proc_*.o $(VHDL_FILE_LIST) $(V_FILE_LIST) $(C_FILE_LIST) $(CXX_FILE_LIST) dump.vcd
+	rm -f $(TARGETS) $(TOOLS) proc_*.o $(VHDL_FILE_LIST) $(V_FILE_LIST) $(C_FILE_LIST) $(CXX_FILE_LIST) dump.vcd
 
 # Rule for cleaning up everything.
 distclean: clean
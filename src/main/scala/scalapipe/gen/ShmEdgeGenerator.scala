@@ -0,0 +1,176 @@
+package scalapipe.gen
+
+import scalapipe._
+
+/** Edge generator for edges between processes on the same machine.
+ * The queue lives in a shared memory segment named after the port
+ * assigned to the edge, so kernels on both sides use it directly.
+ * Waiters spin since the kernels on the other side cannot signal them.
+ */
+private[scalapipe] class ShmEdgeGenerator(
+        val sp: ScalaPipe,
+        val host: String
+    ) extends EdgeGenerator(Platforms.C) with CGenerator {
+
+    private def isProducer(s: Stream): Boolean = {
+        s.sourceKernel.device.host == host
+    }
+
+    private def queueName(stream: Stream) = s"q_${stream.label}"
+
+    private def edgeName(stream: Stream) = s"shm${stream.label}"
+
+    override def batched: Boolean = true
+
+    /** Get an expression for the number of items in a stream's queue. */
+    def queueUsed(stream: Stream): String =
+        s"spaq_get_used(${queueName(stream)})"
+
+    override def emitCommon() {
+        write("#include \"Shm.h\"")
+    }
+
+    override def emitGlobals(streams: Traversable[Stream]) {
+        streams.foreach { s =>
+            write(s"static SPShmEdge *${edgeName(s)} = NULL;")
+            write(s"static SPAQ *${queueName(s)} = NULL;")
+            if (isProducer(s)) {
+                writeProducerGlobals(s)
+            } else {
+                writeConsumerGlobals(s)
+            }
+        }
+    }
+
+    override def emitInit(streams: Traversable[Stream]) {
+        streams.foreach { s =>
+            val port = sp.getPort(s)
+            if (isProducer(s)) {
+                write(s"${edgeName(s)} = sp_shm_attach($port);")
+            } else {
+                val depth = s.parameters.get[Int]('queueDepth)
+                write(s"${edgeName(s)} = sp_shm_create($port, $depth, " +
+                      s"sizeof(${s.valueType}));")
+            }
+            write(s"${queueName(s)} = sp_shm_queue(${edgeName(s)});")
+        }
+    }
+
+    override def emitDestroy(streams: Traversable[Stream]) {
+        streams.foreach { s =>
+            writeIf(edgeName(s))
+            write(s"sp_shm_close(${edgeName(s)}, ${sp.getPort(s)});")
+            writeEnd
+        }
+    }
+
+    private def writeProducerGlobals(stream: Stream) {
+
+        val qname = queueName(stream)
+        val label = stream.label
+
+        // "get_free"
+        write(s"static int ${label}_get_free()")
+        enter
+        writeReturn(s"spaq_get_free($qname)")
+        leave
+
+        // "allocate"
+        write(s"static void *${label}_allocate()")
+        enter
+        writeReturn(s"spaq_start_write($qname, 1)")
+        leave
+
+        // "send"
+        write(s"static void ${label}_send()")
+        enter
+        write(s"spaq_finish_write($qname, 1);")
+        leave
+
+        // "allocate_n"
+        write(s"static void *${label}_allocate_n(int *count)")
+        enter
+        write(s"uint32_t n = *count;")
+        write(s"char *ptr = spaq_start_write_n($qname, &n);")
+        writeIf(s"ptr != NULL")
+        write(s"*count = n;")
+        writeEnd
+        writeReturn(s"ptr")
+        leave
+
+        // "send_n"
+        write(s"static void ${label}_send_n(int count)")
+        enter
+        write(s"spaq_finish_write($qname, count);")
+        leave
+
+        // "finish"
+        write(s"static void ${label}_finish()")
+        enter
+        write(s"sp_shm_finish(${edgeName(stream)});")
+        leave
+
+    }
+
+    private def writeConsumerGlobals(stream: Stream) {
+
+        val qname = queueName(stream)
+        val label = stream.label
+        val edge = edgeName(stream)
+        val destLabel = stream.destKernel.label
+
+        // "get_available"
+        write(s"static int ${label}_get_available()")
+        enter
+        write(s"const int used = spaq_get_used($qname);")
+        writeIf(s"SPUNLIKELY(used == 0 && sp_shm_ended($edge))")
+        write(s"sp_decrement(&$destLabel.active_inputs);")
+        writeEnd
+        writeReturn(s"used")
+        leave
+
+        // "read_value"
+        write(s"static void *${label}_read_value()")
+        enter
+        write(s"char *buffer;")
+        writeIf(s"spaq_start_read($qname, &buffer) > 0")
+        writeReturn(s"buffer")
+        writeEnd
+        writeIf(s"SPUNLIKELY(sp_shm_ended($edge))")
+        write(s"sp_decrement(&$destLabel.active_inputs);")
+        writeEnd
+        writeReturn(s"NULL")
+        leave
+
+        // "release"
+        write(s"static void ${label}_release()")
+        enter
+        write(s"spaq_finish_read($qname, 1);")
+        leave
+
+        // "read_n"
+        write(s"static void *${label}_read_n(int *count)")
+        enter
+        write(s"char *buffer;")
+        write(s"const int available = spaq_start_read($qname, &buffer);")
+        writeIf(s"available > 0")
+        writeIf(s"*count > available")
+        write(s"*count = available;")
+        writeEnd
+        writeReturn(s"buffer")
+        writeEnd
+        writeIf(s"SPUNLIKELY(sp_shm_ended($edge))")
+        write(s"sp_decrement(&$destLabel.active_inputs);")
+        writeEnd
+        writeReturn(s"NULL")
+        leave
+
+        // "release_n"
+        write(s"static void ${label}_release_n(int count)")
+        enter
+        write(s"spaq_finish_read($qname, count);")
+        leave
+
+    }
+
+}
@@ -2,15 +2,29 @@ package scalapipe.gen
 
 import scalapipe._
 
+/** Edge generator for edges between CPUs on different hosts.
+ * Incoming streams are read by one receive engine thread per process.
+ * If tasks is set, the engine does not signal the consumer kernels.
+ */
 private[scalapipe] class SockEdgeGenerator(
         val sp: ScalaPipe,
-        val host: String
+        val host: String,
+        val tasks: Boolean = false
     ) extends EdgeGenerator(Platforms.C) with CGenerator {
 
     private def isProducer(s: Stream): Boolean = {
         s.sourceKernel.device.host == host
     }
 
+    /** Determine if the consumer of a stream can block on it.
+     * Only the receiving side signals its kernel.
+     */
+    def canBlock(stream: Stream): Boolean = !tasks && !isProducer(stream)
+
+    /** Get an expression for the number of items in a stream's queue. */
+    def queueUsed(stream: Stream): String =
+        s"spaq_get_used(q_${stream.label})"
+
     override def emitCommon() {
         write("#include <sys/types.h>")
         write("#include <sys/socket.h>")
@@ -23,9 +37,13 @@ private[scalapipe] class SockEdgeGenerator(
         write("#include <errno.h>")
         write("#include <unistd.h>")
         write("#include <poll.h>")
+        write("#include \"Socket.h\"")
     }
 
     override def emitGlobals(streams: Traversable[Stream]) {
+        if (streams.exists(!isProducer(_))) {
+            write(s"static SPSockEngine sock_engine;")
+        }
         streams.foreach { s =>
             if (isProducer(s)) {
                 writeProducerGlobals(s)
@@ -36,6 +54,9 @@ private[scalapipe] class SockEdgeGenerator(
     }
 
     override def emitInit(streams: Traversable[Stream]) {
+        if (streams.exists(!isProducer(_))) {
+            write(s"sp_sock_engine_start(&sock_engine);")
+        }
         streams.foreach { s =>
             if (isProducer(s)) {
                 writeInitProducer(s)
@@ -46,6 +67,9 @@ private[scalapipe] class SockEdgeGenerator(
     }
 
     override def emitDestroy(streams: Traversable[Stream]) {
+        if (streams.exists(!isProducer(_))) {
+            write(s"sp_sock_engine_stop(&sock_engine);")
+        }
         streams.foreach { s =>
             if (isProducer(s)) {
                 writeDestroyProducer(s)
@@ -58,12 +82,13 @@ private[scalapipe] class SockEdgeGenerator(
     private def writeProducerGlobals(stream: Stream) {
 
         val sock = s"sock${stream.label}"
-        val bufname = s"buffer${stream.label}"
-        val vtype = stream.valueType
+        val sender = s"sender${stream.label}"
+        val qname = s"$sender.q"
 
         // Globals.
+        // Items are written to a local ring that the sender thread sends.
         write(s"static int $sock = 0;")
-        write(s"static char *$bufname = NULL;")
+        write(s"static SPSockSender $sender;")
         write(s"static struct")
         enter
         write(s"volatile uint32_t active_inputs;")
@@ -71,161 +96,69 @@ private[scalapipe] class SockEdgeGenerator(
         write(s"${stream.destKernel.label};")
 
         // "get_free"
-        write(s"static bool ${stream.label}_get_free()")
+        write(s"static int ${stream.label}_get_free()")
         enter
-        write(s"static int size = 0;")
-        writeIf(s"SPUNLIKELY(size == 0)")
-        write(s"socklen_t olen = sizeof(size);")
-        write(s"getsockopt($sock, SOL_SOCKET, SO_SNDBUF, &size, &olen);")
-        writeEnd
-        write(s"int usage = 0;")
-        write(s"ioctl($sock, TIOCOUTQ, &usage);")
-        writeReturn(s"(size - usage) / sizeof($vtype)")
+        writeReturn(s"spaq_get_free($qname)")
         leave
 
         // "allocate"
         write(s"static void *${stream.label}_allocate()")
         enter
-        write(s"static size_t size = 0;")
-        write(s"const size_t temp = sizeof($vtype);")
-        writeIf(s"SPUNLIKELY(temp > size)")
-        write(s"size = temp;")
-        write(s"$bufname = (char*)realloc($bufname, size);")
-        writeEnd
-        writeReturn(bufname)
+        writeReturn(s"spaq_start_write($qname, 1)")
         leave
 
         // "send"
         write(s"static void ${stream.label}_send()")
         enter
-        write(s"const size_t size = sizeof($vtype);")
-        write(s"const int c = send($sock, $bufname, size, 0);")
-        writeIf(s"SPUNLIKELY(c < 0)")
-        write("perror(\"send failed\");")
-        write("exit(-1);")
-        writeEnd
+        write(s"spaq_finish_write($qname, 1);")
         leave
 
         // "finish"
         write(s"static void ${stream.label}_finish()")
         enter
-        writeReturn()
-        leave
-
-    }
-
-    private def writeProcess(stream: Stream) {
-
-        val sock = s"sock${stream.label}"
-        val lsock = s"server${stream.label}"
-        val qname = s"q_${stream.label}"
-        val vtype = stream.valueType
-        val destLabel = stream.destKernel.label
-
-        write(s"static void ${stream.label}_process()")
-        enter
-        write(s"static ssize_t leftovers = 0;")
-        write(s"static char *ptr = NULL;")
-
-        // Check if this socket has already been closed.
-        writeIf(s"SPUNLIKELY($sock < 0)")
-        writeReturn()
-        writeEnd
-
-        // Attempt to connect if the connection has yet to be established.
-        write(s"while(SPUNLIKELY($sock == 0))")
-        enter
-        write(s"struct sockaddr_in caddr;")
-        write(s"socklen_t caddrlen = sizeof(caddr);")
-        write(s"$sock = accept($lsock, (struct sockaddr*)&caddr, &caddrlen);")
-        writeIf(s"$sock < 0")
-        write("perror(\"accept\");")
-        write("exit(-1);")
-        writeEnd
-        leave
-
-        // Check for activity.
-        write(s"struct pollfd fds;")
-        write(s"fds.fd = $sock;")
-        write(s"fds.events = POLLIN;")
-        writeIf(s"poll(&fds, 1, 0) == 0")
-        writeReturn()
-        writeEnd
-
-        // Check for available data.
-        writeIf(s"SPLIKELY(fds.revents & POLLIN)")
-        write(s"size_t max_size;")
-        writeIf(s"leftovers > 0")
-        write(s"max_size = sizeof($vtype) - leftovers;")
-        writeElse
-        write(s"const size_t max_count = ${qname}->depth >> 3;")
-        write(s"max_size = sizeof($vtype) * max_count;")
-        write(s"ptr = (char*)spq_start_write($qname, max_count);")
-        writeEnd
-        writeIf(s"ptr != NULL")
-        write(s"ssize_t rc = recv($sock, ptr, max_size, 0);")
-        writeIf(s"SPUNLIKELY(rc == 0)")
-        write(s"sp_decrement(&$destLabel.active_inputs);")
-        write(s"close($sock);")
-        write(s"$sock = -1;")
-        writeElseIf(s"SPUNLIKELY(rc < 0)")
-        write("perror(\"recv\");")
-        write("exit(-1);")
-        writeEnd
-        write(s"const size_t total = rc + leftovers;")
-        write(s"const size_t count = total / sizeof($vtype);")
-        write(s"leftovers = total % sizeof($vtype);")
-        write(s"ptr += rc;")
-        write(s"spq_finish_write($qname, count);")
-        writeEnd
-        writeReturn()
-        writeEnd    // Data available.
-
-        // Error if we got here.
-        write("perror(\"poll\");")
-        write("exit(-1);")
-
+        write(s"sp_sock_sender_finish(&$sender);")
         leave
 
     }
 
     private def writeConsumerGlobals(stream: Stream) {
 
-        val sock = s"sock${stream.label}"
-        val lsock = s"server${stream.label}"
         val qname = s"q_${stream.label}"
+        val rstream = s"stream${stream.label}"
+        val destLabel = stream.destKernel.label
 
         // Globals.
-        write(s"static int $sock = 0;")
-        write(s"static int $lsock = 0;")
-        write(s"static SPQ *$qname = NULL;")
-
-        // Read from the socket.
-        writeProcess(stream)
+        // The receive engine fills the queue, so the kernel never polls.
+        write(s"static SPSockStream $rstream;")
+        write(s"static SPAQ *$qname = NULL;")
 
         // "get_available"
         write(s"static int ${stream.label}_get_available()")
         enter
-        write(s"${stream.label}_process();")
-        writeReturn(s"spq_get_used($qname);")
+        write(s"const int used = spaq_get_used($qname);")
+        writeIf(s"SPUNLIKELY(used == 0 && sp_sock_ended(&$rstream))")
+        write(s"sp_decrement(&$destLabel.active_inputs);")
+        writeEnd
+        writeReturn(s"used")
         leave
 
         // "read_value"
         write(s"static void *${stream.label}_read_value()")
         enter
         write(s"char *buffer;")
-        write(s"${stream.label}_process();")
-        writeIf(s"spq_start_read($qname, &buffer) > 0")
+        writeIf(s"spaq_start_read($qname, &buffer) > 0")
         writeReturn(s"buffer")
-        writeElse
-        writeReturn(s"NULL")
         writeEnd
+        writeIf(s"SPUNLIKELY(sp_sock_ended(&$rstream))")
+        write(s"sp_decrement(&$destLabel.active_inputs);")
+        writeEnd
+        writeReturn(s"NULL")
         leave
 
         // "release"
         write(s"static void ${stream.label}_release()")
         enter
-        write(s"spq_finish_read($qname, 1);")
+        write(s"sp_sock_release(&$rstream, 1);")
         leave
 
     }
@@ -233,8 +166,13 @@ private[scalapipe] class SockEdgeGenerator(
     private def writeInitProducer(stream: Stream) {
 
         val sock = s"sock${stream.label}"
+        val sender = s"sender${stream.label}"
         val remoteHost = stream.destKernel.device.host
         val port = sp.getPort(stream)
+        val depth = stream.parameters.get[Int]('queueDepth)
+        val vtype = stream.valueType
+        val batch = sp.parameters.get[Int]('sockBatch)
+        val latency = sp.parameters.get[Int]('sockLatency)
 
         // Create the client socket and connect to the server.
         enter
@@ -270,26 +208,37 @@ private[scalapipe] class SockEdgeGenerator(
         write("break;")
         writeEnd
         leave
+
+        // Batches are sent whole, so Nagle's algorithm only adds latency.
+        write(s"int nodelay = 1;")
+        write(s"setsockopt($sock, IPPROTO_TCP, TCP_NODELAY, " +
+              s"&nodelay, sizeof(nodelay));")
+
+        // Start the sender.
+        write(s"sp_sock_sender_start(&$sender, $sock, $depth, " +
+              s"sizeof($vtype), $batch, $latency);")
         leave
 
     }
 
     private def writeInitConsumer(stream: Stream) {
 
-        val lsock = s"server${stream.label}"
         val qname = s"q_${stream.label}"
+        val rstream = s"stream${stream.label}"
         val depth = stream.parameters.get[Int]('queueDepth)
         val vtype = stream.valueType
         val port = sp.getPort(stream)
-
-        // Initialize the queue.
-        write(s"$qname = (SPQ*)malloc(spq_get_size($depth, sizeof($vtype)));")
-        write(s"spq_init($qname, $depth, sizeof($vtype));")
+        val blocking = stream.parameters.get[String]('wait) == "block"
+        val wait = if (canBlock(stream) && blocking) {
+                s"&${stream.destKernel.label}.input_wait"
+            } else {
+                "NULL"
+            }
 
         // Create the server socket.
         enter
-        write(s"$lsock = socket(PF_INET, SOCK_STREAM, 0);")
-        writeIf(s"$lsock < 0")
+        write(s"int lsock = socket(PF_INET, SOCK_STREAM, 0);")
+        writeIf(s"lsock < 0")
         write("perror(\"socket\");")
         write("exit(-1);")
         writeEnd
@@ -297,41 +246,35 @@ private[scalapipe] class SockEdgeGenerator(
         write(s"memset(&addr, 0, sizeof(addr));")
         write(s"addr.sin_family = PF_INET;")
         write(s"addr.sin_port = $port;")
-        write(s"int rc = bind($lsock, (struct sockaddr*)&addr, sizeof(addr));")
+        write(s"int rc = bind(lsock, (struct sockaddr*)&addr, sizeof(addr));")
         writeIf(s"rc")
         write("perror(\"bind\");")
         write("exit(-1);")
         writeEnd
-        write(s"rc = listen($lsock, 1);")
+        write(s"rc = listen(lsock, 1);")
         writeIf(s"rc")
         write("perror(\"listen\");")
         write("exit(-1);")
         writeEnd
+
+        // Hand the stream to the receive engine.
+        write(s"sp_sock_engine_add(&sock_engine, &$rstream, lsock, $depth, " +
+              s"sizeof($vtype), $wait);")
+        write(s"$qname = $rstream.q;")
         leave
 
     }
 
     private def writeDestroyProducer(stream: Stream) {
         val sock = s"sock${stream.label}"
+        val sender = s"sender${stream.label}"
         writeIf(s"$sock")
-        write(s"close($sock);")
+        write(s"sp_sock_sender_join(&$sender);")
         writeEnd
     }
 
     private def writeDestroyConsumer(stream: Stream) {
-
-        val qname = s"q_${stream.label}"
-        val sock = s"sock${stream.label}"
-        val lsock = s"server${stream.label}"
-
-        writeIf(s"$sock")
-        write(s"close($sock);")
-        writeEnd
-        writeIf(s"$lsock")
-        write(s"close($lsock);")
-        writeEnd
-        write(s"free($qname);")
-
+        write(s"sp_sock_stream_close(&stream${stream.label});")
     }
 
 }
@@ -0,0 +1,33 @@
+package scalapipe.kernels
+
+import scalapipe.dsl._
+
+/** Stream records of type t to a file.
+ * Records are collected in blocks of 'blockSize bytes that are written
+ * behind the kernel with up to 'readahead blocks in flight.  The file is
+ * flushed and closed when the process exits.
+ */
+class FileSink(t: Type) extends Kernel {
+
+    val x0 = input(t)
+    val file_name = config(STRING, 'file, "out.dat")
+    val block_size = config(UNSIGNED32, 'blockSize, 1 << 20)
+    val readahead = config(UNSIGNED32, 'readahead, 4)
+
+    val file = local(fileio.SPFILEPTR, 0)
+
+    if (file == 0) {
+        file = fileio.sp_file_open(file_name, fileio.SP_FILE_WRITE,
+                                   block_size, readahead)
+        if (file == 0) {
+            stdio.printf("ERROR: could not open %s\n", file_name)
+            stdio.exit(-1)
+        }
+    }
+
+    // Write straight from the queue.
+    acquire(x0)
+    fileio.sp_file_write(file, addr(x0), sizeof(x0))
+    release(x0)
+
+}
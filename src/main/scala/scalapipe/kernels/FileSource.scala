@@ -0,0 +1,37 @@
+package scalapipe.kernels
+
+import scalapipe.dsl._
+
+/** Stream records of type t from a file.
+ * The file is read in blocks of 'blockSize bytes with 'readahead blocks
+ * in flight, so the kernel only waits when the disk falls behind.
+ */
+class FileSource(t: Type) extends Kernel {
+
+    val y0 = output(t)
+    val file_name = config(STRING, 'file, "in.dat")
+    val block_size = config(UNSIGNED32, 'blockSize, 1 << 20)
+    val readahead = config(UNSIGNED32, 'readahead, 4)
+
+    val file = local(fileio.SPFILEPTR, 0)
+
+    if (file == 0) {
+        file = fileio.sp_file_open(file_name, fileio.SP_FILE_READ,
+                                   block_size, readahead)
+        if (file == 0) {
+            stdio.printf("ERROR: could not open %s\n", file_name)
+            stdio.exit(-1)
+        }
+    }
+
+    // Read straight into the queue.  The item is only sent if the
+    // read succeeds.
+    acquire(y0)
+    if (fileio.sp_file_read(file, addr(y0), sizeof(y0))) {
+        release(y0)
+    } else {
+        fileio.sp_file_close(file)
+        stop
+    }
+
+}
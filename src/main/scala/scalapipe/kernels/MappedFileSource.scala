@@ -0,0 +1,37 @@
+package scalapipe.kernels
+
+import scalapipe.dsl._
+
+/** Stream records of type t from a memory-mapped file.
+ * Records are sent by pointer into the mapping rather than copied, so
+ * the output may feed a kernel with an input of type t directly.
+ * Set 'hugePages to ask for transparent huge pages.
+ */
+class MappedFileSource(t: Type) extends Kernel {
+
+    val ptrType = Pointer(t)
+
+    val y0 = output(ptrType)
+    val file_name = config(STRING, 'file, "in.dat")
+    val huge_pages = config(SIGNED32, 'hugePages, 0)
+
+    val map = local(fileio.SPMAPPTR, 0)
+    val ptr = local(ptrType, 0)
+    val value = local(t)
+
+    if (map == 0) {
+        map = fileio.sp_map_open(file_name, huge_pages)
+        if (map == 0) {
+            stdio.printf("ERROR: could not map %s\n", file_name)
+            stdio.exit(-1)
+        }
+    }
+
+    ptr = fileio.sp_map_next(map, sizeof(value))
+    if (ptr == 0) {
+        stop
+    } else {
+        y0 = ptr
+    }
+
+}
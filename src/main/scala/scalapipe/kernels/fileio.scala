@@ -0,0 +1,45 @@
+package scalapipe.kernels
+
+import scalapipe.dsl._
+
+/** Streaming file I/O (see FileIO.h). */
+object fileio {
+
+    class fileioFunc(_name: String) extends Func(_name) {
+        include("FileIO.h")
+        external("C")
+    }
+
+    val SPFILE = new NativeType("SPFile")
+    val SPFILEPTR = new Pointer(SPFILE)
+    val SPMAP = new NativeType("SPMap")
+    val SPMAPPTR = new Pointer(SPMAP)
+
+    val SP_FILE_READ = 0
+    val SP_FILE_WRITE = 1
+
+    val sp_file_open = new fileioFunc("sp_file_open") {
+        returns(SPFILEPTR)
+    }
+
+    val sp_file_read = new fileioFunc("sp_file_read") {
+        returns(SIGNED32)
+    }
+
+    val sp_file_write = new fileioFunc("sp_file_write") {
+        returns(VOID)
+    }
+
+    val sp_file_close = new fileioFunc("sp_file_close") {
+        returns(VOID)
+    }
+
+    val sp_map_open = new fileioFunc("sp_map_open") {
+        returns(SPMAPPTR)
+    }
+
+    val sp_map_next = new fileioFunc("sp_map_next") {
+        returns(stdio.VOIDPTR)
+    }
+
+}
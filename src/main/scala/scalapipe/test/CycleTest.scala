@@ -42,6 +42,7 @@ object CycleTest {
 
     def main(args: Array[String]) {
         val mapping = args.headOption.getOrElse("0").toInt
+        val options = args.drop(1).headOption.getOrElse("none")
         val app = new Application {
             val cycle = Cycle()
             val result = Looper(Start(), cycle)
@@ -51,6 +52,12 @@ object CycleTest {
                 case 0 => ()
                 case 1 => map(ANY_KERNEL -> Print, FPGA2CPU())
             }
+            options match {
+                case "none" => ()
+                case "workers" =>
+                    // Fewer workers than kernels.
+                    param('workers, 2)
+            }
         }
         app.emit("CycleTest")
     }
@@ -0,0 +1,39 @@
+package scalapipe.test
+
+import scalapipe.kernels._
+import scalapipe.dsl._
+
+object FileTest extends App {
+
+    val Gen = new Kernel("Gen") {
+        val y0 = output(UNSIGNED32)
+        val count = local(UNSIGNED32, 0)
+        if (count < 10) {
+            y0 = count * 3 + 1
+            count += 1
+        } else {
+            stop
+        }
+    }
+
+    val Sink = new FileSink(UNSIGNED32)
+
+    val Source = new FileSource(UNSIGNED32)
+
+    val Print = new Kernel("Print") {
+        val x0 = input(UNSIGNED32)
+        stdio.printf("OUTPUT %d\n", x0)
+    }
+
+    // Use small blocks so the file spans several, the last partial.
+    val app = args(0) match {
+        case "write" => new Application {
+            Sink(Gen(), 'file -> "data.bin", 'blockSize -> 12)
+        }
+        case _ => new Application {
+            Print(Source('file -> "data.bin", 'blockSize -> 12))
+        }
+    }
+    app.emit("FileTest")
+
+}
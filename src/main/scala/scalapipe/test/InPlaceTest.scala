@@ -0,0 +1,51 @@
+package scalapipe.test
+
+import scalapipe.kernels._
+import scalapipe.dsl._
+
+object InPlaceTest {
+
+    val ArrayType = Vector(UNSIGNED32, 8)
+
+    val Gen = new Kernel("Gen") {
+        val y0      = output(ArrayType)
+        val count   = local(UNSIGNED32, 0)
+
+        acquire(y0)
+        for (i <- 0 until 8) {
+            y0(i) = count * 8 + i
+        }
+        release(y0)
+        count += 1
+        if (count == 10) {
+            stop
+        }
+
+    }
+
+    val Print = new Kernel("Print") {
+        val x0      = input(ArrayType)
+        val count   = local(UNSIGNED32, 0)
+
+        acquire(x0)
+        stdio.printf("OUTPUT %d: ", count)
+        for (i <- 0 until 8) {
+            stdio.printf("%d ", x0(i))
+        }
+        stdio.printf("\n")
+        release(x0)
+        count += 1
+        if (count == 10) {
+            stdio.exit(0)
+        }
+
+    }
+
+    def main(args: Array[String]) {
+        val app = new Application {
+            Print(Gen())
+        }
+        app.emit("InPlaceTest")
+    }
+
+}
@@ -0,0 +1,49 @@
+package scalapipe.test
+
+import scalapipe.kernels._
+import scalapipe.dsl._
+
+object ParallelTest extends App {
+
+    val Gen = new Kernel("Gen") {
+        val y0 = output(UNSIGNED32)
+        val count = local(UNSIGNED32, 0)
+        if (count < 10) {
+            y0 = count
+            count += 1
+        } else {
+            stop
+        }
+    }
+
+    // Earlier items take longer, so replicas finish out of order.
+    val Work = new Kernel("Work") {
+        parallel(4)
+        val x0 = input(UNSIGNED32)
+        val y0 = output(UNSIGNED32)
+        val value = local(UNSIGNED32)
+        val state = local(UNSIGNED32)
+        val i = local(UNSIGNED32)
+        value = x0
+        state = 0
+        i = 0
+        while (i < (10 - value) * 100000) {
+            state = state * UNSIGNED32(69069) + UNSIGNED32(1)
+            i += 1
+        }
+        y0 = (value << 8) | (state >> 24)
+    }
+
+    val Print = new Kernel("Print") {
+        val x0 = input(UNSIGNED32)
+        val t = local(UNSIGNED32)
+        t = x0
+        stdio.printf("OUTPUT %d %d\n", t >> 8, t & 255)
+    }
+
+    val app = new Application {
+        Print(Work(Gen()))
+    }
+    app.emit("ParallelTest")
+
+}
@@ -28,12 +28,41 @@ object ReadTest {
 
     def main(args: Array[String]) {
         val mapping = args.headOption.getOrElse("0").toInt
+        val options = args.drop(1).headOption.getOrElse("none")
         val app = new Application {
             Print(Update(Gen()))
             mapping match {
                 case 0 => ()
                 case 1 => map(Update -> Print, FPGA2CPU())
             }
+            options match {
+                case "none" => ()
+                case "batch" =>
+                    // Batches larger than the queue.
+                    param('batchSize, 8)
+                    param(Gen -> Update, 'queueDepth, 4)
+                case "lockFree" =>
+                    // Depths are rounded up to a power of two.
+                    param('lockFree)
+                    param(Gen -> Update, 'queueDepth, 5)
+                case "block" =>
+                    // Short queues so that both sides block.
+                    param('wait, "block")
+                    param('queueDepth, 2)
+                case "fuse" =>
+                    param('fuse)
+                case "fuseBatch" =>
+                    param('fuse)
+                    param('batchSize, 8)
+                case "stats" =>
+                    param('clock, "sampled")
+                    param('metrics, 10)
+                    param('report, 10)
+                    param('counters)
+                    param('queueProfile, "queue.profile")
+                case "tune" =>
+                    param('queueTune, "queue.profile")
+            }
         }
         app.emit("ReadTest")
     }
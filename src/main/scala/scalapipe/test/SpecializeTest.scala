@@ -0,0 +1,21 @@
+package scalapipe.test
+
+import scalapipe.kernels._
+import scalapipe.dsl._
+
+object SpecializeTest extends App {
+
+    val Source = new MappedFileSource(UNSIGNED32)
+
+    val Print = new Kernel("Print") {
+        val x0 = input(UNSIGNED32)
+        stdio.printf("OUTPUT %d\n", x0)
+    }
+
+    val app = new Application {
+        param('specialize)
+        Print(Source('file -> "in.dat"))
+    }
+    app.emit("SpecializeTest")
+
+}
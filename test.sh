@@ -32,6 +32,24 @@ echo "OUTPUT 00080009"  >> test.expected
 rm -rf ReadTest
 run_test ReadTest 0
 run_test ReadTest 1
+run_test ReadTest 0 batch
+run_test ReadTest 0 lockFree
+run_test ReadTest 0 block
+run_test ReadTest 0 fuse
+run_test ReadTest 0 fuseBatch
+
+# Test statistics and size queues from the recorded profile.
+rm -rf ReadTest
+sbt "run-main scalapipe.test.ReadTest 0 stats"
+cd ReadTest
+make
+./proc_localhost | grep OUTPUT > ../test.out
+cp queue.profile ..
+cd ..
+cmp test.out test.expected
+rm -rf ReadTest
+run_test ReadTest 0 tune
+rm queue.profile
 
 
 # Test configuration parameters.
@@ -75,6 +93,91 @@ cd ..
 cmp test.out test.expected
 rm -rf SocketTest
 
+# Test shared memory edges.
+echo "OUTPUT 0"     >  test.expected
+echo "OUTPUT 1"     >> test.expected
+echo "OUTPUT 2"     >> test.expected
+echo "OUTPUT 3"     >> test.expected
+echo "OUTPUT 4"     >> test.expected
+echo "OUTPUT 5"     >> test.expected
+echo "OUTPUT 6"     >> test.expected
+echo "OUTPUT 7"     >> test.expected
+echo "OUTPUT 8"     >> test.expected
+echo "OUTPUT 9"     >> test.expected
+rm -rf ShmTest
+sbt "run-main scalapipe.test.ShmTest"
+cd ShmTest
+make
+./proc_localhost & ./proc_consumer > ../test.out
+wait
+cd ..
+cmp test.out test.expected
+rm -rf ShmTest
+
+# Test specialized kernels reading a mapped file.
+echo "OUTPUT 0"     >  test.expected
+echo "OUTPUT 1"     >> test.expected
+echo "OUTPUT 2"     >> test.expected
+echo "OUTPUT 3"     >> test.expected
+echo "OUTPUT 4"     >> test.expected
+echo "OUTPUT 5"     >> test.expected
+echo "OUTPUT 6"     >> test.expected
+echo "OUTPUT 7"     >> test.expected
+echo "OUTPUT 8"     >> test.expected
+echo "OUTPUT 9"     >> test.expected
+rm -rf SpecializeTest
+sbt "run-main scalapipe.test.SpecializeTest"
+cd SpecializeTest
+make
+for i in 0 1 2 3 4 5 6 7 8 9 ; do
+    printf "\\x0$i\\x00\\x00\\x00"
+done > in.dat
+./proc_localhost > ../test.out
+cd ..
+cmp test.out test.expected
+rm -rf SpecializeTest
+
+# Test streaming records to a file and back.
+echo "OUTPUT 1"     >  test.expected
+echo "OUTPUT 4"     >> test.expected
+echo "OUTPUT 7"     >> test.expected
+echo "OUTPUT 10"    >> test.expected
+echo "OUTPUT 13"    >> test.expected
+echo "OUTPUT 16"    >> test.expected
+echo "OUTPUT 19"    >> test.expected
+echo "OUTPUT 22"    >> test.expected
+echo "OUTPUT 25"    >> test.expected
+echo "OUTPUT 28"    >> test.expected
+rm -rf FileTest
+sbt "run-main scalapipe.test.FileTest write"
+cd FileTest
+make
+./proc_localhost
+mv data.bin ..
+cd ..
+rm -rf FileTest
+sbt "run-main scalapipe.test.FileTest read"
+cd FileTest
+make
+mv ../data.bin .
+./proc_localhost | grep OUTPUT > ../test.out
+cd ..
+cmp test.out test.expected
+rm -rf FileTest
+
+# Test replicas finishing out of order.
+echo "OUTPUT 0 48"      >  test.expected
+echo "OUTPUT 1 211"     >> test.expected
+echo "OUTPUT 2 193"     >> test.expected
+echo "OUTPUT 3 162"     >> test.expected
+echo "OUTPUT 4 76"      >> test.expected
+echo "OUTPUT 5 191"     >> test.expected
+echo "OUTPUT 6 42"      >> test.expected
+echo "OUTPUT 7 228"     >> test.expected
+echo "OUTPUT 8 115"     >> test.expected
+echo "OUTPUT 9 136"     >> test.expected
+run_test ParallelTest 0
+
 # Test cycles.
 echo "OUTPUT 1"     >  test.expected
 echo "OUTPUT 2"     >> test.expected
@@ -87,6 +190,7 @@ echo "OUTPUT 8"     >> test.expected
 echo "OUTPUT 9"     >> test.expected
 run_test CycleTest 0
 run_test CycleTest 1
+run_test CycleTest 0 workers
 
 # Test control structures.
 echo "OUTPUT 5" > test.expected
@@ -107,6 +211,19 @@ echo "OUTPUT 9: 72 73 74 75 76 77 78 79 "       >> test.expected
 run_test ArrayTest 0
 run_test ArrayTest 1
 
+# Test in-place port access.
+echo "OUTPUT 0: 0 1 2 3 4 5 6 7 "           >  test.expected
+echo "OUTPUT 1: 8 9 10 11 12 13 14 15 "     >> test.expected
+echo "OUTPUT 2: 16 17 18 19 20 21 22 23 "       >> test.expected
+echo "OUTPUT 3: 24 25 26 27 28 29 30 31 "       >> test.expected
+echo "OUTPUT 4: 32 33 34 35 36 37 38 39 "       >> test.expected
+echo "OUTPUT 5: 40 41 42 43 44 45 46 47 "       >> test.expected
+echo "OUTPUT 6: 48 49 50 51 52 53 54 55 "       >> test.expected
+echo "OUTPUT 7: 56 57 58 59 60 61 62 63 "       >> test.expected
+echo "OUTPUT 8: 64 65 66 67 68 69 70 71 "       >> test.expected
+echo "OUTPUT 9: 72 73 74 75 76 77 78 79 "       >> test.expected
+run_test InPlaceTest 0
+
 echo "OUTPUT 0"         >  test.expected
 echo "OUTPUT 2"         >> test.expected
 echo "OUTPUT 7"         >> test.expected